@@ -0,0 +1,103 @@
+#include "db.h"
+
+#include <pthread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+// Measures commit throughput with a write-ahead log for synchronous,
+// asynchronous and relaxed commits, as the number of client threads
+// grows. Each transaction updates a record of its own thread. A round
+// ends once every commit is durable.
+
+#define MAX_THREADS 64
+#define RECORDS_PER_THREAD 100
+
+static int64_t table_id;
+static int num_trx_per_thread, commit_mode;
+static std::atomic<long> committed;
+
+enum commit_mode_t {
+    COMMIT_SYNC,
+    COMMIT_ASYNC,
+    COMMIT_RELAXED,
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_commit(int trx_id, int result, void *) {
+    if (result == trx_id)
+        committed++;
+}
+
+static void * commit_bench_thread(void * arg) {
+    int64_t base_key = (int64_t)(size_t)arg * RECORDS_PER_THREAD, value;
+    uint16_t val_size;
+    int i, trx_id;
+
+    for (i = 0; i < num_trx_per_thread; i++) {
+        trx_id = trx_begin();
+        value = i;
+        if (db_update(table_id, base_key + i % RECORDS_PER_THREAD, (char *)&value, sizeof(value),
+                      &val_size, trx_id) != 0)
+            continue;
+        if (commit_mode == COMMIT_SYNC)
+            count_commit(trx_id, trx_commit(trx_id), NULL);
+        else
+            trx_commit_async(trx_id, count_commit, NULL, commit_mode == COMMIT_RELAXED);
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    num_trx_per_thread = argc > 2 ? atoi(argv[2]) : 2000;
+    pthread_t threads[MAX_THREADS];
+    double start, elapsed;
+    int64_t key, value = 0;
+    int i, num_threads;
+    const char * mode_names[] = { "sync", "async", "relaxed" };
+    const char * path = "commit_bench.db";
+    const char * log_path = "commit_bench.log";
+
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+    remove(path);
+    remove(log_path);
+    if (init_db(1000, log_path) != 0) {
+        fprintf(stderr, "cannot open %s\n", log_path);
+        return 1;
+    }
+    table_id = open_table(path, sizeof(value));
+    if (table_id < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    for (key = 0; key < (int64_t)max_threads * RECORDS_PER_THREAD; key++)
+        db_insert(table_id, key, (const char *)&value, sizeof(value));
+
+    printf("%-10s %8s %12s\n", "commit", "threads", "Ktrx/s");
+    for (commit_mode = COMMIT_SYNC; commit_mode <= COMMIT_RELAXED; commit_mode++)
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        committed = 0;
+        start = now_sec();
+        for (i = 0; i < num_threads; i++)
+            pthread_create(&threads[i], NULL, commit_bench_thread, (void *)(size_t)i);
+        for (i = 0; i < num_threads; i++)
+            pthread_join(threads[i], NULL);
+        trx_flush_commits();
+        elapsed = now_sec() - start;
+        printf("%-10s %8d %12.2f\n", mode_names[commit_mode], num_threads,
+                committed / elapsed / 1e3);
+    }
+
+    shutdown_db();
+    remove(path);
+    remove(log_path);
+    return 0;
+}
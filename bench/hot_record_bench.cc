@@ -0,0 +1,116 @@
+#include "db.h"
+
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Measures commit throughput on a single hot record with a write-ahead
+// log, with locks released after the commit is durable and released
+// early, as the number of threads grows. Each transaction increments the
+// record and commits. A transaction whose snapshot is older than the last
+// commit of the record when it gets the lock aborts, and is retried.
+
+#define MAX_THREADS 64
+
+static int64_t table_id;
+static int num_trx_per_thread;
+
+struct hot_record_result_t {
+    long committed;
+    long aborted;
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Increment the record. Return non-zero if the transaction was aborted.
+static int increment() {
+    int64_t counter;
+    uint16_t val_size;
+    int trx_id;
+
+    trx_id = trx_begin();
+    if (db_find_for_update(table_id, 0, (char *)&counter, &val_size, trx_id) != 0)
+        return 1;
+    counter++;
+    if (db_update(table_id, 0, (char *)&counter, sizeof(counter), &val_size, trx_id) != 0)
+        return 1;
+    return trx_commit(trx_id) != trx_id;
+}
+
+static void * hot_record_thread(void * arg) {
+    struct hot_record_result_t * result = (struct hot_record_result_t *)arg;
+    int i;
+
+    for (i = 0; i < num_trx_per_thread; i++) {
+        while (increment() != 0)
+            result->aborted++;
+        result->committed++;
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    num_trx_per_thread = argc > 2 ? atoi(argv[2]) : 500;
+    struct hot_record_result_t results[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    long committed, aborted;
+    double start, elapsed;
+    int64_t counter = 0;
+    uint16_t val_size;
+    int i, num_threads, early, trx_id;
+    const char * path = "hot_record_bench.db";
+    const char * log_path = "hot_record_bench.log";
+
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+    remove(path);
+    remove(log_path);
+    if (init_db(100, log_path) != 0) {
+        fprintf(stderr, "cannot open %s\n", log_path);
+        return 1;
+    }
+    table_id = open_table(path, sizeof(counter));
+    if (table_id < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    db_insert(table_id, 0, (const char *)&counter, sizeof(counter));
+
+    printf("%-14s %8s %12s %12s\n", "release", "threads", "Ktrx/s", "aborts");
+    for (early = 0; early <= 1; early++)
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        lock_set_early_release(early);
+        start = now_sec();
+        for (i = 0; i < num_threads; i++) {
+            results[i].committed = results[i].aborted = 0;
+            pthread_create(&threads[i], NULL, hot_record_thread, &results[i]);
+        }
+        committed = aborted = 0;
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            committed += results[i].committed;
+            aborted += results[i].aborted;
+        }
+        elapsed = now_sec() - start;
+        printf("%-14s %8d %12.2f %12ld\n", early ? "pre-commit" : "after-durable", num_threads,
+                committed / elapsed / 1e3, aborted);
+    }
+
+    // Every committed increment is there.
+    trx_id = trx_begin();
+    db_find(table_id, 0, (char *)&counter, &val_size, trx_id);
+    trx_commit(trx_id);
+    printf("counter %ld\n", (long)counter);
+
+    shutdown_db();
+    remove(path);
+    remove(log_path);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "db.h"
+
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+// Measures lock manager throughput as the number of threads grows. Each
+// transaction locks a few random records spread over some pages and
+// commits. Run with a single page to measure a hot page. Every deadlock
+// policy is measured unless one is given, with and without the lock word
+// fast path unless one is chosen. The lock statistics of the run and its
+// hottest keys are printed at the end.
+
+#define MAX_THREADS 64
+#define LOCKS_PER_TRX 8
+
+static int num_trx_per_thread, num_pages, keys_per_page, write_percent;
+
+struct lock_bench_result_t {
+    long acquired;
+    long aborted;
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * lock_bench_thread(void * arg) {
+    struct lock_bench_result_t * result = (struct lock_bench_result_t *)arg;
+    unsigned int seed = (unsigned int)(size_t)arg;
+    int i, j, trx_id, lock_mode;
+    pagenum_t pagenum;
+
+    for (i = 0; i < num_trx_per_thread; i++) {
+        trx_id = trx_begin();
+        for (j = 0; j < LOCKS_PER_TRX; j++) {
+            pagenum = rand_r(&seed) % num_pages;
+            lock_mode = (int)(rand_r(&seed) % 100) < write_percent;
+            if (lock_acquire(1, pagenum, pagenum * keys_per_page + rand_r(&seed) % keys_per_page, trx_id, lock_mode) == NULL)
+                break;
+            result->acquired++;
+        }
+        if (j < LOCKS_PER_TRX)
+            result->aborted++;
+        else
+            trx_commit(trx_id);
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+    num_trx_per_thread = argc > 2 ? atoi(argv[2]) : 20000;
+    num_pages = argc > 3 ? atoi(argv[3]) : 1000;
+    write_percent = argc > 4 ? atoi(argv[4]) : 20;
+    keys_per_page = argc > 5 ? atoi(argv[5]) : 100;
+    struct lock_bench_result_t results[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    long acquired, aborted;
+    double start, elapsed;
+    int i, num_threads, policy, fast_path;
+    int first_policy = argc > 6 ? atoi(argv[6]) : DEADLOCK_DETECT;
+    int last_policy = argc > 6 ? first_policy : DEADLOCK_WOUND_WAIT;
+    int first_fast_path = argc > 7 ? atoi(argv[7]) != 0 : 0;
+    int last_fast_path = argc > 7 ? first_fast_path : 1;
+    const char * policy_names[] = { "detect", "timeout", "no-wait", "wait-die", "wound-wait" };
+
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+    init_db(100);
+
+    printf("%-12s %6s %8s %14s %12s\n", "policy", "fast", "threads", "Mlock/s", "aborts");
+    for (policy = first_policy; policy <= last_policy; policy++)
+    for (fast_path = first_fast_path; fast_path <= last_fast_path; fast_path++)
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        lock_set_deadlock_policy(policy, 10);
+        lock_set_fast_path(fast_path);
+        start = now_sec();
+        for (i = 0; i < num_threads; i++) {
+            results[i].acquired = results[i].aborted = 0;
+            pthread_create(&threads[i], NULL, lock_bench_thread, &results[i]);
+        }
+        acquired = aborted = 0;
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            acquired += results[i].acquired;
+            aborted += results[i].aborted;
+        }
+        elapsed = now_sec() - start;
+        printf("%-12s %6s %8d %14.2f %12ld\n", policy_names[policy], fast_path ? "on" : "off",
+                num_threads, acquired / elapsed / 1e6, aborted);
+    }
+
+    // Contention of the whole run, and its hottest keys.
+    printf("\n");
+    db_print_lock_stats(stdout, 5);
+
+    shutdown_db();
+    return 0;
+}
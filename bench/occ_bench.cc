@@ -0,0 +1,128 @@
+#include "db.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Compares optimistic and locking transactions on a bank transfer
+// workload as the number of accounts, and so the contention, changes.
+// Each transaction moves money between two random accounts, and is
+// retried until it commits.
+
+#define MAX_THREADS 64
+#define INITIAL_BALANCE 1000000
+
+static int64_t table_id;
+static int num_accounts, num_trx_per_thread, optimistic;
+
+struct occ_bench_result_t {
+    long committed;
+    long aborted;
+};
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Move an amount between two accounts. Return non-zero if the
+// transaction was aborted.
+static int transfer(int64_t from, int64_t to, int64_t amount) {
+    int64_t keys[2] = { from, to }, balance;
+    uint16_t val_size;
+    int trx_id, i;
+
+    trx_id = optimistic ? trx_begin_optimistic() : trx_begin();
+    for (i = 0; i < 2; i++) {
+        if (optimistic) {
+            if (db_find(table_id, keys[i], (char *)&balance, &val_size, trx_id) != 0)
+                break;
+        } else if (db_find_for_update(table_id, keys[i], (char *)&balance, &val_size, trx_id) != 0) {
+            return 1;
+        }
+        balance += i == 0 ? -amount : amount;
+        if (db_update(table_id, keys[i], (char *)&balance, sizeof(balance), &val_size, trx_id) != 0)
+            break;
+    }
+    if (i < 2) {
+        trx_abort(trx_id);
+        return 1;
+    }
+    return trx_commit(trx_id) != trx_id;
+}
+
+static void * occ_bench_thread(void * arg) {
+    struct occ_bench_result_t * result = (struct occ_bench_result_t *)arg;
+    unsigned int seed = (unsigned int)(size_t)arg;
+    int64_t from, to, amount;
+    int i;
+
+    for (i = 0; i < num_trx_per_thread; i++) {
+        from = rand_r(&seed) % num_accounts;
+        do {
+            to = rand_r(&seed) % num_accounts;
+        } while (to == from);
+        amount = rand_r(&seed) % 100;
+        // Let the transaction in the way finish before retrying.
+        while (transfer(from, to, amount) != 0) {
+            result->aborted++;
+            sched_yield();
+        }
+        result->committed++;
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int num_threads = argc > 1 ? atoi(argv[1]) : 8;
+    num_trx_per_thread = argc > 2 ? atoi(argv[2]) : 20000;
+    int account_counts[] = { 10, 100, 10000 };
+    struct occ_bench_result_t results[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    long committed, aborted;
+    double start, elapsed;
+    int64_t balance;
+    int i, c;
+    const char * path = "occ_bench.db";
+
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    remove(path);
+    init_db(1000);
+    table_id = open_table(path, sizeof(balance));
+    if (table_id < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    balance = INITIAL_BALANCE;
+    for (i = 0; i < 10000; i++)
+        db_insert(table_id, i, (const char *)&balance, sizeof(balance));
+
+    printf("%-12s %10s %14s %12s\n", "mode", "accounts", "Ktrx/s", "aborts");
+    for (c = 0; c < (int)(sizeof(account_counts) / sizeof(account_counts[0])); c++)
+    for (optimistic = 0; optimistic <= 1; optimistic++) {
+        num_accounts = account_counts[c];
+        start = now_sec();
+        for (i = 0; i < num_threads; i++) {
+            results[i].committed = results[i].aborted = 0;
+            pthread_create(&threads[i], NULL, occ_bench_thread, &results[i]);
+        }
+        committed = aborted = 0;
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            committed += results[i].committed;
+            aborted += results[i].aborted;
+        }
+        elapsed = now_sec() - start;
+        printf("%-12s %10d %14.1f %12ld\n", optimistic ? "optimistic" : "locking",
+                num_accounts, committed / elapsed / 1e3, aborted);
+    }
+
+    shutdown_db();
+    remove(path);
+    return 0;
+}
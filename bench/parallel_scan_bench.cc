@@ -0,0 +1,71 @@
+#include "db.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// Measures db_parallel_scan throughput over a cached table as the number
+// of workers grows.
+
+#define MAX_WORKERS 64
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Per-worker checksum, padded to keep workers off each other's cache lines.
+struct worker_sum_t {
+    int64_t sum;
+    int8_t pad[56];
+};
+
+static void sum_values(int worker, int64_t key, const char * value,
+                        uint16_t, void * arg) {
+    struct worker_sum_t * sums = (struct worker_sum_t *)arg;
+    int64_t v;
+    memcpy(&v, value, sizeof(v));
+    sums[worker].sum += key ^ v;
+}
+
+int main(int argc, char ** argv) {
+    int num_records = argc > 1 ? atoi(argv[1]) : 500000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int num_rounds = argc > 3 ? atoi(argv[3]) : 5;
+    int i, r, threads, found;
+    int64_t value;
+    double start, elapsed;
+    static struct worker_sum_t sums[MAX_WORKERS];
+    const char * path = "parallel_scan_bench.db";
+
+    if (max_threads > MAX_WORKERS)
+        max_threads = MAX_WORKERS;
+    remove(path);
+    init_db(num_records / 20 + 1000);
+    int64_t table_id = open_table(path, 8);
+    if (table_id < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+    for (i = 0; i < num_records; i++) {
+        value = (int64_t)i * 7;
+        db_insert(table_id, i, (const char *)&value, sizeof(value));
+    }
+
+    printf("%8s %12s %14s\n", "threads", "ms", "Mrec/s");
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        start = now_sec();
+        for (r = 0; r < num_rounds; r++) {
+            memset(sums, 0, sizeof(sums));
+            found = db_parallel_scan(table_id, 0, num_records - 1, threads, sum_values, sums);
+        }
+        elapsed = (now_sec() - start) / num_rounds;
+        printf("%8d %12.3f %14.1f\n", threads, elapsed * 1e3, found / elapsed / 1e6);
+    }
+
+    shutdown_db();
+    remove(path);
+    return 0;
+}
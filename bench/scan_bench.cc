@@ -0,0 +1,86 @@
+#include "db.h"
+#include "file.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Compares full-record and key-only scans over the slotted (row) layout,
+// the dense (PAX) layout and the dense layout with compressed keys.
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct layout_bench_t {
+    const char * name;
+    uint16_t fixed_val_size;
+    int compress_keys;
+    int64_t table_id;
+};
+
+int main(int argc, char ** argv) {
+    int num_records = argc > 1 ? atoi(argv[1]) : 200000;
+    int num_rounds = argc > 2 ? atoi(argv[2]) : 10;
+    int i, r, found;
+    char value[8];
+    double start, record_time, key_time;
+    std::vector<int64_t> keys;
+    std::vector<char *> values;
+    std::vector<uint16_t> val_sizes;
+    struct table_stats_t stats;
+    struct layout_bench_t layouts[] = {
+        { "row", 0, 0, -1 },
+        { "pax", 8, 0, -1 },
+        { "pax+for", 8, 1, -1 },
+    };
+
+    printf("%-8s %8s %14s %14s %14s\n", "layout", "leaves", "records ms", "keys ms", "keys Mkey/s");
+    for (auto & layout : layouts) {
+        // Each layout gets a buffer pool of its own that holds the whole table.
+        std::string path = std::string("scan_bench_") + layout.name + ".db";
+        remove(path.c_str());
+        init_db(num_records / 20 + 1000);
+        layout.table_id = open_table(path.c_str(), layout.fixed_val_size,
+                                        layout.compress_keys);
+        if (layout.table_id < 0) {
+            fprintf(stderr, "cannot open %s\n", path.c_str());
+            return 1;
+        }
+        for (i = 0; i < num_records; i++) {
+            memcpy(value, &i, sizeof(i));
+            memset(value + sizeof(i), 0, sizeof(value) - sizeof(i));
+            db_insert(layout.table_id, i, value, sizeof(value));
+        }
+        db_table_stats(layout.table_id, &stats);
+
+        start = now_sec();
+        for (r = 0; r < num_rounds; r++) {
+            keys.clear(), values.clear(), val_sizes.clear();
+            found = db_scan(layout.table_id, 0, num_records, &keys, &values, &val_sizes);
+            for (i = 0; i < found; i++)
+                free(values[i]);
+        }
+        record_time = (now_sec() - start) / num_rounds;
+
+        start = now_sec();
+        for (r = 0; r < num_rounds; r++) {
+            keys.clear();
+            found = db_scan_keys(layout.table_id, 0, num_records, &keys);
+        }
+        key_time = (now_sec() - start) / num_rounds;
+
+        printf("%-8s %8lu %14.3f %14.3f %14.1f\n", layout.name,
+                (unsigned long)stats.num_leaves, record_time * 1e3, key_time * 1e3,
+                found / key_time / 1e6);
+
+        shutdown_db();
+        remove(path.c_str());
+    }
+    return 0;
+}
@@ -17,6 +17,50 @@ typedef struct header_page_t header_node;
 typedef struct leaf_page_t leaf_node;
 typedef struct internal_page_t node;
 
+// Statistics of a table gathered by walking its leaves.
+struct table_stats_t {
+    int height;
+    uint64_t num_leaves;
+    uint64_t num_records;
+    uint64_t key_bytes;         // Bytes the leaves spend on keys.
+    uint64_t raw_key_bytes;     // Bytes of the keys at 8 bytes each.
+    double key_compression_ratio;
+};
+
+// Filters of a range scan, evaluated on each leaf while it is latched.
+struct scan_filter_t {
+    // Keep a record only if the pred_len bytes at pred_offset of its value
+    // compare between pred_low and pred_high, inclusive (memcmp order).
+    // A NULL bound is open, and pred_len 0 disables the predicate.
+    uint16_t pred_offset;
+    uint16_t pred_len;
+    const char * pred_low;
+    const char * pred_high;
+    // Return only proj_len bytes at proj_offset of each value, clipped to
+    // the value. proj_len 0 returns the whole value.
+    uint16_t proj_offset;
+    uint16_t proj_len;
+    // Stop after this many records. 0 means no limit.
+    int limit;
+};
+
+// Called for each record of a parallel scan by the worker that found it.
+// The value points into the latched leaf frame and is only valid during
+// the call.
+typedef void (*scan_callback_t)(int worker, int64_t key, const char * value,
+                                uint16_t val_size, void * arg);
+
+
+
+// Latch of the tree structures. Insertions and deletions hold it
+// exclusively, and lookups through find_leaf hold it shared, since a split
+// or merge moves records between leaves.
+extern pthread_rwlock_t tree_latch;
+
+// Number of pages the trees gave back, changed under tree_latch held
+// exclusively. A leaf remembered with the count still belongs to its tree
+// as long as the count has not changed.
+extern uint64_t tree_free_count;
 
 
 // FUNCTION PROTOTYPES.
@@ -25,15 +69,32 @@ typedef struct internal_page_t node;
 
 void print_bpt( int64_t table_id );
 void print_leaves( int64_t table_id );
+int get_table_stats( int64_t table_id, struct table_stats_t * stats );
 int find_range( int64_t table_id, int64_t begin_key, int64_t end_key, 
                 std::vector<int64_t>* keys, std::vector<char*>* values,
                 std::vector<uint16_t>* val_sizes);
+int find_range_filtered( int64_t table_id, int64_t begin_key, int64_t end_key,
+                        const struct scan_filter_t * filter,
+                        std::vector<int64_t>* keys, std::vector<char*>* values,
+                        std::vector<uint16_t>* val_sizes);
+int find_range_separators( int64_t table_id, int64_t begin_key, int64_t end_key,
+                            int num_parts, std::vector<int64_t>* separators);
+int find_range_parallel( int64_t table_id, int64_t begin_key, int64_t end_key,
+                            int num_threads, scan_callback_t callback, void * arg);
+int find_range_reverse( int64_t table_id, int64_t begin_key, int64_t end_key, int limit,
+                        std::vector<int64_t>* keys, std::vector<char*>* values,
+                        std::vector<uint16_t>* val_sizes);
+int find_range_keys( int64_t table_id, int64_t begin_key, int64_t end_key,
+                        std::vector<int64_t>* keys);
 pagenum_t find_leaf( int64_t table_id, int64_t key);
 int find( int64_t table_id, int64_t key, char * ret_val, uint16_t * val_size);
 int64_t read_leaf_key(leaf_node * leaf, int i);
 uint16_t read_leaf_val_size(leaf_node * leaf, int i);
 uint16_t read_leaf_offset(leaf_node * leaf, int i);
 void read_leaf_value(leaf_node * leaf, char * ret_val, int i);
+void read_leaf_keys(leaf_node * leaf, int from, int to, int64_t * keys);
+int leaf_lower_bound(leaf_node * leaf, int64_t key);
+int leaf_has_room(leaf_node * leaf, int64_t key, uint16_t val_size);
 uint64_t read_temp_body_key(uint8_t * body, int i);
 uint16_t read_temp_body_val_size(uint8_t * body, int i);
 uint16_t read_temp_body_offset(uint8_t * body, int i);
@@ -70,7 +131,7 @@ int insert(int64_t table_id, int64_t key, const char* value,
 
 int get_neighbor_index(int64_t table_id, pagenum_t n_pagenum);
 int adjust_root(int64_t table_id, pagenum_t root_pagenum);
-void remove_entry_from_node(int64_t table_id, pagenum_t n_pagenum, int key);
+void remove_entry_from_node(int64_t table_id, pagenum_t n_pagenum, int64_t key);
 int coalesce_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbor_pagenum, 
                     int neighbor_index, int64_t k_prime);
 int coalesce_leaf_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbor_pagenum,
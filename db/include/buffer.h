@@ -5,6 +5,10 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+
+#include <unordered_map>
+#include <utility>
+
 #include "file.h"
 
 struct buffer_t {
@@ -12,15 +16,26 @@ struct buffer_t {
     int64_t table_id;
     pagenum_t pagenum;
     int is_dirty;
+    // Changed by an operation whose log records are not written yet.
+    int op_pending;
     pthread_mutex_t page_latch;
     struct buffer_t * next;
     struct buffer_t * prev;
 };
 
+// For using (table id, page number) as a hash key.
+struct buffer_page_hash {
+    std::size_t operator()(const std::pair<int64_t, pagenum_t> &page) const {
+        return std::hash<int64_t>()(page.first) ^ (std::hash<pagenum_t>()(page.second) << 1);
+    }
+};
+
 struct buffer_pool {
     struct buffer_t * list;
     int num_buf;
     struct buffer_t * LRU_begin, * LRU_end;
+    // Index of the frame holding each cached page.
+    std::unordered_map<std::pair<int64_t, pagenum_t>, int, buffer_page_hash> page_table;
 };
 
 // Check the page and return if it exists.
@@ -41,6 +56,15 @@ struct page_t * buffer_read_page(int64_t table_id, pagenum_t pagenum);
 // Write an in-memory page(src) to the on-disk page
 void buffer_write_page(struct page_t * dirty_page);
 
+// Mark a page dirty whose change is already logged, and unpin it.
+void buffer_write_logged_page(struct page_t * dirty_page);
+
+// Return a page freed by a finished operation to the free page list.
+void buffer_free_file_page(int64_t table_id, pagenum_t pagenum);
+
+// Write every dirty page and forget every cached page.
+void buffer_flush_all();
+
 // Initalizing.
 void buffer_init(int num_buf);
 
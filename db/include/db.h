@@ -7,30 +7,96 @@
 #include "trx.h"
 
 // Open an existing database file or create one if not exist.
-int64_t open_table(const char* pathname);
+// A non-zero fixed_val_size makes every record of the table exactly that
+// size and lets leaves use the dense layout. It is recorded in the header
+// page and can only be set while the table is empty.
+// compress_keys additionally stores the keys of each dense leaf as 32-bit
+// deltas from a per-leaf base key whenever they span less than 2^32. It
+// only applies to dense leaves, so it fails without a fixed_val_size.
+int64_t open_table(const char* pathname, uint16_t fixed_val_size = 0,
+                    int compress_keys = 0);
 
 // Insert a record to the given table.
+// With a trx_id, the key stays exclusively locked until the transaction
+// ends, snapshots taken before its commit do not see the record, and the
+// insertion is undone if the transaction aborts. Without one, the
+// insertion is durable once it returns, and it returns -1 if the log could
+// not be written.
 int db_insert(int64_t table_id, int64_t key, const char* value,
-uint16_t val_size);
+uint16_t val_size, int trx_id = 0);
 
-// Find a record with the matching key from the given table.
+// Find a record with the matching key from the given table, as of the
+// start of the transaction. It takes no lock, so it never waits for writers.
 int db_find(int64_t table_id, int64_t key, char* ret_val,
 uint16_t* val_size, int trx_id);
 
-// Update a record with the matching key from the given table.
+// Find a record with the matching key from the given table, for updating
+// it later in the same transaction. Readers are not blocked, but other
+// transactions finding the record for update wait until this one ends.
+// A missing key is locked too, so no other transaction can insert it.
+int db_find_for_update(int64_t table_id, int64_t key, char* ret_val,
+uint16_t* val_size, int trx_id);
+
+// Update a record with the matching key from the given table. The new
+// value may have another size, unless the table has fixed-size values.
 int db_update(int64_t table_id, int64_t key, char* value, 
                 uint16_t new_val_size, uint16_t* old_val_size, int trx_id);
 
 // Delete a record with the matching key from the given table.
-int db_delete(int64_t table_id, int64_t key);
+// With a trx_id, it is locked and undone like a transactional insertion,
+// and snapshots taken before the commit still see the deleted value.
+// Without one, the deletion is durable once it returns, and it returns -1
+// if the log could not be written.
+int db_delete(int64_t table_id, int64_t key, int trx_id = 0);
 
 // Find records with a key between the range: 𝑏𝑒𝑔𝑖𝑛_𝑘𝑒y ≤ 𝑘𝑒𝑦 ≤ 𝑒𝑛𝑑_𝑘𝑒𝑦
+// With a trx_id, the range is share-locked until the trx ends, so no other
+// trx can change, insert or delete a record in it.
 int db_scan(int64_t table_id, int64_t begin_key, int64_t end_key, 
                 std::vector<int64_t>* keys, std::vector<char*>* values,
-                std::vector<uint16_t>* val_sizes);
+                std::vector<uint16_t>* val_sizes, int trx_id = 0);
+
+// Find records with a key between the range: begin_key ≤ key ≤ end_key
+// that pass the predicate of the filter, returning only the projected part
+// of each value and at most filter->limit records.
+int db_scan_filter(int64_t table_id, int64_t begin_key, int64_t end_key,
+                    const struct scan_filter_t * filter,
+                    std::vector<int64_t>* keys, std::vector<char*>* values,
+                    std::vector<uint16_t>* val_sizes);
+
+// Scan records with a key between the range: begin_key ≤ key ≤ end_key
+// with up to num_threads threads, passing each record to callback.
+int db_parallel_scan(int64_t table_id, int64_t begin_key, int64_t end_key,
+                        int num_threads, scan_callback_t callback, void * arg);
+
+// Find records with a key between the range: begin_key ≤ key ≤ end_key
+// in descending key order, returning at most limit records (0: no limit).
+int db_scan_reverse(int64_t table_id, int64_t begin_key, int64_t end_key, int limit,
+                    std::vector<int64_t>* keys, std::vector<char*>* values,
+                    std::vector<uint16_t>* val_sizes);
+
+// Find the keys between the range: begin_key ≤ key ≤ end_key, without
+// reading the values.
+int db_scan_keys(int64_t table_id, int64_t begin_key, int64_t end_key,
+                    std::vector<int64_t>* keys);
+
+// Gather leaf statistics of the given table.
+int db_table_stats(int64_t table_id, struct table_stats_t * stats);
+
+// Gather contention statistics of the lock manager since init_db.
+int db_lock_stats(struct lock_stats_t * stats);
+
+// Find up to limit records, blocks or tables with the longest total lock
+// wait, longest first. Returns the number found.
+int db_lock_hot_keys(int limit, std::vector<struct lock_key_stats_t>* keys);
+
+// Print the lock statistics and up to limit hot keys to out.
+void db_print_lock_stats(FILE* out, int limit);
 
 // Initialize the database system.
-int init_db(int num_buf);
+// With a log_path, changes are logged to that file before the pages are
+// written, and the tables are first recovered from the log left by a crash.
+int init_db(int num_buf, const char* log_path = NULL);
 
 // Shutdown the database system.
 int shutdown_db();
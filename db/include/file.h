@@ -36,6 +36,12 @@ void file_read_page(int64_t table_id, pagenum_t pagenum, struct page_t* dest);
 // Write an in-memory page(src) to the on-disk page
 void file_write_page(int64_t table_id, pagenum_t pagenum, const struct page_t* src);
 
+// Let data pages reach the disk lazily, or force every write
+void file_set_lazy_writes(int lazy);
+
+// Force the pages written so far to the disk
+void file_sync_table_files();
+
 // Close the database file
 void file_close_table_file();
 
@@ -0,0 +1,89 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "page.h"
+
+// Types of log records.
+enum log_type_t {
+    LOG_TABLE = 1,      // A table id was given to a table file.
+    LOG_PAGE,           // After image of a page changed by an operation.
+    LOG_OP_END,         // Every page image of an operation is logged.
+    LOG_UPDATE,         // A transaction changed the value of a record.
+    LOG_COMMIT,
+    LOG_ABORT,
+    LOG_INSERT,         // A transaction inserted a record.
+    LOG_DELETE,         // A transaction deleted a record.
+};
+
+// Header of a log record, followed by its payload:
+// LOG_TABLE: the path of the table file.
+// LOG_PAGE: the page.
+// LOG_UPDATE: the value before and the value after the update.
+// LOG_INSERT: the value after. LOG_DELETE: the value before.
+struct log_record_t {
+    uint64_t lsn;
+    uint32_t size;
+    uint32_t checksum;
+    int32_t type;
+    // Transaction id, or operation id of LOG_PAGE and LOG_OP_END.
+    int32_t trx_id;
+    int64_t table_id;
+    pagenum_t pagenum;
+    int64_t key;
+    uint16_t before_size;
+    uint16_t after_size;
+    uint32_t reserved;
+};
+
+/* APIs for Log Manager */
+
+// Open the log file, recover the tables it covers and start a new log.
+int log_open(const char *pathname);
+
+// Write the whole log, make the tables durable and close the log.
+void log_close();
+
+// Make every log record up to the one at lsn durable. Returns -1 if the
+// log could not be written, and the records stay in the log buffer.
+int log_flush(uint64_t lsn);
+
+// Log the table file given to a table id.
+void log_table(int64_t table_id, const char *pathname);
+
+// Log an update of a record, and return its LSN.
+uint64_t log_update(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key,
+                    const char *before, uint16_t before_size,
+                    const char *after, uint16_t after_size);
+
+// Log an insertion or a deletion of a record by a transaction, ahead of
+// the operation that makes it, and return its LSN.
+uint64_t log_insert(int trx_id, int64_t table_id, int64_t key,
+                    const char *value, uint16_t val_size);
+uint64_t log_delete(int trx_id, int64_t table_id, int64_t key,
+                    const char *value, uint16_t val_size);
+
+// Log the end of a transaction, and return its LSN.
+uint64_t log_commit(int trx_id);
+uint64_t log_abort(int trx_id);
+
+// Start an operation of the calling thread. Pages it changes are logged
+// as a whole when it ends, and do not reach the disk before that.
+void log_op_begin();
+
+// Log every page the operation of the calling thread changed, and return
+// the LSN of the end of the operation, or 0 if nothing was logged.
+uint64_t log_op_end();
+
+// Log a changed page, or add it to the operation of the calling thread.
+void log_page_write(int64_t table_id, pagenum_t pagenum, struct page_t *page,
+                    int *op_pending);
+
+// Keep a page freed by the operation of the calling thread until the
+// operation is logged. Return non-zero if the page can be freed now.
+int log_defer_free(int64_t table_id, pagenum_t pagenum);
+
+#endif /* __LOG_H__ */
@@ -7,6 +7,11 @@
 
 #define LEAF_SPACE_AMOUNT 3968
 #define INTERNAL_ORDER 248
+#define MAX_VAL_SIZE 120
+
+// Every header, internal and leaf page keeps the LSN of the last log record
+// that changed it at the same offset.
+#define PAGE_LSN_OFFSET 104
 
 typedef uint64_t pagenum_t;
 
@@ -21,8 +26,12 @@ struct header_page_t {
     pagenum_t free_page_num;
     uint64_t page_count;
     pagenum_t root_page_num;
+    uint16_t fixed_val_size;
+    uint16_t compress_keys;
 
-    int8_t reserved[4064]; 
+    int8_t reserved[68];
+    uint64_t page_lsn;
+    int8_t reserved2[3984];
 };
 
 struct leaf_page_t {
@@ -30,7 +39,16 @@ struct leaf_page_t {
     uint32_t is_leaf;
     uint32_t num_keys;
 
-    int8_t reserved[96];
+    // Non-zero for dense leaves of a fixed-value-size table.
+    uint16_t fixed_val_size;
+    uint16_t dense_capacity;
+    // Keys of a dense leaf are 8 bytes, or 4-byte deltas from key_base.
+    uint16_t key_width;
+    uint16_t compress_keys;
+    int64_t key_base;
+    pagenum_t left_sibling_page_num;
+    int8_t reserved[64];
+    uint64_t page_lsn;
 
     uint64_t free_space_amount;
     pagenum_t right_sibling_page_num;
@@ -43,11 +61,23 @@ struct internal_page_t {
     uint32_t is_leaf;
     uint32_t num_keys;
 
-    int8_t reserved[104];
+    int8_t reserved[88];
+    uint64_t page_lsn;
+    int8_t reserved2[8];
 
     pagenum_t leftmost_page_num;
 
     int64_t entries[496];
 };
 
+// Read the LSN of a header, internal or leaf page.
+static inline uint64_t page_get_lsn(const struct page_t *page) {
+    return *(const uint64_t *)((const int8_t *)page + PAGE_LSN_OFFSET);
+}
+
+// Set the LSN of a header, internal or leaf page.
+static inline void page_set_lsn(struct page_t *page, uint64_t lsn) {
+    *(uint64_t *)((int8_t *)page + PAGE_LSN_OFFSET) = lsn;
+}
+
 #endif
\ No newline at end of file
@@ -14,11 +14,18 @@
 
 typedef struct lock_t lock_t;
 typedef struct lock_table_t lock_table_t;
+typedef struct lock_bucket_t lock_bucket_t;
 
 // Struct of lock object.
 struct lock_t {
+    int64_t table_id;
     int64_t key;
+    int level;
+    pagenum_t pagenum;
     int lock_mode;
+    // Granted on a lock word. Such a lock joins a queue only when another
+    // request for its record needs one.
+    int fast;
 
     lock_t *prev;
     lock_t *next;
@@ -28,22 +35,138 @@ struct lock_t {
     int trx_id;
     lock_t *next_trx_lock;
 
-    char *original_value;
+    // Signaled when the lock is granted to a waiting request.
+    pthread_cond_t cond;
 };
 
-// Struct of lock table elements.
+// Struct of lock table elements, one queue per record, block or table.
 struct lock_table_t {
     int64_t table_id;
-    pagenum_t pagenum;
+    int64_t key;
+    int level;
     lock_t *tail;
     lock_t *head;
+    int length;
+    lock_bucket_t *bucket;
+};
+
+// Lock modes. An update lock is shared with readers but not with other
+// updaters, so read-modify-write transactions do not deadlock upgrading.
+// Intention modes are taken on tables and blocks above a record lock.
+enum lock_mode_t {
+    LOCK_SHARED,
+    LOCK_EXCLUSIVE,
+    LOCK_UPDATE,
+    LOCK_INTENTION_SHARED,
+    LOCK_INTENTION_EXCLUSIVE,
+    LOCK_SHARED_INTENTION_EXCLUSIVE,
+};
+
+// Levels of the lock hierarchy. A block is a range of keys of a table, so
+// it keeps covering the same records when leaves split or merge.
+enum lock_level_t {
+    LOCK_LEVEL_RECORD,
+    LOCK_LEVEL_BLOCK,
+    LOCK_LEVEL_TABLE,
+};
+
+// Number of low key bits that select a record within its block.
+#define LOCK_BLOCK_SHIFT 8
+
+// Changes of a record to undo on abort. An insertion after a deletion in
+// the same transaction is an update of the deleted value.
+enum undo_type_t {
+    UNDO_NONE,
+    UNDO_UPDATE,        // Write the value before back.
+    UNDO_INSERT,        // Delete the record.
+    UNDO_DELETE,        // Insert the value before again.
+};
+
+// What the changes of a record by a transaction amount to, which decides
+// the version it leaves for snapshots. The values to write back on abort
+// are kept in the undo log of the transaction.
+struct trx_undo_t {
+    int64_t table_id;
+    int64_t key;
+    int undo_type;
+};
+
+// Called once a commit queued by trx_commit_async is durable, with what
+// trx_commit would return: the transaction id, 0 if it was aborted, or -1
+// if the log could not be written.
+typedef void (*trx_commit_callback_t)(int trx_id, int result, void *arg);
+
+// Size of the version of a record that did not exist yet.
+#define VERSION_ABSENT UINT16_MAX
+
+// Causes of the aborts of lock requests.
+enum lock_abort_cause_t {
+    LOCK_ABORT_DEADLOCK,    // Chosen to break a cycle.
+    LOCK_ABORT_UPGRADE,     // A waiting upgrade of a held lock failed.
+    LOCK_ABORT_TIMEOUT,     // Waited longer than the lock wait timeout.
+    LOCK_ABORT_NO_WAIT,     // Would have waited under no-wait or wait-die.
+    LOCK_ABORT_WOUNDED,     // Wounded by an older transaction.
+};
+
+#define LOCK_ABORT_CAUSE_NUMBER 5
+
+// Bins of the lock wait time histograms. Bin 0 counts waits shorter than
+// a microsecond, bin i those from 2^(i-1) up to 2^i microseconds, and the
+// last bin every longer one too.
+#define LOCK_WAIT_BIN_NUMBER 20
+
+// Contention statistics of the lock manager since init_db.
+struct lock_stats_t {
+    uint64_t waits;                 // Lock requests that waited.
+    uint64_t wait_us;
+    uint64_t wait_histogram[LOCK_WAIT_BIN_NUMBER];
+    uint64_t deadlocks;             // Cycles found.
+    uint64_t aborts[LOCK_ABORT_CAUSE_NUMBER];
+    uint64_t max_queue_length;      // Most lock objects seen in one queue.
+    // Lock table latches. Hold times are sampled.
+    uint64_t latch_acquires;
+    uint64_t latch_waits;           // Acquisitions that found it taken.
+    uint64_t latch_wait_ns;
+    uint64_t latch_hold_samples;
+    uint64_t latch_hold_ns;
+};
+
+// Waits for the locks on a record, block or table. The lock manager keeps
+// a bounded number of keys, and a key that replaced a colder one took over
+// its count of waits as inherited_waits.
+struct lock_key_stats_t {
+    int64_t table_id;
+    int64_t key;
+    int level;
+    uint64_t waits;
+    uint64_t inherited_waits;
+    uint64_t wait_us;
+    uint64_t max_wait_us;
+    uint64_t max_queue_length;
+    uint32_t wait_histogram[LOCK_WAIT_BIN_NUMBER];
+};
+
+// Deadlock handling policies.
+enum deadlock_policy_t {
+    DEADLOCK_DETECT,        // Search for a cycle whenever a request waits.
+    DEADLOCK_TIMEOUT,       // Time out waits, and search in the background.
+    DEADLOCK_NO_WAIT,       // Abort instead of waiting.
+    DEADLOCK_WAIT_DIE,      // Older transactions wait, younger ones abort.
+    DEADLOCK_WOUND_WAIT,    // Older transactions abort younger holders.
 };
 
 /* APIs for Lock Manager */
+int lock_set_deadlock_policy(int policy, int timeout_ms);
+int lock_set_early_release(int enabled);
+int lock_set_fast_path(int enabled);
 void lock_update_wait_for(lock_t *new_lock);
 int lock_check_deadlock(int trx_id);
 int init_lock_table();
+int lock_set_escalation_threshold(int block_threshold, int table_threshold);
+int lock_get_stats(struct lock_stats_t *stats);
+int lock_get_hot_keys(int limit, std::vector<struct lock_key_stats_t> *keys);
 lock_t *lock_acquire(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int lock_mode);
+int lock_acquire_range(int64_t table_id, int64_t begin_key, int64_t end_key, int trx_id, int lock_mode);
 int lock_release(lock_t *lock_obj);
 
 /* APIs for Transaction Manager */
@@ -51,6 +174,21 @@ int trx_insert(int trx_id, lock_t *new_lock);
 int trx_find(int trx_id);
 int trx_abort(int trx_id);
 int trx_begin(void);
+int trx_begin_readonly(void);
+int trx_begin_optimistic(void);
+int trx_is_optimistic(int trx_id);
+int trx_buffer_write(int trx_id, int64_t table_id, int64_t key, const char *value, uint16_t val_size);
 int trx_commit(int trx_id);
+int trx_commit_async(int trx_id, trx_commit_callback_t callback, void *arg, int relaxed = 0);
+void trx_flush_commits(void);
+int trx_log_undo(int trx_id, int undo_type, int64_t table_id, int64_t key, pagenum_t pagenum,
+                 int slot, const char *before, uint16_t before_size);
+trx_undo_t *trx_get_undo(int trx_id, int64_t table_id, int64_t key);
+int trx_add_version(int trx_id, int64_t table_id, int64_t key, const char *value, uint16_t val_size);
+void trx_drop_version(int64_t table_id, int64_t key);
+int trx_write_record(int trx_id, int64_t table_id, int64_t key, const char *value,
+                     uint16_t val_size, uint16_t *old_val_size);
+int trx_read_version(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key,
+                     char *ret_val, uint16_t *val_size);
 
 #endif /* __TRX_H__ */
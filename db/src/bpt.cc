@@ -48,9 +48,237 @@
  */
 
 #include <queue>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "bpt.h"
 
 #define PAGE_BODY_OFFSET 1984
+#define LEAF_FREE_SPACE_THRESHOLD 2500
+
+pthread_rwlock_t tree_latch = PTHREAD_RWLOCK_INITIALIZER;
+uint64_t tree_free_count = 0;
+
+// Give a page of a tree back to its file.
+static void free_tree_page(struct page_t * page) {
+    tree_free_count++;
+    buffer_free_page(page);
+}
+
+// DENSE LEAVES.
+
+/* Leaves of a table opened with a fixed value size store a key array
+ * followed by a value array instead of slots, so record i sits at a
+ * fixed position and needs no offset or size field.
+ * If the table compresses keys, a leaf whose keys span less than 2^32
+ * stores them as 32-bit deltas from key_base (frame of reference).
+ */
+
+#define DENSE_MAX_KEYS (LEAF_SPACE_AMOUNT / 4 + 1)
+
+enum leaf_layout_t { LEAF_SLOTTED, LEAF_DENSE, LEAF_DENSE_FOR };
+
+static inline uint8_t * dense_key_ptr(leaf_node * leaf, int i) {
+    return leaf->body + i * leaf->key_width;
+}
+static inline uint8_t * dense_value_ptr(leaf_node * leaf, int i) {
+    return leaf->body + leaf->dense_capacity * leaf->key_width + i * leaf->fixed_val_size;
+}
+static inline int dense_leaf_capacity(uint16_t key_width, uint16_t val_size) {
+    return LEAF_SPACE_AMOUNT / (key_width + val_size);
+}
+
+// Returns the narrowest key width that can encode keys in [min_key, max_key].
+static inline uint16_t dense_key_width(leaf_node * leaf, int64_t min_key, int64_t max_key) {
+    if (leaf->compress_keys && (uint64_t)max_key - (uint64_t)min_key <= UINT32_MAX)
+        return 4;
+    return 8;
+}
+
+// Key accessors specialized for each leaf layout.
+template <int kLayout>
+static inline int64_t leaf_key_at(leaf_node * leaf, int i);
+
+template <>
+inline int64_t leaf_key_at<LEAF_DENSE_FOR>(leaf_node * leaf, int i) {
+    uint32_t delta;
+    memcpy(&delta, leaf->body + i * 4, 4);
+    return (int64_t)((uint64_t)leaf->key_base + delta);
+}
+
+template <>
+inline int64_t leaf_key_at<LEAF_DENSE>(leaf_node * leaf, int i) {
+    int64_t key;
+    memcpy(&key, leaf->body + i * 8, 8);
+    return key;
+}
+
+template <>
+inline int64_t leaf_key_at<LEAF_SLOTTED>(leaf_node * leaf, int i) {
+    int64_t key = 0;
+    int j;
+    for(j = 0; j < 8; j++) {
+        key |= leaf->body[i * 12 + j];
+        if(j < 7) key <<= 8;
+    }
+    return key;
+}
+
+template <int kLayout>
+static int leaf_lower_bound_impl(leaf_node * leaf, int64_t key) {
+    int low = 0, high = leaf->num_keys, mid;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (leaf_key_at<kLayout>(leaf, mid) < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static inline int leaf_layout(leaf_node * leaf) {
+    if (!leaf->fixed_val_size)
+        return LEAF_SLOTTED;
+    return leaf->key_width == 4 ? LEAF_DENSE_FOR : LEAF_DENSE;
+}
+
+// Checks whether the key can be written in the current key encoding.
+static inline int dense_key_fits(leaf_node * leaf, int64_t key) {
+    return leaf->key_width == 8
+        || ((uint64_t)key - (uint64_t)leaf->key_base <= UINT32_MAX && key >= leaf->key_base);
+}
+
+static inline void dense_write_key(leaf_node * leaf, int64_t key, int i) {
+    uint32_t delta;
+    if (leaf->key_width == 8) {
+        memcpy(dense_key_ptr(leaf, i), &key, 8);
+        return;
+    }
+    delta = (uint32_t)((uint64_t)key - (uint64_t)leaf->key_base);
+    memcpy(dense_key_ptr(leaf, i), &delta, 4);
+}
+
+/* Decodes the keys of slots [from, to) of a dense leaf straight from the
+ * key array, unpacking four deltas at a time.
+ */
+static void dense_leaf_decode_keys(leaf_node * leaf, int from, int to, int64_t * keys) {
+    int i = from;
+
+    if (leaf->key_width == 8) {
+        memcpy(keys, leaf->body + from * 8, (to - from) * 8);
+        return;
+    }
+#if defined(__SSE2__)
+    __m128i base = _mm_set1_epi64x(leaf->key_base), zero = _mm_setzero_si128(), deltas;
+    for ( ; i + 4 <= to; i += 4) {
+        deltas = _mm_loadu_si128((const __m128i *)(leaf->body + i * 4));
+        _mm_storeu_si128((__m128i *)(keys + i - from), _mm_add_epi64(base, _mm_unpacklo_epi32(deltas, zero)));
+        _mm_storeu_si128((__m128i *)(keys + i - from + 2), _mm_add_epi64(base, _mm_unpackhi_epi32(deltas, zero)));
+    }
+#endif
+    for ( ; i < to; i++)
+        keys[i - from] = leaf_key_at<LEAF_DENSE_FOR>(leaf, i);
+}
+
+// Initializes an empty dense leaf for the given value size.
+static void dense_leaf_init(leaf_node * leaf, uint16_t val_size, uint16_t compress_keys) {
+    leaf->fixed_val_size = val_size;
+    leaf->compress_keys = compress_keys;
+    leaf->key_width = 8;
+    leaf->key_base = 0;
+    leaf->dense_capacity = dense_leaf_capacity(8, val_size);
+    leaf->num_keys = 0;
+    leaf->free_space_amount = LEAF_SPACE_AMOUNT;
+}
+
+// Checks whether the given sorted records fit in a dense leaf.
+static int dense_leaf_fits(leaf_node * leaf, const int64_t * keys, int num_keys) {
+    if (num_keys == 0)
+        return 1;
+    return num_keys <= dense_leaf_capacity(dense_key_width(leaf, keys[0], keys[num_keys - 1]),
+                                           leaf->fixed_val_size);
+}
+
+/* Rewrites a dense leaf with the given sorted records, choosing the
+ * narrowest key encoding for them.
+ * Returns -1 and leaves the page untouched if they don't fit.
+ */
+static int dense_leaf_fill(leaf_node * leaf, const int64_t * keys, const uint8_t * values, int num_keys) {
+    uint16_t val_size = leaf->fixed_val_size, key_width;
+    int i;
+
+    key_width = num_keys > 0 ? dense_key_width(leaf, keys[0], keys[num_keys - 1]) : 8;
+    if (num_keys > dense_leaf_capacity(key_width, val_size))
+        return -1;
+
+    leaf->key_width = key_width;
+    leaf->key_base = num_keys > 0 ? keys[0] : 0;
+    leaf->dense_capacity = dense_leaf_capacity(key_width, val_size);
+    leaf->num_keys = num_keys;
+    leaf->free_space_amount = LEAF_SPACE_AMOUNT - num_keys * (key_width + val_size);
+    for (i = 0; i < num_keys; i++)
+        dense_write_key(leaf, keys[i], i);
+    memcpy(dense_value_ptr(leaf, 0), values, num_keys * val_size);
+    return 0;
+}
+
+/* Copies the records of a dense leaf to the given arrays, leaving room
+ * for one more record at slot gap when gap is not -1.
+ */
+static void dense_leaf_copy_out(leaf_node * leaf, int64_t * keys, uint8_t * values, int gap) {
+    uint16_t val_size = leaf->fixed_val_size;
+    int num_keys = leaf->num_keys;
+
+    if (gap < 0) {
+        dense_leaf_decode_keys(leaf, 0, num_keys, keys);
+        memcpy(values, dense_value_ptr(leaf, 0), num_keys * val_size);
+        return;
+    }
+    dense_leaf_decode_keys(leaf, 0, num_keys, keys);
+    memmove(keys + gap + 1, keys + gap, (num_keys - gap) * 8);
+    memcpy(values, dense_value_ptr(leaf, 0), gap * val_size);
+    memcpy(values + (gap + 1) * val_size, dense_value_ptr(leaf, gap), (num_keys - gap) * val_size);
+}
+
+// Inserts a record at slot i, shifting the records on its right.
+static void dense_leaf_insert_at(leaf_node * leaf, int i, int64_t key, const char * value) {
+    uint16_t val_size = leaf->fixed_val_size, key_width = leaf->key_width;
+    int num_moved = leaf->num_keys - i;
+    int64_t keys[DENSE_MAX_KEYS];
+    uint8_t values[LEAF_SPACE_AMOUNT];
+
+    // Case: the key is out of the frame or the leaf is full at its
+    // current key width, re-encode the whole leaf.
+    if (!dense_key_fits(leaf, key) || leaf->num_keys == leaf->dense_capacity) {
+        dense_leaf_copy_out(leaf, keys, values, i);
+        keys[i] = key;
+        memcpy(values + i * val_size, value, val_size);
+        dense_leaf_fill(leaf, keys, values, leaf->num_keys + 1);
+        return;
+    }
+
+    memmove(dense_key_ptr(leaf, i + 1), dense_key_ptr(leaf, i), num_moved * key_width);
+    memmove(dense_value_ptr(leaf, i + 1), dense_value_ptr(leaf, i), num_moved * val_size);
+    dense_write_key(leaf, key, i);
+    memcpy(dense_value_ptr(leaf, i), value, val_size);
+
+    leaf->num_keys++;
+    leaf->free_space_amount -= key_width + val_size;
+}
+
+// Removes the record at slot i, shifting the records on its right.
+static void dense_leaf_remove_at(leaf_node * leaf, int i) {
+    uint16_t val_size = leaf->fixed_val_size, key_width = leaf->key_width;
+    int num_moved = leaf->num_keys - i - 1;
+
+    memmove(dense_key_ptr(leaf, i), dense_key_ptr(leaf, i + 1), num_moved * key_width);
+    memmove(dense_value_ptr(leaf, i), dense_value_ptr(leaf, i + 1), num_moved * val_size);
+
+    leaf->num_keys--;
+    leaf->free_space_amount += key_width + val_size;
+}
+
 
 // FUNCTION DEFINITIONS.
 
@@ -143,6 +371,45 @@ void print_leaves( int64_t table_id ) {
 }
 
 
+// Walks the leaves and fills the table statistics.
+int get_table_stats( int64_t table_id, struct table_stats_t * stats ) {
+    header_node * header = (header_node *)buffer_read_page(table_id, 0x0);
+    pagenum_t pagenum = header->root_page_num;
+    buffer_page_unlatch((struct page_t *)header);
+    node * c;
+
+    memset(stats, 0, sizeof(*stats));
+    if (pagenum == 0)
+        return 0;
+
+    // Go down to the leftmost leaf.
+    c = (node *)buffer_read_page(table_id, pagenum);
+    stats->height = 1;
+    while (!c->is_leaf) {
+        pagenum = c->leftmost_page_num;
+        buffer_page_unlatch((struct page_t *)c);
+        c = (node *)buffer_read_page(table_id, pagenum);
+        stats->height++;
+    }
+
+    // Count the records and key bytes of every leaf.
+    while (true) {
+        leaf_node * leaf = (leaf_node *)c;
+        stats->num_leaves++;
+        stats->num_records += leaf->num_keys;
+        stats->key_bytes += leaf->num_keys * (leaf->fixed_val_size ? leaf->key_width : 8);
+        pagenum = leaf->right_sibling_page_num;
+        buffer_page_unlatch((struct page_t *)c);
+        if (pagenum == 0)
+            break;
+        c = (node *)buffer_read_page(table_id, pagenum);
+    }
+    stats->raw_key_bytes = stats->num_records * 8;
+    stats->key_compression_ratio = stats->key_bytes ? (double)stats->raw_key_bytes / stats->key_bytes : 1.0;
+    return 0;
+}
+
+
 /* Finds keys and their pointers, if present, in the range specified
  * by key_start and key_end, inclusive.  Places these in the arrays
  * returned_keys and returned_pointers, and returns the number of
@@ -151,30 +418,315 @@ void print_leaves( int64_t table_id ) {
 int find_range( int64_t table_id, int64_t begin_key, int64_t end_key, 
                 std::vector<int64_t>* keys, std::vector<char*>* values,
                 std::vector<uint16_t>* val_sizes) {
-    int i, num_found;
-    num_found = 0;
-    char * temp_values;
+    return find_range_filtered(table_id, begin_key, end_key, NULL, keys, values, val_sizes);
+}
+
+
+/* Visits the records in the range specified by begin_key and end_key,
+ * inclusive, in key order. visit(n, i, key) is called with leaf n still
+ * latched, and returns false to stop the walk.
+ */
+template <typename Visit>
+static void walk_leaf_range( int64_t table_id, int64_t begin_key, int64_t end_key,
+                                Visit && visit) {
+    int i;
+    int64_t key;
+    leaf_node * n;
 
     // Find leaf node that has the begin key.
     pagenum_t n_pagenum = find_leaf( table_id, begin_key);
-    leaf_node * n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+    if (n_pagenum == (pagenum_t)-1 || begin_key > end_key)
+        return;
+    n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+    i = leaf_lower_bound(n, begin_key);
+
+    while (true) {
+        for ( ; i < (int)n->num_keys; i++) {
+            key = read_leaf_key(n, i);
+            if (key > end_key || !visit(n, i, key))
+                break;
+        }
 
-    // Fill return vectors.
-    if (n_pagenum == 0) return 0;
-    for (i = 0; i < n->num_keys && read_leaf_key(n, i) < begin_key; i++);
-    if (i == n->num_keys) return 0;
-    while (n_pagenum != 0) {
+        // Stop at the end of the range, when told to or at the last leaf.
+        n_pagenum = n->right_sibling_page_num;
+        if (i < (int)n->num_keys || n_pagenum == 0)
+            break;
         buffer_page_unlatch((struct page_t *)n);
         n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
-        for ( ; i < n->num_keys && read_leaf_key(n, i) <= end_key; i++) {
-            (*keys).push_back(read_leaf_key(n, i));
+        i = 0;
+    }
+    buffer_page_unlatch((struct page_t *)n);
+}
+
+
+// Checks the predicate of a scan filter against a value in a leaf frame.
+static bool scan_filter_match(const struct scan_filter_t * filter,
+                                const uint8_t * value, uint16_t val_size) {
+    if (filter == NULL || filter->pred_len == 0)
+        return true;
+    if (filter->pred_offset + filter->pred_len > val_size)
+        return false;
+    value += filter->pred_offset;
+    if (filter->pred_low != NULL && memcmp(value, filter->pred_low, filter->pred_len) < 0)
+        return false;
+    if (filter->pred_high != NULL && memcmp(value, filter->pred_high, filter->pred_len) > 0)
+        return false;
+    return true;
+}
+
+
+/* Finds the records in the range specified by begin_key and end_key,
+ * inclusive, that pass the predicate of the filter, up to its limit.
+ * Only the projected part of each value is copied out of the leaf.
+ * A NULL filter keeps every record. Returns the number of records found.
+ */
+int find_range_filtered( int64_t table_id, int64_t begin_key, int64_t end_key,
+                        const struct scan_filter_t * filter,
+                        std::vector<int64_t>* keys, std::vector<char*>* values,
+                        std::vector<uint16_t>* val_sizes) {
+    int num_found = 0, limit = filter != NULL ? filter->limit : 0;
+
+    walk_leaf_range(table_id, begin_key, end_key, [&](leaf_node * n, int i, int64_t key) {
+        uint16_t val_size = read_leaf_val_size(n, i), proj_offset = 0, proj_len = val_size;
+        const uint8_t * value = n->body + read_leaf_offset(n, i);
+        char * temp_values;
+
+        if (!scan_filter_match(filter, value, val_size))
+            return true;
+        if (filter != NULL && filter->proj_len != 0) {
+            proj_offset = filter->proj_offset < val_size ? filter->proj_offset : val_size;
+            proj_len = val_size - proj_offset < filter->proj_len ?
+                        val_size - proj_offset : filter->proj_len;
+        }
+        (*keys).push_back(key);
+        (*val_sizes).push_back(proj_len);
+        temp_values = (char *)malloc(proj_len == val_size ? MAX_VAL_SIZE : proj_len + 1);
+        memcpy(temp_values, value + proj_offset, proj_len);
+        (*values).push_back(temp_values);
+        return ++num_found != limit;
+    });
+    return num_found;
+}
+
+
+/* Collects up to num_parts - 1 separator keys in (begin_key, end_key] from
+ * the highest internal level that has enough of them, spaced evenly, so
+ * that they split the range into parts of similar size.
+ * Returns the number of separators found.
+ */
+int find_range_separators( int64_t table_id, int64_t begin_key, int64_t end_key,
+                            int num_parts, std::vector<int64_t>* separators) {
+    std::vector<pagenum_t> level, children;
+    std::vector<int64_t> candidates;
+    int i, j, leaf_level;
+    int64_t low, high;
+    node * c;
+
+    separators->clear();
+    c = (node *)buffer_read_page(table_id, 0x0);
+    level.push_back(((header_node *)c)->root_page_num);
+    buffer_page_unlatch((struct page_t *)c);
+    if (level[0] == 0 || num_parts <= 1 || begin_key >= end_key)
+        return 0;
+
+    // Descend while the level has too few separators in the range.
+    while (true) {
+        candidates.clear(), children.clear();
+        leaf_level = 0;
+        for (i = 0; i < (int)level.size(); i++) {
+            c = (node *)buffer_read_page(table_id, level[i]);
+            if (c->is_leaf) {
+                leaf_level = 1;
+                buffer_page_unlatch((struct page_t *)c);
+                break;
+            }
+            // Child j covers keys in [key j - 1, key j).
+            for (j = 0; j <= (int)c->num_keys; j++) {
+                low = j == 0 ? INT64_MIN : c->entries[j * 2 - 2];
+                high = j == (int)c->num_keys ? INT64_MAX : c->entries[j * 2];
+                if (j < (int)c->num_keys && high > begin_key && high <= end_key)
+                    candidates.push_back(high);
+                if (low <= end_key && (j == (int)c->num_keys || high > begin_key))
+                    children.push_back(j == 0 ? c->leftmost_page_num : c->entries[j * 2 - 1]);
+            }
+            buffer_page_unlatch((struct page_t *)c);
+        }
+        if (leaf_level)
+            break;
+        *separators = candidates;
+        if ((int)candidates.size() >= num_parts - 1)
+            break;
+        level.swap(children);
+    }
+
+    // Space the separators evenly.
+    if ((int)separators->size() > num_parts - 1) {
+        candidates.swap(*separators);
+        separators->clear();
+        for (i = 1; i < num_parts; i++)
+            separators->push_back(candidates[(size_t)i * candidates.size() / num_parts]);
+    }
+    return separators->size();
+}
+
+
+// Arguments of a parallel scan worker.
+struct parallel_scan_arg_t {
+    int64_t table_id;
+    int64_t begin_key;
+    int64_t end_key;
+    int worker;
+    scan_callback_t callback;
+    void * arg;
+    int num_found;
+};
+
+// Scans the sub-range of one worker.
+static void * parallel_scan_worker(void * arg) {
+    struct parallel_scan_arg_t * part = (struct parallel_scan_arg_t *)arg;
+
+    walk_leaf_range(part->table_id, part->begin_key, part->end_key,
+                    [part](leaf_node * n, int i, int64_t key) {
+        part->callback(part->worker, key, (const char *)n->body + read_leaf_offset(n, i),
+                        read_leaf_val_size(n, i), part->arg);
+        part->num_found++;
+        return true;
+    });
+    return NULL;
+}
+
+
+/* Scans the range specified by begin_key and end_key, inclusive, with up
+ * to num_threads workers. The range is split at separator keys of the
+ * upper levels, and each worker descends to the start of its part and
+ * walks the leaves on its own. Records are passed to callback with the
+ * worker index and the value in the latched leaf frame.
+ * Returns the number of records found.
+ */
+int find_range_parallel( int64_t table_id, int64_t begin_key, int64_t end_key,
+                            int num_threads, scan_callback_t callback, void * arg) {
+    std::vector<int64_t> separators;
+    std::vector<struct parallel_scan_arg_t> parts;
+    std::vector<pthread_t> threads;
+    std::vector<char> started;
+    int i, num_found = 0;
+
+    if (begin_key > end_key)
+        return 0;
+    find_range_separators(table_id, begin_key, end_key, num_threads, &separators);
+
+    // Part i covers [separator i - 1, separator i).
+    parts.resize(separators.size() + 1);
+    for (i = 0; i < (int)parts.size(); i++) {
+        parts[i].table_id = table_id;
+        parts[i].begin_key = i == 0 ? begin_key : separators[i - 1];
+        parts[i].end_key = i == (int)separators.size() ? end_key : separators[i] - 1;
+        parts[i].worker = i;
+        parts[i].callback = callback;
+        parts[i].arg = arg;
+        parts[i].num_found = 0;
+    }
+
+    // The caller scans the first part itself, and any part whose thread
+    // could not be created.
+    threads.resize(parts.size());
+    started.resize(parts.size(), 0);
+    for (i = 1; i < (int)parts.size(); i++)
+        started[i] = pthread_create(&threads[i], NULL, parallel_scan_worker, &parts[i]) == 0;
+    parallel_scan_worker(&parts[0]);
+    for (i = 1; i < (int)parts.size(); i++)
+        if (!started[i])
+            parallel_scan_worker(&parts[i]);
+    for (i = 1; i < (int)parts.size(); i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    for (i = 0; i < (int)parts.size(); i++)
+        num_found += parts[i].num_found;
+    return num_found;
+}
+
+
+/* Finds the records in the range specified by begin_key and end_key,
+ * inclusive, in descending key order, up to limit records (0 means no
+ * limit). Starts at the leaf of end_key and follows the left sibling
+ * links. Returns the number of records found.
+ */
+int find_range_reverse( int64_t table_id, int64_t begin_key, int64_t end_key, int limit,
+                        std::vector<int64_t>* keys, std::vector<char*>* values,
+                        std::vector<uint16_t>* val_sizes) {
+    int i, num_found = 0;
+    int64_t key;
+    char * temp_values;
+    leaf_node * n;
+
+    // Find leaf node that has the end key.
+    pagenum_t n_pagenum = find_leaf( table_id, end_key);
+    if (n_pagenum == (pagenum_t)-1 || begin_key > end_key)
+        return 0;
+    n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+    i = (end_key == INT64_MAX ? n->num_keys : leaf_lower_bound(n, end_key + 1)) - 1;
+
+    while (true) {
+        for ( ; i >= 0; i--) {
+            key = read_leaf_key(n, i);
+            if (key < begin_key)
+                break;
+            (*keys).push_back(key);
             (*val_sizes).push_back(read_leaf_val_size(n, i));
-            temp_values = (char *)malloc(120 * sizeof(char));
+            temp_values = (char *)malloc(MAX_VAL_SIZE);
             read_leaf_value(n, temp_values, i);
             (*values).push_back(temp_values);
-            num_found++;
+            if (++num_found == limit)
+                break;
         }
+
+        // Stop at the start of the range, the limit or the first leaf.
+        n_pagenum = n->left_sibling_page_num;
+        if (i >= 0 || n_pagenum == 0)
+            break;
+        buffer_page_unlatch((struct page_t *)n);
+        n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+        i = n->num_keys - 1;
+    }
+    buffer_page_unlatch((struct page_t *)n);
+    return num_found;
+}
+
+
+/* Finds the keys in the range specified by begin_key and end_key,
+ * inclusive, and appends them to keys. Only the key part of each
+ * leaf is read, which for dense leaves is a contiguous array.
+ * Returns the number of keys found.
+ */
+int find_range_keys( int64_t table_id, int64_t begin_key, int64_t end_key,
+                        std::vector<int64_t>* keys) {
+    int i, end_i, num_found = 0;
+    size_t old_size;
+    leaf_node * n;
+
+    pagenum_t n_pagenum = find_leaf( table_id, begin_key);
+    if (n_pagenum == (pagenum_t)-1 || begin_key > end_key)
+        return 0;
+    n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+    i = leaf_lower_bound(n, begin_key);
+
+    while (true) {
+        // Slots [i, end_i) of this leaf are in the range.
+        end_i = end_key == INT64_MAX ? n->num_keys : leaf_lower_bound(n, end_key + 1);
+        if (i < end_i) {
+            old_size = keys->size();
+            keys->resize(old_size + end_i - i);
+            read_leaf_keys(n, i, end_i, keys->data() + old_size);
+            num_found += end_i - i;
+        }
+
+        // Stop at the end of the range or at the last leaf.
         n_pagenum = n->right_sibling_page_num;
+        if (end_i < (int)n->num_keys || n_pagenum == 0)
+            break;
+        buffer_page_unlatch((struct page_t *)n);
+        n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
         i = 0;
     }
     buffer_page_unlatch((struct page_t *)n);
@@ -231,9 +783,8 @@ int find( int64_t table_id, int64_t key, char* ret_val,
     c = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
 
     if (leaf_pagenum == 0) return -1;
-    for (i = 0; i < c->num_keys; i++)
-        if (read_leaf_key(c, i) == key) break;
-    if (i == c->num_keys) {
+    i = leaf_lower_bound(c, key);
+    if (i == (int)c->num_keys || read_leaf_key(c, i) != key) {
         buffer_page_unlatch((struct page_t *)c);
         return -1;
     }
@@ -246,15 +797,18 @@ int find( int64_t table_id, int64_t key, char* ret_val,
 }
 
 int64_t read_leaf_key(leaf_node * leaf, int i) {
-    int64_t key = 0;
-    int j;
-    for(j = 0; j < 8; j++) {
-        key |= leaf->body[i * 12 + j];
-        if(j < 7) key <<= 8;
+    switch (leaf_layout(leaf)) {
+    case LEAF_DENSE_FOR:
+        return leaf_key_at<LEAF_DENSE_FOR>(leaf, i);
+    case LEAF_DENSE:
+        return leaf_key_at<LEAF_DENSE>(leaf, i);
+    default:
+        return leaf_key_at<LEAF_SLOTTED>(leaf, i);
     }
-    return key;
 }
 uint16_t read_leaf_val_size(leaf_node * leaf, int i) {
+    if (leaf->fixed_val_size)
+        return leaf->fixed_val_size;
     uint64_t val_size = 0;
     val_size |= leaf->body[i * 12 + 8];
     val_size <<= 8;
@@ -262,6 +816,8 @@ uint16_t read_leaf_val_size(leaf_node * leaf, int i) {
     return val_size;
 }
 uint16_t read_leaf_offset(leaf_node * leaf, int i) {
+    if (leaf->fixed_val_size)
+        return dense_value_ptr(leaf, i) - leaf->body;
     uint64_t offset = 0;
     offset |= leaf->body[i * 12 + 10];
     offset <<= 8;
@@ -269,10 +825,53 @@ uint16_t read_leaf_offset(leaf_node * leaf, int i) {
     return offset;
 }
 void read_leaf_value(leaf_node * leaf, char * ret_val, int i) {
+    if (leaf->fixed_val_size) {
+        memcpy(ret_val, dense_value_ptr(leaf, i), leaf->fixed_val_size);
+        return;
+    }
     int j;
     for(j = 0; j < read_leaf_val_size(leaf, i); j++)
         ret_val[j] = (char)leaf->body[read_leaf_offset(leaf, i) + j];
 }
+// Returns the first slot whose key is not less than the given key.
+int leaf_lower_bound(leaf_node * leaf, int64_t key) {
+    switch (leaf_layout(leaf)) {
+    case LEAF_DENSE_FOR:
+        return leaf_lower_bound_impl<LEAF_DENSE_FOR>(leaf, key);
+    case LEAF_DENSE:
+        return leaf_lower_bound_impl<LEAF_DENSE>(leaf, key);
+    default:
+        return leaf_lower_bound_impl<LEAF_SLOTTED>(leaf, key);
+    }
+}
+
+// Copies the keys of slots [from, to) without touching the values.
+void read_leaf_keys(leaf_node * leaf, int from, int to, int64_t * keys) {
+    int i;
+    if (leaf->fixed_val_size) {
+        dense_leaf_decode_keys(leaf, from, to, keys);
+        return;
+    }
+    for (i = from; i < to; i++)
+        keys[i - from] = leaf_key_at<LEAF_SLOTTED>(leaf, i);
+}
+
+// Checks whether a leaf can take one more record without splitting.
+int leaf_has_room(leaf_node * leaf, int64_t key, uint16_t val_size) {
+    int64_t min_key, max_key;
+
+    if (!leaf->fixed_val_size)
+        return leaf->free_space_amount >= val_size + 12u;
+    if (leaf->num_keys == 0)
+        return 1;
+
+    min_key = read_leaf_key(leaf, 0);
+    max_key = read_leaf_key(leaf, leaf->num_keys - 1);
+    if (key < min_key) min_key = key;
+    if (key > max_key) max_key = key;
+    return (int)leaf->num_keys < dense_leaf_capacity(dense_key_width(leaf, min_key, max_key),
+                                                     leaf->fixed_val_size);
+}
 uint64_t read_temp_body_key(uint8_t * body, int i) {
     int64_t key = 0;
     int j;
@@ -307,6 +906,10 @@ void read_temp_body_value(uint8_t * body, char * ret_val, int i) {
 // INSERTION
 
 void write_leaf_key(leaf_node * leaf, int64_t key, int i) {
+    if (leaf->fixed_val_size) {
+        dense_write_key(leaf, key, i);
+        return;
+    }
     int j;
     for(j = 7; j >= 0; j--) {
         leaf->body[i * 12 + j] = 0;
@@ -315,6 +918,9 @@ void write_leaf_key(leaf_node * leaf, int64_t key, int i) {
     }
 }
 void write_leaf_val_size(leaf_node * leaf, uint16_t val_size, int i) {
+    // Dense leaves have no size field.
+    if (leaf->fixed_val_size)
+        return;
     int j;
     leaf->body[i * 12 + 9] = 0;
     leaf->body[i * 12 + 9] |= val_size;
@@ -323,6 +929,9 @@ void write_leaf_val_size(leaf_node * leaf, uint16_t val_size, int i) {
     leaf->body[i * 12 + 8] |= val_size;
 }
 void write_leaf_offset(leaf_node * leaf, uint16_t offset, int i) {
+    // Dense leaves have no offset field.
+    if (leaf->fixed_val_size)
+        return;
     int j;
     leaf->body[i * 12 + 11] = 0;
     leaf->body[i * 12 + 11] |= offset;
@@ -331,6 +940,10 @@ void write_leaf_offset(leaf_node * leaf, uint16_t offset, int i) {
     leaf->body[i * 12 + 10] |= offset;
 }
 void write_leaf_value(leaf_node * leaf, const char * val, uint16_t val_size, int i) {
+    if (leaf->fixed_val_size) {
+        memcpy(dense_value_ptr(leaf, i), val, leaf->fixed_val_size);
+        return;
+    }
     int j;
     for(j = 0; j < val_size; j++)
         leaf->body[read_leaf_offset(leaf, i) + j] = (uint8_t)val[j];
@@ -372,8 +985,12 @@ leaf_node * make_leaf( void ) {
     leaf_node * leaf = (leaf_node *)make_in_momory_page();
     leaf->is_leaf = true;
     leaf->num_keys = 0;
+    leaf->fixed_val_size = 0;
+    leaf->dense_capacity = 0;
+    leaf->compress_keys = 0;
     leaf->free_space_amount = LEAF_SPACE_AMOUNT;
     leaf->right_sibling_page_num = 0;
+    leaf->left_sibling_page_num = 0;
     return leaf;
 }
 
@@ -404,6 +1021,13 @@ void insert_into_leaf( int64_t table_id, pagenum_t leaf_pagenum, int64_t key, co
     leaf_node * leaf = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
     uint16_t temp_offset, offset;
 
+    // Case: dense leaf, shift the parallel arrays.
+    if (leaf->fixed_val_size) {
+        dense_leaf_insert_at(leaf, leaf_lower_bound(leaf, key), key, value);
+        buffer_write_page((struct page_t *)leaf);
+        return;
+    }
+
     // Find an offset (minimum offset in the tree - val_Size).
     offset = LEAF_SPACE_AMOUNT;
     for(i = 0; i < leaf->num_keys; i++) {
@@ -414,9 +1038,7 @@ void insert_into_leaf( int64_t table_id, pagenum_t leaf_pagenum, int64_t key, co
     offset -= val_size;
 
     // Find an insertion point.
-    insertion_point = 0;
-    while (insertion_point < leaf->num_keys && read_leaf_key(leaf, insertion_point) < key)
-        insertion_point++;
+    insertion_point = leaf_lower_bound(leaf, key);
 
     // Move records that is in right side of the input key.
     for (i = leaf->num_keys; i > insertion_point; i--) {
@@ -435,6 +1057,17 @@ void insert_into_leaf( int64_t table_id, pagenum_t leaf_pagenum, int64_t key, co
 }
 
 
+// Points the left sibling link of a leaf, if any, at another leaf.
+static void set_left_sibling(int64_t table_id, pagenum_t leaf_pagenum, pagenum_t left_pagenum) {
+    leaf_node * leaf;
+    if (leaf_pagenum == 0)
+        return;
+    leaf = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
+    leaf->left_sibling_page_num = left_pagenum;
+    buffer_write_page((struct page_t *)leaf);
+}
+
+
 /* Inserts a new key and pointer
  * to a new record into a leaf so as to exceed
  * the tree's order, causing the leaf to be split
@@ -447,8 +1080,9 @@ void insert_into_leaf_after_splitting( int64_t table_id, pagenum_t leaf_pagenum,
     int64_t temp_key;
     uint16_t temp_offset, temp_val_size;
     char temp_value[120] = {};
-    int insertion_index, split_index, new_key, temp_size, extra_space = 200, total_num_keys, i, j;
-    uint8_t *temp_body = (uint8_t *)malloc(LEAF_SPACE_AMOUNT + extra_space);
+    int insertion_index, split_index, temp_size, extra_space = 200, total_num_keys, i, j;
+    int64_t new_key;
+    uint8_t *temp_body;
 
     leaf = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
 
@@ -457,65 +1091,87 @@ void insert_into_leaf_after_splitting( int64_t table_id, pagenum_t leaf_pagenum,
     new_leaf->is_leaf = 1;
 
     // Find insertion index
-    insertion_index = 0;
-    while (insertion_index < leaf->num_keys && read_leaf_key(leaf, insertion_index) < key)
-        insertion_index++;
-
-    // Copy the leaf node with the new key and value to a temp body.
-    total_num_keys = leaf->num_keys + 1;
-    temp_size = 0;
-    temp_offset = LEAF_SPACE_AMOUNT + extra_space;
-    for (i = 0, j = 0; i < total_num_keys; i++, j++) {
-        if (j == insertion_index) {
-            temp_offset -= val_size;
-            write_temp_body(temp_body, key, val_size, temp_offset, value, j);
-
-            temp_size += val_size + 12;
+    insertion_index = leaf_lower_bound(leaf, key);
+
+    // Case: dense leaf, re-encode each half of the records on its own.
+    if (leaf->fixed_val_size) {
+        int64_t temp_keys[DENSE_MAX_KEYS];
+        uint8_t temp_values[LEAF_SPACE_AMOUNT + MAX_VAL_SIZE];
+
+        dense_leaf_copy_out(leaf, temp_keys, temp_values, insertion_index);
+        temp_keys[insertion_index] = key;
+        memcpy(temp_values + insertion_index * val_size, value, val_size);
+
+        total_num_keys = leaf->num_keys + 1;
+        split_index = total_num_keys / 2;
+        dense_leaf_init(new_leaf, leaf->fixed_val_size, leaf->compress_keys);
+        dense_leaf_fill(leaf, temp_keys, temp_values, split_index);
+        dense_leaf_fill(new_leaf, temp_keys + split_index, temp_values + split_index * val_size,
+                        total_num_keys - split_index);
+    }
+    else {
+        new_leaf->fixed_val_size = 0;
+        new_leaf->dense_capacity = 0;
+        new_leaf->compress_keys = 0;
+        temp_body = (uint8_t *)malloc(LEAF_SPACE_AMOUNT + extra_space);
+
+        // Copy the leaf node with the new key and value to a temp body.
+        total_num_keys = leaf->num_keys + 1;
+        temp_size = 0;
+        temp_offset = LEAF_SPACE_AMOUNT + extra_space;
+        for (i = 0, j = 0; j < total_num_keys; j++) {
+            if (j == insertion_index) {
+                temp_offset -= val_size;
+                write_temp_body(temp_body, key, val_size, temp_offset, value, j);
+                temp_size += val_size + 12;
+            }
+            else {
+                temp_key = read_leaf_key(leaf, i);
+                temp_val_size = read_leaf_val_size(leaf, i);
+                temp_offset -= temp_val_size;
+                read_leaf_value(leaf, temp_value, i);
+                write_temp_body(temp_body, temp_key, temp_val_size, temp_offset, temp_value, j);
+                temp_size += temp_val_size + 12;
+                i++;
+            }
             if(temp_size <= PAGE_BODY_OFFSET)
                 split_index = j + 1;
-            j++;
         }
-        temp_key = read_leaf_key(leaf, i);
-        temp_val_size = read_leaf_val_size(leaf, i);
-        temp_offset -= temp_val_size;
-        read_leaf_value(leaf, temp_value, i);
-        write_temp_body(temp_body, temp_key, temp_val_size, temp_offset, temp_value, j);
-
-        temp_size += temp_val_size + 12;
-        if(temp_size <= PAGE_BODY_OFFSET)
-                split_index = j + 1;
+
+        // Copy half of the temp body to original leaf node.
+        leaf->num_keys = 0;
+        temp_offset = LEAF_SPACE_AMOUNT;
+        for (i = 0; i <= split_index; i++) {
+            temp_key = read_temp_body_key(temp_body, i);
+            temp_val_size = read_temp_body_val_size(temp_body, i);
+            temp_offset -= temp_val_size;
+            read_temp_body_value(temp_body, temp_value, i);
+
+            write_leaf_record(leaf, temp_key, temp_val_size, temp_offset, temp_value, i);
+            leaf->num_keys++;
+        }
+        leaf->free_space_amount = temp_offset - 12 * i;
+
+        // Copy the other half of the temp body to a new leaf node.
+        new_leaf->num_keys = 0;
+        temp_offset = LEAF_SPACE_AMOUNT;
+        for (i = split_index + 1, j = 0; i < total_num_keys; i++, j++) {
+            temp_key = read_temp_body_key(temp_body, i);
+            temp_val_size = read_temp_body_val_size(temp_body, i);
+            temp_offset -= temp_val_size;
+            read_temp_body_value(temp_body, temp_value, i);
+            write_leaf_record(new_leaf, temp_key, temp_val_size, temp_offset, temp_value, j);
+            new_leaf->num_keys++;
+        }
+        new_leaf->free_space_amount = temp_offset - 12 * j;
+        free(temp_body);
     }
-    
-    // Copy half of the temp body to original leaf node.
-    leaf->num_keys = 0;
-    temp_offset = LEAF_SPACE_AMOUNT;
-    for (i = 0; i <= split_index; i++) {
-        temp_key = read_temp_body_key(temp_body, i);
-        temp_val_size = read_temp_body_val_size(temp_body, i);
-        temp_offset -= temp_val_size;
-        read_temp_body_value(temp_body, temp_value, i);
-        
-        write_leaf_record(leaf, temp_key, temp_val_size, temp_offset, temp_value, i);
-        leaf->num_keys++;
-    }
-    leaf->free_space_amount = temp_offset - 12 * i;
-
-    // Copy the other half of the temp body to a new leaf node.
-    new_leaf->num_keys = 0;
-    temp_offset = LEAF_SPACE_AMOUNT;
-    for (i = split_index + 1, j = 0; i < total_num_keys; i++, j++) {
-        temp_key = read_temp_body_key(temp_body, i);
-        temp_val_size = read_temp_body_val_size(temp_body, i);
-        temp_offset -= temp_val_size;
-        read_temp_body_value(temp_body, temp_value, i);
-        write_leaf_record(new_leaf, temp_key, temp_val_size, temp_offset, temp_value, j);
-        new_leaf->num_keys++;
-    }
-    new_leaf->free_space_amount = temp_offset - 12 * i;
 
     // Update and write two pages.
     new_leaf->right_sibling_page_num = leaf->right_sibling_page_num;
+    new_leaf->left_sibling_page_num = leaf_pagenum;
     leaf->right_sibling_page_num = new_leaf_pagenum;
+    set_left_sibling(table_id, new_leaf->right_sibling_page_num, new_leaf_pagenum);
 
     new_leaf->parent_page_num = leaf->parent_page_num;
     new_key = read_leaf_key(new_leaf, 0);
@@ -726,6 +1382,7 @@ void start_new_tree(int64_t table_id, int64_t key, const char* value,
     header_node * header;
     leaf_node * root;
     pagenum_t root_num;
+    uint16_t fixed_val_size, compress_keys;
 
     // Allocate a root page.
     root = (leaf_node *)buffer_alloc_page(table_id, &root_num);
@@ -733,13 +1390,28 @@ void start_new_tree(int64_t table_id, int64_t key, const char* value,
     // Update the header page.
     header = (header_node *)buffer_read_page(table_id, 0x0);
     header->root_page_num = root_num;
+    fixed_val_size = header->fixed_val_size;
+    compress_keys = header->compress_keys;
     buffer_write_page((struct page_t *)header);
 
     // Initialize the root page.
     root->parent_page_num = 0x0;
     root->is_leaf = 1;
-    root->num_keys = 1;
     root->right_sibling_page_num = 0x0;
+    root->left_sibling_page_num = 0x0;
+
+    // Case: fixed-value-size table, start with a dense leaf.
+    if (fixed_val_size) {
+        dense_leaf_init(root, fixed_val_size, compress_keys);
+        dense_leaf_insert_at(root, 0, key, value);
+        buffer_write_page((struct page_t *)root);
+        return;
+    }
+
+    root->num_keys = 1;
+    root->fixed_val_size = 0;
+    root->dense_capacity = 0;
+    root->compress_keys = 0;
     root->free_space_amount = LEAF_SPACE_AMOUNT - (val_size + 12);
 
     // Insert the key and value.
@@ -767,8 +1439,13 @@ int insert(int64_t table_id, int64_t key, const char* value,
 
     node * c = (node *)buffer_read_page(table_id, 0x0);
     pagenum_t root = ((header_node *)c)->root_page_num;
+    uint16_t fixed_val_size = ((header_node *)c)->fixed_val_size;
     buffer_page_unlatch((struct page_t *)c);
 
+    // Case: a fixed-value-size table only accepts values of that size.
+    if (fixed_val_size && val_size != fixed_val_size)
+        return -1;
+
     // Case: the tree does not exist yet, start a new tree.
     if (root == 0x0) {
         start_new_tree(table_id, key, value, val_size);
@@ -786,11 +1463,11 @@ int insert(int64_t table_id, int64_t key, const char* value,
     // Find the leaf node the input record should go in.
     leaf_pagenum = find_leaf(table_id, key);
     leaf = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
-    uint64_t leaf_free_space_amout = leaf->free_space_amount;
+    int has_room = leaf_has_room(leaf, key, val_size);
     buffer_page_unlatch((struct page_t *)leaf);
 
     // Case: leaf has room for key and pointer.
-    if (leaf_free_space_amout >= val_size + 12) {
+    if (has_room) {
         insert_into_leaf(table_id, leaf_pagenum, key, value, val_size);
         return 0;
     }
@@ -876,11 +1553,11 @@ int adjust_root(int64_t table_id, pagenum_t root_pagenum) {
     }
 
     buffer_write_page((struct page_t *)header);
-    buffer_free_page((struct page_t *)root);
+    free_tree_page((struct page_t *)root);
     return 0;
 }
 
-void remove_entry_from_node(int64_t table_id, pagenum_t n_pagenum, int key) {
+void remove_entry_from_node(int64_t table_id, pagenum_t n_pagenum, int64_t key) {
     int i;
     node * n;
 
@@ -905,11 +1582,21 @@ void remove_entry_from_node(int64_t table_id, pagenum_t n_pagenum, int key) {
     leaf_node * leaf_n;
     uint16_t offset_diff, del_record_offset, temp_offset;
 
-    // Find the location of the key
     leaf_n = (leaf_node *)n;
-    i = 0;
-    while (read_leaf_key(leaf_n, i) != key)
-        i++;
+
+    // Case: the key is not in the leaf.
+    i = leaf_lower_bound(leaf_n, key);
+    if (i == (int)leaf_n->num_keys || read_leaf_key(leaf_n, i) != key) {
+        buffer_page_unlatch((struct page_t *)leaf_n);
+        return;
+    }
+
+    // Case: dense leaf, close the gap in the parallel arrays.
+    if (leaf_n->fixed_val_size) {
+        dense_leaf_remove_at(leaf_n, i);
+        buffer_write_page((struct page_t *)leaf_n);
+        return;
+    }
 
     del_record_offset = read_leaf_offset(leaf_n, i);
     offset_diff = read_leaf_val_size(leaf_n, i);
@@ -1003,8 +1690,8 @@ int coalesce_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbor_pag
 
     parent_pagenum = n->parent_page_num;
 
-    buffer_free_page((struct page_t *)n);
-    buffer_page_unlatch((struct page_t *)neighbor);
+    free_tree_page((struct page_t *)n);
+    buffer_write_page((struct page_t *)neighbor);
     delete_entry(table_id, parent_pagenum, k_prime);
     return 0;
 }
@@ -1018,6 +1705,7 @@ int coalesce_leaf_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbo
          
     int i, j, neighbor_insertion_index;
     leaf_node * tmp, * n, * neighbor;
+    pagenum_t parent_pagenum;
     int16_t temp_val_size, current_offset, temp_offset;
     char temp_value[120] = {};
     
@@ -1030,6 +1718,53 @@ int coalesce_leaf_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbo
         tmp = n;
         n = neighbor;
         neighbor = tmp;
+        neighbor_pagenum = n_pagenum;
+    }
+    parent_pagenum = n->parent_page_num;
+
+    // Case: dense leaves, append the records of n to the neighbor.
+    if (neighbor->fixed_val_size) {
+        int64_t temp_keys[DENSE_MAX_KEYS];
+        uint8_t temp_values[2 * LEAF_SPACE_AMOUNT];
+        uint16_t val_size = neighbor->fixed_val_size;
+        int num_keys = neighbor->num_keys + n->num_keys, split = num_keys / 2;
+        node * parent;
+
+        dense_leaf_copy_out(neighbor, temp_keys, temp_values, -1);
+        dense_leaf_copy_out(n, temp_keys + neighbor->num_keys,
+                            temp_values + neighbor->num_keys * val_size, -1);
+
+        /* Case: the merged keys need a wider encoding than fits.
+         * Redistribute the records instead, as evenly as both leaves can
+         * hold them. The split they had before always fits.
+         */
+        if (dense_leaf_fill(neighbor, temp_keys, temp_values, num_keys) < 0) {
+            while (!dense_leaf_fits(neighbor, temp_keys, split)
+                    || !dense_leaf_fits(n, temp_keys + split, num_keys - split))
+                split += split < (int)neighbor->num_keys ? 1 : -1;
+            dense_leaf_fill(neighbor, temp_keys, temp_values, split);
+            dense_leaf_fill(n, temp_keys + split, temp_values + split * val_size, num_keys - split);
+            buffer_write_page((struct page_t *)n);
+            buffer_write_page((struct page_t *)neighbor);
+
+            // Update the key between n and the neighbor in the parent.
+            parent = (node *)buffer_read_page(table_id, parent_pagenum);
+            for (i = 0; i < (int)parent->num_keys; i++) {
+                if (parent->entries[i * 2] == k_prime) {
+                    parent->entries[i * 2] = temp_keys[split];
+                    break;
+                }
+            }
+            buffer_write_page((struct page_t *)parent);
+            return 0;
+        }
+        neighbor->right_sibling_page_num = n->right_sibling_page_num;
+        set_left_sibling(table_id, neighbor->right_sibling_page_num, neighbor_pagenum);
+
+        free_tree_page((struct page_t *)n);
+        buffer_write_page((struct page_t *)neighbor);
+        delete_entry(table_id, parent_pagenum, k_prime);
+        return 0;
     }
 
     // Starting point in the neighbor for copying records from n.
@@ -1056,10 +1791,11 @@ int coalesce_leaf_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t neighbo
         neighbor->free_space_amount -= 12 + temp_val_size;
     }
     neighbor->right_sibling_page_num = n->right_sibling_page_num;
+    set_left_sibling(table_id, neighbor->right_sibling_page_num, neighbor_pagenum);
 
-    buffer_free_page((struct page_t *)n);
-    buffer_page_unlatch((struct page_t *)neighbor);
-    delete_entry(table_id, n->parent_page_num, k_prime);
+    free_tree_page((struct page_t *)n);
+    buffer_write_page((struct page_t *)neighbor);
+    delete_entry(table_id, parent_pagenum, k_prime);
 
     return 0;
 }
@@ -1152,50 +1888,54 @@ int redistribute_leaf_nodes(int64_t table_id, pagenum_t n_pagenum, pagenum_t nei
                  
     node * parent;
     leaf_node * n, * neighbor;
+    pagenum_t parent_pagenum;
+    uint64_t n_free_space_amount;
     int64_t temp_key;
     int16_t temp_val_size;
+    int moved_index;
     char temp_value[120] = {};
 
-    n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
-    neighbor = (leaf_node *)buffer_read_page(table_id, neighbor_pagenum);
-    parent = (node *)buffer_read_page(table_id, n->parent_page_num);
-
     /* Case: n has a neighbor to the left. 
      * Pull the neighbor's last key-pointer pair over
      * from the neighbor's right end to n's left end.
-     */
-
-    if (neighbor_index != -2) {
-        temp_key = read_leaf_key(neighbor, neighbor->num_keys - 1);
-        temp_val_size = read_leaf_val_size(neighbor, neighbor->num_keys - 1);
-        read_leaf_value(neighbor, temp_value, neighbor->num_keys - 1);
-
-        insert_into_leaf(table_id, n_pagenum, temp_key, temp_value, temp_val_size);
-        remove_entry_from_node(table_id, neighbor_pagenum, temp_key);
-
-        parent->entries[k_prime_index * 2] = read_leaf_key(n, 0);
-    }
-
-    /* Case: n is the leftmost child.
+     * Case: n is the leftmost child.
      * Take a key-pointer pair from the neighbor to the right.
      * Move the neighbor's leftmost key-pointer pair
      * to n's rightmost position.
+     * Repeat until n is back above the threshold. Pages are not
+     * held across the moves since moving a record latches them again.
      */
 
-    else {  
-        temp_key = read_leaf_key(neighbor, 0);
-        temp_val_size = read_leaf_val_size(neighbor, 0);
-        read_leaf_value(neighbor, temp_value, 0);
+    while (true) {
+        n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+        n_free_space_amount = n->free_space_amount;
+        parent_pagenum = n->parent_page_num;
+        buffer_page_unlatch((struct page_t *)n);
+        if (n_free_space_amount < LEAF_FREE_SPACE_THRESHOLD)
+            break;
+
+        neighbor = (leaf_node *)buffer_read_page(table_id, neighbor_pagenum);
+        moved_index = neighbor_index != -2 ? neighbor->num_keys - 1 : 0;
+        temp_key = read_leaf_key(neighbor, moved_index);
+        temp_val_size = read_leaf_val_size(neighbor, moved_index);
+        read_leaf_value(neighbor, temp_value, moved_index);
+        buffer_page_unlatch((struct page_t *)neighbor);
 
         insert_into_leaf(table_id, n_pagenum, temp_key, temp_value, temp_val_size);
         remove_entry_from_node(table_id, neighbor_pagenum, temp_key);
-
-        parent->entries[k_prime_index * 2] = read_leaf_key(neighbor, 0);
     }
 
-    buffer_page_unlatch((struct page_t *)parent);
-    buffer_write_page((struct page_t *)n);
-    buffer_write_page((struct page_t *)neighbor);
+    // Update the key between n and the neighbor in the parent.
+    if (neighbor_index != -2)
+        n = (leaf_node *)buffer_read_page(table_id, n_pagenum);
+    else
+        n = (leaf_node *)buffer_read_page(table_id, neighbor_pagenum);
+    temp_key = read_leaf_key(n, 0);
+    buffer_page_unlatch((struct page_t *)n);
+
+    parent = (node *)buffer_read_page(table_id, parent_pagenum);
+    parent->entries[k_prime_index * 2] = temp_key;
+    buffer_write_page((struct page_t *)parent);
 
     return 0;
 }
@@ -1234,7 +1974,7 @@ int delete_entry( int64_t table_id, pagenum_t node_pagenum, int64_t key) {
     n = (node *)buffer_read_page(table_id, node_pagenum);
     
     // Determine threshold.
-    threshold = n->is_leaf ? 2500 : 124;
+    threshold = n->is_leaf ? LEAF_FREE_SPACE_THRESHOLD : 124;
 
     // Case: node stays at or above minimum.
     if(!n->is_leaf && n->num_keys > threshold
@@ -1300,12 +2040,10 @@ int delete_entry( int64_t table_id, pagenum_t node_pagenum, int64_t key) {
 
         // Leaf node redistribution.
         else {
-            while (((leaf_node *)n)->free_space_amount >= threshold)
-                redistribute_leaf_nodes(table_id, node_pagenum, neighbor_pagenum,
-                                            neighbor_index, k_prime_index, k_prime);
             buffer_page_unlatch((struct page_t *)n);
             buffer_page_unlatch((struct page_t *)neighbor);
-            return 0;
+            return redistribute_leaf_nodes(table_id, node_pagenum, neighbor_pagenum,
+                                            neighbor_index, k_prime_index, k_prime);
         }
     }
     
@@ -1320,12 +2058,22 @@ int delete_entry( int64_t table_id, pagenum_t node_pagenum, int64_t key) {
  */
 int bpt_delete(int64_t table_id, int64_t key) {
     pagenum_t key_leaf_pagenum;
+    leaf_node * leaf;
+    int i, found;
 
     // Find the leaf node that has the key.
     key_leaf_pagenum = find_leaf(table_id, key);
 
-    // Case: the key doesn't exist.
-    if (key_leaf_pagenum < 0)
+    // Case: the tree is empty.
+    if (key_leaf_pagenum == (pagenum_t)-1 || key_leaf_pagenum == 0)
+        return -1;
+
+    // Case: the key does not exist.
+    leaf = (leaf_node *)buffer_read_page(table_id, key_leaf_pagenum);
+    i = leaf_lower_bound(leaf, key);
+    found = i < (int)leaf->num_keys && read_leaf_key(leaf, i) == key;
+    buffer_page_unlatch((struct page_t *)leaf);
+    if (!found)
         return -1;
 
     // Case: the key exists.
@@ -1,31 +1,138 @@
 #include <stdint.h>
+#include <sched.h>
 #include "buffer.h"
+#include "log.h"
 
 struct buffer_pool buffer;
 
 // Initialize Mutex and conditial variable
 pthread_mutex_t buffer_manager_latch = PTHREAD_MUTEX_INITIALIZER;
 
+// Signaled when a page that can be evicted joins the LRU list, for the
+// threads waiting for one.
+pthread_cond_t buffer_evict_cond = PTHREAD_COND_INITIALIZER;
+int buffer_evict_waiters = 0;
+
 // Check the page and return if it exists.
+// The caller must hold the buffer manager latch.
 int buffer_check(int64_t table_id, pagenum_t pagenum) {
-    int i;
-    for(i = 0; i < buffer.num_buf; i++) {
-        if(buffer.list[i].table_id == table_id && buffer.list[i].pagenum == pagenum)
-            return i;
+    auto it = buffer.page_table.find(std::make_pair(table_id, pagenum));
+    if (it == buffer.page_table.end())
+        return -1;
+    return it->second;
+}
+
+// Give a frame the identity of another page.
+// The caller must hold the buffer manager latch.
+static void buffer_set_page(struct buffer_t * page, int64_t table_id, pagenum_t pagenum) {
+    if (page->table_id != -1)
+        buffer.page_table.erase(std::make_pair(page->table_id, (pagenum_t)page->pagenum));
+    page->table_id = table_id;
+    page->pagenum = pagenum;
+    if (table_id != -1)
+        buffer.page_table[std::make_pair(table_id, pagenum)] = page - buffer.list;
+}
+
+// Write a dirty frame to its page, after the log records that changed it.
+static void buffer_flush_frame(struct buffer_t * page) {
+    // The page must not reach the disk before its log records.
+    if (log_flush(page_get_lsn((struct page_t *)page->frame)) != 0) {
+        perror("log flush");
+        exit(EXIT_FAILURE);
+    }
+    file_write_page(page->table_id, page->pagenum, (struct page_t *)page->frame);
+    page->is_dirty = 0;
+}
+
+// Take the least recently used page that can be evicted out of the LRU
+// list and latch it. Pages in the LRU list are never latched, so the
+// trylock succeeds. Pages changed by an unfinished operation must not
+// reach the disk before its log records, so they are skipped, and while
+// every page is latched or pending, the caller waits for one. The pool
+// must hold more pages than a single operation changes.
+// The caller must hold the buffer manager latch.
+static struct buffer_t * buffer_evict_lru() {
+    struct buffer_t * new_page;
+
+    for (;;) {
+        new_page = buffer.LRU_begin->next;
+        while (new_page != buffer.LRU_end && new_page->op_pending)
+            new_page = new_page->next;
+        if (new_page != buffer.LRU_end)
+            break;
+        buffer_evict_waiters++;
+        pthread_cond_wait(&buffer_evict_cond, &buffer_manager_latch);
+        buffer_evict_waiters--;
     }
-    return -1;
+
+    // Update LRU list.
+    new_page->prev->next = new_page->next;
+    new_page->next->prev = new_page->prev;
+
+    // Page Latch
+    pthread_mutex_trylock(&new_page->page_latch);
+    return new_page;
+}
+
+// Add a latched page to the most recently used end of the LRU list.
+// The caller must hold the buffer manager latch, and unlatches the page.
+static void buffer_lru_append(struct buffer_t * page) {
+    page->next = buffer.LRU_end;
+    page->prev = buffer.LRU_end->prev;
+    buffer.LRU_end->prev->next = page;
+    buffer.LRU_end->prev = page;
+    if (buffer_evict_waiters > 0 && !page->op_pending)
+        pthread_cond_broadcast(&buffer_evict_cond);
+}
+
+/* Evict a page and return its frame latched and clean. A dirty victim
+ * keeps its page while it is written without the buffer manager latch, so
+ * other misses do not wait for its log flush and write, and readers of
+ * that page wait on its page latch. Header pages are written under the
+ * latch, since page allocation updates the on-disk header under it.
+ * The caller must hold the buffer manager latch, which is held again on
+ * return but may have been released.
+ */
+static struct buffer_t * buffer_get_frame() {
+    struct buffer_t * page = buffer_evict_lru();
+
+    if (page->is_dirty == 1 && page->pagenum == 0x0) {
+        buffer_flush_frame(page);
+    } else if (page->is_dirty == 1) {
+        pthread_mutex_unlock(&buffer_manager_latch);
+        buffer_flush_frame(page);
+        pthread_mutex_lock(&buffer_manager_latch);
+    }
+    return page;
 }
 
 // Unpin the page.
 void buffer_page_unlatch(struct page_t * page) {
     struct buffer_t * unpin_page = (struct buffer_t *)page;
 
+    // A page joins the LRU list and gets unlatched under the buffer manager
+    // latch, so a page is in the list exactly when it is not latched.
+    pthread_mutex_lock(&buffer_manager_latch);
+    buffer_lru_append(unpin_page);
     pthread_mutex_unlock(&unpin_page->page_latch);
+    pthread_mutex_unlock(&buffer_manager_latch);
+}
+
+// Copy the free page list of the on-disk header page to the cached one.
+// The caller must hold the buffer manager latch.
+static void buffer_sync_header(int64_t table_id) {
+    header_page_t * cached, * on_disk;
+    int buf_index;
 
-    unpin_page->next = buffer.LRU_end;
-    unpin_page->prev = buffer.LRU_end->prev;
-    buffer.LRU_end->prev->next = unpin_page;
-    buffer.LRU_end->prev = unpin_page;
+    buf_index = buffer_check(table_id, 0x0);
+    if (buf_index < 0)
+        return;
+    cached = (header_page_t *)&buffer.list[buf_index];
+    on_disk = (header_page_t *)make_in_momory_page();
+    file_read_page(table_id, 0x0, (struct page_t *)on_disk);
+    cached->free_page_num = on_disk->free_page_num;
+    cached->page_count = on_disk->page_count;
+    free(on_disk);
 }
 
 // Allocate a new page and return the page.
@@ -33,43 +140,24 @@ struct page_t * buffer_alloc_page(int64_t table_id, pagenum_t * ret_pagenum) {
     // Buffer Manager Latch
     pthread_mutex_lock(&buffer_manager_latch);
 
+    // Find LRU page, and write it if it is dirty.
+    struct buffer_t * new_page = buffer_get_frame();
+
     pagenum_t new_pagenum = file_alloc_page(table_id);
     *ret_pagenum = new_pagenum;
 
-    // Find LRU page
-    struct buffer_t * new_page = buffer.LRU_begin->next;
-
-    // Update LRU list.
-    buffer.LRU_begin->next = new_page->next;
-    buffer.LRU_begin->next->prev = buffer.LRU_begin;
-
-    // Write the dirty page.
-    if(new_page->is_dirty == 1)
-        file_write_page(new_page->table_id, new_page->pagenum, (struct page_t *)new_page->frame);
-
     // Fetch the on-disk page to the buffer pool.
     file_read_page(table_id, new_pagenum, (struct page_t *)new_page);
-    new_page->table_id = table_id;
-    new_page->pagenum = new_pagenum;
+    buffer_set_page(new_page, table_id, new_pagenum);
     new_page->is_dirty = 0;
+    new_page->op_pending = 0;
 
-    // Update free page number of the header page on buffer
-    int buf_index;
-    buf_index = buffer_check(table_id, 0x0);
-    if (buf_index >= 0) {
-        ((header_page_t *)&buffer.list[buf_index])->free_page_num 
-            = ((struct page_t *)new_page)->next_page;
-    }
+    // Update the free page list of the header page on buffer
+    buffer_sync_header(table_id);
 
-    // Page Latch
-    int trylock_return = pthread_mutex_trylock(&new_page->page_latch);
     // Buffer Manager Unlatch
     pthread_mutex_unlock(&buffer_manager_latch);
 
-    if (trylock_return != 0) {
-        while (pthread_mutex_trylock(&new_page->page_latch) != 0);
-    }
-
     return (struct page_t *)new_page;
 }
 
@@ -77,74 +165,101 @@ struct page_t * buffer_alloc_page(int64_t table_id, pagenum_t * ret_pagenum) {
 void buffer_free_page(struct page_t * page) {
     struct buffer_t * free_page = (struct buffer_t *)page;
 
-    file_free_page(free_page->table_id, free_page->pagenum);
+    // A page freed by an operation stays allocated until the operation is
+    // logged, since the disk may still hold pages pointing to it.
+    if (log_defer_free(free_page->table_id, free_page->pagenum) != 0)
+        buffer_free_file_page(free_page->table_id, free_page->pagenum);
 
     free_page->is_dirty = 0;
-    free_page->table_id = -1;
-    free_page->pagenum = -1;
+    free_page->op_pending = 0;
+    pthread_mutex_lock(&buffer_manager_latch);
+    buffer_set_page(free_page, -1, -1);
+    pthread_mutex_unlock(&buffer_manager_latch);
 
     // Add the page to LRU list
     buffer_page_unlatch(page);
 }
 
+// Return a page freed by a finished operation to the free page list.
+void buffer_free_file_page(int64_t table_id, pagenum_t pagenum) {
+    pthread_mutex_lock(&buffer_manager_latch);
+    file_free_page(table_id, pagenum);
+    buffer_sync_header(table_id);
+    pthread_mutex_unlock(&buffer_manager_latch);
+}
+
 // Read an on-disk page into a buffer frame.
 // Replace the least recently used buffer page and fetch one.
 struct page_t * buffer_read_page(int64_t table_id, pagenum_t pagenum) {
-    // Buffer Manager Latch
-    pthread_mutex_lock(&buffer_manager_latch);
-
-    // Page already exists in the buffer pool. 
+    struct buffer_t * new_page;
     int buf_index;
-    buf_index = buffer_check(table_id, pagenum);
-    if (buf_index >= 0) {
-        // Update LRU list if the page is in it.
+
+    while (true) {
+        // Buffer Manager Latch
+        pthread_mutex_lock(&buffer_manager_latch);
+
+        // Page already exists in the buffer pool. 
+        buf_index = buffer_check(table_id, pagenum);
+        if (buf_index < 0) {
+            // Find LRU page, and write it if it is dirty.
+            new_page = buffer_get_frame();
+
+            // Another thread may have fetched the page meanwhile.
+            if (buffer_check(table_id, pagenum) < 0)
+                break;
+            buffer_lru_append(new_page);
+            pthread_mutex_unlock(&new_page->page_latch);
+            pthread_mutex_unlock(&buffer_manager_latch);
+            continue;
+        }
+
+        // Page Latch
+        // If another thread holds the page, it may be evicted or replaced
+        // once released, so look the page up again.
+        if (pthread_mutex_trylock(&buffer.list[buf_index].page_latch) != 0) {
+            pthread_mutex_unlock(&buffer_manager_latch);
+            sched_yield();
+            continue;
+        }
+
+        // Take the page out of the LRU list.
         buffer.list[buf_index].prev->next = buffer.list[buf_index].next;
         buffer.list[buf_index].next->prev = buffer.list[buf_index].prev;
 
-        // Page Latch
-        int trylock_return = pthread_mutex_trylock(&buffer.list[buf_index].page_latch);
         // Buffer Manager Unlatch
         pthread_mutex_unlock(&buffer_manager_latch);
-
-        if (trylock_return != 0) {
-            while (pthread_mutex_trylock(&buffer.list[buf_index].page_latch) != 0);
-    }
-
         return (struct page_t *)&buffer.list[buf_index];
     }
 
-    // Find LRU page
-    struct buffer_t * new_page = buffer.LRU_begin->next;
-
-    
-    // Update LRU list.
-    buffer.LRU_begin->next = new_page->next;
-    buffer.LRU_begin->next->prev = buffer.LRU_begin;
+    // The frame takes its new identity before the buffer manager latch is
+    // released, so other readers of the page wait on its page latch
+    // instead of fetching it a second time.
+    buffer_set_page(new_page, table_id, pagenum);
+    new_page->is_dirty = 0;
+    new_page->op_pending = 0;
 
-    // Page Latch
-    int trylock_return = pthread_mutex_trylock(&new_page->page_latch);
     // Buffer Manager Unlatch
     pthread_mutex_unlock(&buffer_manager_latch);
 
-    if (trylock_return != 0) {
-        while (pthread_mutex_trylock(&new_page->page_latch) != 0);
-    }
-
-    // Write the dirty page.
-    if(new_page->is_dirty == 1)
-        file_write_page(new_page->table_id, new_page->pagenum, (struct page_t *)new_page->frame);
-
     // Fetch the on-disk page to the buffer pool.
     file_read_page(table_id, pagenum, (struct page_t *)new_page);
-    new_page->table_id = table_id;
-    new_page->pagenum = pagenum;
-    new_page->is_dirty = 0;
 
     return (struct page_t *)new_page;
 }
 
 // Change buffer page is_dirty status to 1.
+// With a log, the change joins the current operation, or is logged as a
+// page image right away outside of one.
 void buffer_write_page(struct page_t * dirty_page) {
+    struct buffer_t * page = (struct buffer_t *)dirty_page;
+
+    page->is_dirty = 1;
+    log_page_write(page->table_id, page->pagenum, dirty_page, &page->op_pending);
+    buffer_page_unlatch(dirty_page);
+}
+
+// Mark a page dirty whose change is already logged, and unpin it.
+void buffer_write_logged_page(struct page_t * dirty_page) {
     ((struct buffer_t *)dirty_page)->is_dirty = 1;
     buffer_page_unlatch(dirty_page);
 }
@@ -163,6 +278,7 @@ void buffer_init(int num_buf) {
     int i;
     for(i = 0; i < num_buf; i++) {
         buffer.list[i].is_dirty = 0;
+        buffer.list[i].op_pending = 0;
         buffer.list[i].page_latch = PTHREAD_MUTEX_INITIALIZER;
         buffer.list[i].table_id = -1;
         buffer.list[i].pagenum = -1;
@@ -179,6 +295,8 @@ void buffer_init(int num_buf) {
     }
 
     buffer.num_buf = num_buf;
+    buffer.page_table.clear();
+    buffer.page_table.reserve(num_buf);
     buffer.LRU_begin->prev = NULL;
     buffer.LRU_end->next = NULL;
     buffer.LRU_begin->next = &buffer.list[0];
@@ -191,11 +309,30 @@ void buffer_clear() {
     int i;
     for(i = 0; i < buffer.num_buf; i++) {
         if(buffer.list[i].is_dirty == 1)
-            file_write_page(buffer.list[i].table_id, buffer.list[i].pagenum, (struct page_t *)&buffer.list[i]);
+            buffer_flush_frame(&buffer.list[i]);
     }
 
+    buffer.page_table.clear();
     free(buffer.list);
     free(buffer.LRU_begin);
     free(buffer.LRU_end);
     buffer.num_buf = 0;
 }
+
+// Write every dirty page and forget every cached page.
+void buffer_flush_all() {
+    int i;
+
+    pthread_mutex_lock(&buffer_manager_latch);
+    for(i = 0; i < buffer.num_buf; i++) {
+        if(buffer.list[i].is_dirty == 1)
+            buffer_flush_frame(&buffer.list[i]);
+        buffer.list[i].op_pending = 0;
+        buffer.list[i].table_id = -1;
+        buffer.list[i].pagenum = -1;
+    }
+    buffer.page_table.clear();
+    if (buffer_evict_waiters > 0)
+        pthread_cond_broadcast(&buffer_evict_cond);
+    pthread_mutex_unlock(&buffer_manager_latch);
+}
@@ -1,59 +1,177 @@
 #include <stdio.h>
 #include "db.h"
+#include "log.h"
 
 // Open an existing database file or create one if not exist.
-int64_t open_table(const char* pathname){
-    return file_open_table_file(pathname);
+int64_t open_table(const char* pathname, uint16_t fixed_val_size, int compress_keys){
+    // Key compression only applies to the dense layout. The arguments are
+    // checked first, so that a bad layout does not take a table slot.
+    if ((compress_keys && fixed_val_size == 0) || fixed_val_size > MAX_VAL_SIZE)
+        return -1;
+
+    int64_t table_id = file_open_table_file(pathname);
+    if (table_id > 0)
+        log_table(table_id, pathname);
+    if (table_id < 0 || fixed_val_size == 0)
+        return table_id;
+
+    // Record the leaf layout in the header page of an empty table.
+    header_node * header = (header_node *)buffer_read_page(table_id, 0x0);
+    if (header->fixed_val_size == fixed_val_size && header->compress_keys == !!compress_keys) {
+        buffer_page_unlatch((struct page_t *)header);
+        return table_id;
+    }
+    if (header->root_page_num != 0) {
+        buffer_page_unlatch((struct page_t *)header);
+        return -1;
+    }
+    header->fixed_val_size = fixed_val_size;
+    header->compress_keys = !!compress_keys;
+    log_op_begin();
+    buffer_write_page((struct page_t *)header);
+    if (log_flush(log_op_end()) != 0)
+        return -1;
+    return table_id;
+}
+
+// Find the leaf holding a record and the slot of the record in it.
+// Return the leaf latched, or NULL if there is no such record.
+// The caller must hold the tree latch.
+static leaf_node * db_find_record(int64_t table_id, int64_t key,
+                                    pagenum_t * leaf_pagenum, int * index) {
+    leaf_node * leaf;
+    int i;
+
+    *leaf_pagenum = find_leaf(table_id, key);
+    if (*leaf_pagenum == (pagenum_t)-1 || *leaf_pagenum == 0)
+        return NULL;
+
+    leaf = (leaf_node *)buffer_read_page(table_id, *leaf_pagenum);
+    i = leaf_lower_bound(leaf, key);
+    if (i == (int)leaf->num_keys || read_leaf_key(leaf, i) != key) {
+        buffer_page_unlatch((struct page_t *)leaf);
+        return NULL;
+    }
+    *index = i;
+    return leaf;
 }
 
 // Insert a record to the given table.
 int db_insert(int64_t table_id, int64_t key, const char* value,
-uint16_t val_size) {
-    return insert(table_id, key, value, val_size);
+uint16_t val_size, int trx_id) {
+    trx_undo_t *undo = NULL;
+    pagenum_t leaf_pagenum;
+    leaf_node * c;
+    uint64_t lsn;
+    int i, ret, undo_type = UNDO_NONE;
+
+    if (trx_id != 0) {
+        // Trx is already aborted
+        if(trx_find(trx_id) == -1)
+            return -1;
+
+        // The key is locked whether or not the record exists, so readers
+        // and writers of the key wait until this trx ends.
+        if(lock_acquire(table_id, 0, key, trx_id, LOCK_EXCLUSIVE) == NULL)
+            return -1;
+        undo = trx_get_undo(trx_id, table_id, key);
+    }
+
+    pthread_rwlock_wrlock(&tree_latch);
+
+    if (trx_id != 0) {
+        c = db_find_record(table_id, key, &leaf_pagenum, &i);
+        if (c != NULL) {
+            buffer_page_unlatch((struct page_t *)c);
+            pthread_rwlock_unlock(&tree_latch);
+            return -1;
+        }
+
+        // Snapshots taken before the commit do not see the record.
+        undo_type = undo->undo_type;
+        if (undo->undo_type == UNDO_NONE) {
+            if (trx_add_version(trx_id, table_id, key, NULL, VERSION_ABSENT) != 0) {
+                pthread_rwlock_unlock(&tree_latch);
+                trx_abort(trx_id);
+                return -1;
+            }
+            undo->undo_type = UNDO_INSERT;
+        }
+        else if (undo->undo_type == UNDO_DELETE)
+            undo->undo_type = UNDO_UPDATE;
+        log_insert(trx_id, table_id, key, value, val_size);
+    }
+
+    // The pages the insertion changes are logged together.
+    log_op_begin();
+    ret = insert(table_id, key, value, val_size);
+    lsn = log_op_end();
+    if (trx_id != 0 && ret == 0)
+        trx_log_undo(trx_id, UNDO_INSERT, table_id, key, 0, 0, NULL, 0);
+
+    // A failed insertion leaves the record as it was, so the trx does not
+    // change it either.
+    if (trx_id != 0 && ret != 0) {
+        if (undo_type == UNDO_NONE)
+            trx_drop_version(table_id, key);
+        undo->undo_type = undo_type;
+    }
+
+    pthread_rwlock_unlock(&tree_latch);
+
+    // Without a trx, the insertion is durable when it returns.
+    if (trx_id == 0 && log_flush(lsn) != 0)
+        return -1;
+    return ret;
 }
 
-// Find a record with the matching key from the given table.
+// Find a record with the matching key from the given table, as of the
+// start of the transaction. It takes no lock.
 int db_find(int64_t table_id, int64_t key, char* ret_val,
 uint16_t* val_size, int trx_id) {
+    int ret;
+
     // Trx is already aborted
     if(trx_find(trx_id) == -1)
         return -1;
 
-    int i = 0;
-    leaf_node * c;
-    lock_t *acquired_lock;
-
+    // A record missing from the tree may still be in the snapshot.
+    pthread_rwlock_rdlock(&tree_latch);
     pagenum_t leaf_pagenum = find_leaf( table_id, key );
+    if(leaf_pagenum == (pagenum_t)-1)
+        leaf_pagenum = 0;
+    ret = trx_read_version(trx_id, table_id, leaf_pagenum, key, ret_val, val_size);
+    pthread_rwlock_unlock(&tree_latch);
 
-    if(leaf_pagenum == -1 || leaf_pagenum == 0)
-        return -1;
-
-    c = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
+    return ret;
+}
 
-    for (i = 0; i < c->num_keys; i++)
-        if (read_leaf_key(c, i) == key) break;
+// Find a record with the matching key from the given table, for updating
+// it later in the same transaction.
+int db_find_for_update(int64_t table_id, int64_t key, char* ret_val,
+uint16_t* val_size, int trx_id) {
+    int ret;
 
-    // Can't find matching key
-    if (i == c->num_keys) {
-        buffer_page_unlatch((struct page_t *)c);
+    // Trx is already aborted
+    if(trx_find(trx_id) == -1)
         return -1;
-    }
-    buffer_page_unlatch((struct page_t *)c);
 
-    // Can find the matching key, request shared lock
-    acquired_lock = lock_acquire(table_id, leaf_pagenum, key, trx_id, 0);
+    // An optimistic trx validates the record when it commits instead.
+    if(trx_is_optimistic(trx_id))
+        return db_find(table_id, key, ret_val, val_size, trx_id);
 
-    if(acquired_lock == NULL)
+    // A missing key is locked as well, so it stays missing.
+    if(lock_acquire(table_id, 0, key, trx_id, LOCK_UPDATE) == NULL)
         return -1;
 
-    c = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
-
-    *val_size = read_leaf_val_size(c, i);
-    read_leaf_value(c, ret_val, i);
+    pthread_rwlock_rdlock(&tree_latch);
+    pagenum_t leaf_pagenum = find_leaf( table_id, key );
+    if(leaf_pagenum == (pagenum_t)-1)
+        leaf_pagenum = 0;
+    ret = trx_read_version(trx_id, table_id, leaf_pagenum, key, ret_val, val_size);
+    pthread_rwlock_unlock(&tree_latch);
 
-    buffer_page_unlatch((struct page_t *)c);
-    
-    return 0;
+    return ret;
 }
 
 // Update a record with the matching key from the given table.
@@ -63,75 +181,240 @@ int db_update(int64_t table_id, int64_t key, char* value, uint16_t new_val_size,
     if(trx_find(trx_id) == -1)
         return -1;
 
-    int i = 0;
+    int i = 0, ret;
     leaf_node * c;
-    lock_t *acquired_lock;
-    char* original_value;
-
-    pagenum_t leaf_pagenum = find_leaf( table_id, key );
-
-    if(leaf_pagenum == -1 || leaf_pagenum == 0)
-        return -1;
-
-    c = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
+    char old_value[MAX_VAL_SIZE];
+    pagenum_t leaf_pagenum;
 
-    for (i = 0; i < c->num_keys; i++)
-        if (read_leaf_key(c, i) == key) break;
+    pthread_rwlock_rdlock(&tree_latch);
+    c = db_find_record(table_id, key, &leaf_pagenum, &i);
 
-    // Can't find matching key
-    if (i == c->num_keys) {
-        buffer_page_unlatch((struct page_t *)c);
+    // Can't find matching key, or the new value doesn't fit the leaf
+    if (c == NULL || new_val_size > MAX_VAL_SIZE ||
+        (c->fixed_val_size && new_val_size != c->fixed_val_size)) {
+        if (c != NULL)
+            buffer_page_unlatch((struct page_t *)c);
+        pthread_rwlock_unlock(&tree_latch);
         return -1;
     }
     buffer_page_unlatch((struct page_t *)c);
 
+    // An optimistic trx updates the value it sees, when it commits.
+    if (trx_is_optimistic(trx_id)) {
+        ret = trx_read_version(trx_id, table_id, leaf_pagenum, key, old_value, old_val_size);
+        pthread_rwlock_unlock(&tree_latch);
+        if (ret != 0)
+            return -1;
+        return trx_buffer_write(trx_id, table_id, key, value, new_val_size);
+    }
+    pthread_rwlock_unlock(&tree_latch);
+
     // Can find the matching key, request exclusive lock
-    acquired_lock = lock_acquire(table_id, leaf_pagenum, key, trx_id, 1);
-    //printf("Update 2\n");
-    if(acquired_lock == NULL)
+    if(lock_acquire(table_id, leaf_pagenum, key, trx_id, LOCK_EXCLUSIVE) == NULL)
         return -1;
-    
-    c = (leaf_node *)buffer_read_page(table_id, leaf_pagenum);
-
-    // Backup the original value for using when the trx is aborted
-    if(acquired_lock->original_value == NULL) {
-        original_value = (char *)malloc(read_leaf_val_size(c, i) * sizeof(char));
-        read_leaf_value(c, original_value, i);
-        acquired_lock->original_value = original_value;
+
+    return trx_write_record(trx_id, table_id, key, value, new_val_size, old_val_size);
+}
+
+// Delete a record with the matching key from the given table.
+int db_delete(int64_t table_id, int64_t key, int trx_id) {
+    trx_undo_t *undo = NULL;
+    char value[MAX_VAL_SIZE];
+    pagenum_t leaf_pagenum;
+    uint16_t val_size;
+    leaf_node * c;
+    uint64_t lsn;
+    int i, ret;
+
+    if (trx_id != 0) {
+        // Trx is already aborted
+        if(trx_find(trx_id) == -1)
+            return -1;
+
+        if(lock_acquire(table_id, 0, key, trx_id, LOCK_EXCLUSIVE) == NULL)
+            return -1;
+        undo = trx_get_undo(trx_id, table_id, key);
     }
 
-    *old_val_size = read_leaf_val_size(c, i);
-    write_leaf_val_size(c, new_val_size, i);
-    write_leaf_value(c, value, new_val_size, i);
+    pthread_rwlock_wrlock(&tree_latch);
 
-    buffer_page_unlatch((struct page_t *)c);
+    if (trx_id != 0) {
+        c = db_find_record(table_id, key, &leaf_pagenum, &i);
+        if (c == NULL) {
+            pthread_rwlock_unlock(&tree_latch);
+            return -1;
+        }
+        val_size = read_leaf_val_size(c, i);
+        read_leaf_value(c, value, i);
+        buffer_page_unlatch((struct page_t *)c);
 
-    return 0;
-}
+        // Snapshots taken before the commit still see the deleted value.
+        if (undo->undo_type == UNDO_NONE) {
+            if (trx_add_version(trx_id, table_id, key, value, val_size) != 0) {
+                pthread_rwlock_unlock(&tree_latch);
+                trx_abort(trx_id);
+                return -1;
+            }
+            undo->undo_type = UNDO_DELETE;
+        }
+        else if (undo->undo_type == UNDO_UPDATE)
+            undo->undo_type = UNDO_DELETE;
+        log_delete(trx_id, table_id, key, value, val_size);
+    }
 
-// Delete a record with the matching key from the given table.
-int db_delete(int64_t table_id, int64_t key) {
-    return bpt_delete(table_id, key);
+    // The pages the deletion changes are logged together.
+    log_op_begin();
+    ret = bpt_delete(table_id, key);
+    lsn = log_op_end();
+    if (trx_id != 0 && ret == 0)
+        trx_log_undo(trx_id, UNDO_DELETE, table_id, key, 0, 0, value, val_size);
+
+    pthread_rwlock_unlock(&tree_latch);
+
+    // Without a trx, the deletion is durable when it returns.
+    if (trx_id == 0 && log_flush(lsn) != 0)
+        return -1;
+    return ret;
 }
 
 // Find records with a key between the range: 𝑏𝑒𝑔𝑖𝑛_𝑘𝑒𝑦 ≤ 𝑘𝑒𝑦 ≤ 𝑒𝑛𝑑_𝑘𝑒𝑦
 int db_scan(int64_t table_id, int64_t begin_key, int64_t end_key, 
                 std::vector<int64_t>* keys, std::vector<char*>* values,
-                std::vector<uint16_t>* val_sizes) {
-    return find_range(table_id, begin_key, end_key, keys, values, val_sizes);
+                std::vector<uint16_t>* val_sizes, int trx_id) {
+    int ret;
+
+    // The range stays as scanned until the trx ends, keys not yet
+    // inserted included.
+    if (trx_id != 0 &&
+        lock_acquire_range(table_id, begin_key, end_key, trx_id, LOCK_SHARED) != 0)
+        return -1;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = find_range(table_id, begin_key, end_key, keys, values, val_sizes);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Find records with a key between the range: begin_key ≤ key ≤ end_key
+// that pass the predicate of the filter.
+int db_scan_filter(int64_t table_id, int64_t begin_key, int64_t end_key,
+                    const struct scan_filter_t * filter,
+                    std::vector<int64_t>* keys, std::vector<char*>* values,
+                    std::vector<uint16_t>* val_sizes) {
+    int ret;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = find_range_filtered(table_id, begin_key, end_key, filter, keys, values, val_sizes);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Scan records with a key between the range: begin_key ≤ key ≤ end_key
+// with up to num_threads threads, passing each record to callback.
+int db_parallel_scan(int64_t table_id, int64_t begin_key, int64_t end_key,
+                        int num_threads, scan_callback_t callback, void * arg) {
+    int ret;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = find_range_parallel(table_id, begin_key, end_key, num_threads, callback, arg);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Find records with a key between the range: begin_key ≤ key ≤ end_key
+// in descending key order, returning at most limit records (0: no limit).
+int db_scan_reverse(int64_t table_id, int64_t begin_key, int64_t end_key, int limit,
+                    std::vector<int64_t>* keys, std::vector<char*>* values,
+                    std::vector<uint16_t>* val_sizes) {
+    int ret;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = find_range_reverse(table_id, begin_key, end_key, limit, keys, values, val_sizes);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Find the keys between the range: begin_key ≤ key ≤ end_key, without
+// reading the values.
+int db_scan_keys(int64_t table_id, int64_t begin_key, int64_t end_key,
+                    std::vector<int64_t>* keys) {
+    int ret;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = find_range_keys(table_id, begin_key, end_key, keys);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Gather leaf statistics of the given table.
+int db_table_stats(int64_t table_id, struct table_stats_t * stats) {
+    int ret;
+
+    pthread_rwlock_rdlock(&tree_latch);
+    ret = get_table_stats(table_id, stats);
+    pthread_rwlock_unlock(&tree_latch);
+    return ret;
+}
+
+// Gather contention statistics of the lock manager.
+int db_lock_stats(struct lock_stats_t * stats) {
+    return lock_get_stats(stats);
+}
+
+// Find the keys with the longest total lock wait.
+int db_lock_hot_keys(int limit, std::vector<struct lock_key_stats_t>* keys) {
+    return lock_get_hot_keys(limit, keys);
+}
+
+// Print the lock statistics and the hot keys.
+void db_print_lock_stats(FILE* out, int limit) {
+    const char* cause_names[] = { "deadlock", "upgrade", "timeout", "no-wait", "wounded" };
+    const char* level_names[] = { "record", "block", "table" };
+    std::vector<struct lock_key_stats_t> keys;
+    struct lock_stats_t stats;
+    int i, bin;
+
+    lock_get_stats(&stats);
+    fprintf(out, "lock waits: %llu, %llu us\n", (unsigned long long)stats.waits,
+            (unsigned long long)stats.wait_us);
+    for (bin = 0; bin < LOCK_WAIT_BIN_NUMBER; bin++) {
+        if (stats.wait_histogram[bin] == 0) continue;
+        fprintf(out, "  < %llu us: %llu\n", 1ULL << bin, (unsigned long long)stats.wait_histogram[bin]);
+    }
+    fprintf(out, "deadlocks: %llu\n", (unsigned long long)stats.deadlocks);
+    fprintf(out, "aborts:");
+    for (i = 0; i < LOCK_ABORT_CAUSE_NUMBER; i++)
+        fprintf(out, " %s %llu", cause_names[i], (unsigned long long)stats.aborts[i]);
+    fprintf(out, "\nlongest queue: %llu\n", (unsigned long long)stats.max_queue_length);
+    fprintf(out, "latch: %llu acquires, %llu waits, %llu ns waiting, %.0f ns held on average\n",
+            (unsigned long long)stats.latch_acquires, (unsigned long long)stats.latch_waits,
+            (unsigned long long)stats.latch_wait_ns,
+            stats.latch_hold_samples ? (double)stats.latch_hold_ns / stats.latch_hold_samples : 0.0);
+
+    lock_get_hot_keys(limit, &keys);
+    for (i = 0; i < (int)keys.size(); i++) {
+        fprintf(out, "hot %s %lld/%lld: %llu waits, %llu us, max %llu us, queue %llu\n",
+                level_names[keys[i].level], (long long)keys[i].table_id, (long long)keys[i].key,
+                (unsigned long long)keys[i].waits, (unsigned long long)keys[i].wait_us,
+                (unsigned long long)keys[i].max_wait_us, (unsigned long long)keys[i].max_queue_length);
+    }
 }
 
 // Initialize the database system.
-int init_db(int num_buf) {
+int init_db(int num_buf, const char* log_path) {
     file_init_table_list(20);
     buffer_init(num_buf);
     init_lock_table();
+    if (log_path != NULL)
+        return log_open(log_path);
     return 0;
 }
 
 // Shutdown the database system.
 int shutdown_db() {
+    trx_flush_commits();
     buffer_clear();
+    log_close();
     file_close_table_file();
     return 0;
 }
@@ -7,6 +7,10 @@
 // The list of file descriptor
 struct table_list_t table_list;
 
+// Whether data pages may reach the disk lazily. Header pages, which hold
+// the free page list, are always written through.
+int file_lazy_writes = 0;
+
 void file_init_table_list(int max_table) {
   table_list.num_of_tables = 0;
   table_list.list.clear();
@@ -15,7 +19,8 @@ void file_init_table_list(int max_table) {
 
 struct page_t* make_in_momory_page() {
   struct page_t * new_page;
-  new_page = (struct page_t*)malloc(PAGE_SIZE);
+  // Zeroed, so new pages start with LSN 0.
+  new_page = (struct page_t*)calloc(1, PAGE_SIZE);
   if (new_page == NULL) {
     perror("Node creation.");
     exit(EXIT_FAILURE);
@@ -31,7 +36,7 @@ int64_t file_open_table_file(const char* pathname) {
     return -1;
 
   // Open file
-  int fd = open(pathname, O_SYNC | O_CREAT | O_RDWR, 0777);
+  int fd = open(pathname, O_CREAT | O_RDWR, 0777);
   uint64_t* check_magic = (uint64_t *)malloc(sizeof(uint64_t));
   int size = pread(fd, check_magic, 8, 0);
   
@@ -56,6 +61,9 @@ int64_t file_open_table_file(const char* pathname) {
     header_page->magic_num = 2022;
     header_page->free_page_num = 0X0001;
     header_page->page_count = INITIAL_DB_NUM_OF_PAGES;
+    header_page->root_page_num = 0x0;
+    header_page->fixed_val_size = 0;
+    header_page->compress_keys = 0;
     file_write_page(table_id, 0x0, (struct page_t*)header_page);
     free(header_page);
 
@@ -131,6 +139,7 @@ void file_free_page(int64_t table_id, pagenum_t pagenum) {
   // Insert page to free page list
   page->next_page = header_page->free_page_num;
   header_page->free_page_num = pagenum;
+  file_write_page(table_id, pagenum, page);
   file_write_page(table_id, 0x0, (struct page_t*)header_page);
 
   free(page);
@@ -149,8 +158,20 @@ void file_write_page(int64_t table_id, pagenum_t pagenum, const struct page_t* s
   if(table_id > table_list.num_of_tables || table_id < 0)
     return;
   pwrite(table_list.list[table_id], src, PAGE_SIZE, PAGE_SIZE * pagenum);
-  sync();
+  // Writing the header also forces the pages written before it.
+  if(!file_lazy_writes || pagenum == 0x0)
+    fsync(table_list.list[table_id]);
+}
+
+// Let data pages reach the disk lazily, or force every write.
+void file_set_lazy_writes(int lazy) {
+  file_lazy_writes = lazy;
+}
 
+// Force the pages written so far to the disk.
+void file_sync_table_files() {
+  for(auto &table : table_list.list)
+    fsync(table.second);
 }
 
 // Close the database file
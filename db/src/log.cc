@@ -0,0 +1,567 @@
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "bpt.h"
+
+// Magic number of the log file.
+#define LOG_MAGIC_NUM 2023
+
+// Size of the log buffer that makes an append write it out.
+#define LOG_BUFFER_LIMIT (1024 * 1024)
+
+// Header of the log file. The record right after it has LSN base_lsn, and
+// each following record the LSN of the byte it starts at, so LSNs keep
+// growing when the log is truncated.
+struct log_file_header_t {
+    uint64_t magic_num;
+    uint64_t base_lsn;
+};
+
+// Operation of a thread, whose pages are logged when it ends.
+struct log_op_t {
+    int op_id;  // 0: no operation
+    std::vector<std::pair<int64_t, pagenum_t>> pages;
+    std::set<std::pair<int64_t, pagenum_t>> freed;
+};
+
+// Log file descriptor, -1 while no log is open.
+int log_fd = -1;
+uint64_t log_base_lsn;
+
+// Latch of the log buffer and the LSN of the next record.
+pthread_mutex_t log_latch = PTHREAD_MUTEX_INITIALIZER;
+std::vector<char> log_buffer;
+uint64_t log_buffer_lsn;
+uint64_t log_next_lsn;
+
+// Held by the thread writing the log buffer out. Threads flushing at the
+// same time wait for it and find their records written.
+pthread_mutex_t log_flush_latch = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<uint64_t> log_flushed_lsn;
+
+std::atomic<int> log_next_op_id;
+static thread_local log_op_t log_op;
+
+// FNV-1a hash of the record except its checksum field.
+static uint32_t log_checksum(const log_record_t *rec) {
+    const uint8_t *bytes = (const uint8_t *)rec;
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < rec->size; i++) {
+        if (i == offsetof(log_record_t, checksum))
+            i += sizeof(rec->checksum);
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Append a record with its payload to the log buffer and return its LSN.
+// A page in the payload gets the LSN of the record before it is copied.
+static uint64_t log_append(log_record_t *rec, const void *data1, size_t size1,
+                           const void *data2, size_t size2, struct page_t *page) {
+    size_t offset;
+    uint64_t lsn;
+    int full;
+
+    // Records are 8-byte aligned in the log.
+    rec->size = (sizeof(log_record_t) + size1 + size2 + 7) & ~(size_t)7;
+    rec->reserved = 0;
+    rec->checksum = 0;
+
+    pthread_mutex_lock(&log_latch);
+    lsn = rec->lsn = log_next_lsn;
+    if (page != NULL)
+        page_set_lsn(page, lsn);
+
+    offset = log_buffer.size();
+    log_buffer.resize(offset + rec->size);
+    memcpy(&log_buffer[offset], rec, sizeof(log_record_t));
+    if (size1 > 0)
+        memcpy(&log_buffer[offset + sizeof(log_record_t)], data1, size1);
+    if (size2 > 0)
+        memcpy(&log_buffer[offset + sizeof(log_record_t) + size1], data2, size2);
+    ((log_record_t *)&log_buffer[offset])->checksum = log_checksum((log_record_t *)&log_buffer[offset]);
+
+    log_next_lsn += rec->size;
+    full = log_buffer.size() >= LOG_BUFFER_LIMIT;
+    pthread_mutex_unlock(&log_latch);
+
+    if (full)
+        log_flush(lsn);
+    return lsn;
+}
+
+// Write the whole data at the offset of the log file, and return -1 if it
+// fails.
+static int log_write(const char *data, size_t size, off_t offset) {
+    ssize_t written;
+
+    while (size > 0) {
+        written = pwrite(log_fd, data, size, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+/* Make every log record up to the one at lsn durable. The first thread to
+ * get the flush latch writes out the records of every waiting thread.
+ * Returns -1 if the records could not be written. They are then kept in
+ * the log buffer, and the next flush tries again.
+ */
+int log_flush(uint64_t lsn) {
+    std::vector<char> data;
+    uint64_t start, end;
+    int ret = 0;
+
+    if (log_fd < 0 || lsn < log_flushed_lsn)
+        return 0;
+
+    pthread_mutex_lock(&log_flush_latch);
+    if (lsn >= log_flushed_lsn) {
+        pthread_mutex_lock(&log_latch);
+        data.swap(log_buffer);
+        start = log_buffer_lsn;
+        end = log_buffer_lsn = log_next_lsn;
+        pthread_mutex_unlock(&log_latch);
+
+        if (!data.empty() &&
+            (log_write(data.data(), data.size(), sizeof(log_file_header_t) + start - log_base_lsn) != 0 ||
+             fdatasync(log_fd) != 0)) {
+            // Put the records back in front of the ones appended meanwhile.
+            pthread_mutex_lock(&log_latch);
+            data.insert(data.end(), log_buffer.begin(), log_buffer.end());
+            log_buffer.swap(data);
+            log_buffer_lsn = start;
+            pthread_mutex_unlock(&log_latch);
+            ret = -1;
+        } else {
+            log_flushed_lsn = end;
+        }
+    }
+    pthread_mutex_unlock(&log_flush_latch);
+    return ret;
+}
+
+// Log the table file given to a table id.
+void log_table(int64_t table_id, const char *pathname) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return;
+    rec.type = LOG_TABLE;
+    rec.table_id = table_id;
+    log_append(&rec, pathname, strlen(pathname), NULL, 0, NULL);
+}
+
+// Log an update of a record, and return its LSN.
+uint64_t log_update(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key,
+                    const char *before, uint16_t before_size,
+                    const char *after, uint16_t after_size) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return 0;
+    rec.type = LOG_UPDATE;
+    rec.trx_id = trx_id;
+    rec.table_id = table_id;
+    rec.pagenum = pagenum;
+    rec.key = key;
+    rec.before_size = before_size;
+    rec.after_size = after_size;
+    return log_append(&rec, before, before_size, after, after_size, NULL);
+}
+
+// Log an insertion or a deletion of a record by a transaction, ahead of
+// the operation that makes it, and return its LSN.
+uint64_t log_insert(int trx_id, int64_t table_id, int64_t key,
+                    const char *value, uint16_t val_size) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return 0;
+    rec.type = LOG_INSERT;
+    rec.trx_id = trx_id;
+    rec.table_id = table_id;
+    rec.key = key;
+    rec.after_size = val_size;
+    return log_append(&rec, value, val_size, NULL, 0, NULL);
+}
+
+uint64_t log_delete(int trx_id, int64_t table_id, int64_t key,
+                    const char *value, uint16_t val_size) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return 0;
+    rec.type = LOG_DELETE;
+    rec.trx_id = trx_id;
+    rec.table_id = table_id;
+    rec.key = key;
+    rec.before_size = val_size;
+    return log_append(&rec, value, val_size, NULL, 0, NULL);
+}
+
+// Log the end of a transaction, and return its LSN.
+static uint64_t log_trx_end(int trx_id, int type) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return 0;
+    rec.type = type;
+    rec.trx_id = trx_id;
+    return log_append(&rec, NULL, 0, NULL, 0, NULL);
+}
+
+uint64_t log_commit(int trx_id) {
+    return log_trx_end(trx_id, LOG_COMMIT);
+}
+
+uint64_t log_abort(int trx_id) {
+    return log_trx_end(trx_id, LOG_ABORT);
+}
+
+// Start an operation of the calling thread.
+void log_op_begin() {
+    if (log_fd < 0)
+        return;
+    log_op.op_id = ++log_next_op_id;
+}
+
+// Log every page the operation of the calling thread changed. The pages
+// stay pinned to the buffer until the end of the operation is logged too,
+// so recovery never finds a part of an operation on the disk.
+// Return the LSN of the end of the operation, or 0 if nothing was logged.
+uint64_t log_op_end() {
+    struct page_t *page, *freed_page;
+    log_record_t rec = {};
+    uint64_t lsn;
+
+    if (log_op.op_id == 0)
+        return 0;
+
+    for (auto &p : log_op.pages) {
+        if (log_op.freed.count(p))
+            continue;
+        page = buffer_read_page(p.first, p.second);
+        rec.type = LOG_PAGE;
+        rec.trx_id = log_op.op_id;
+        rec.table_id = p.first;
+        rec.pagenum = p.second;
+        log_append(&rec, page, PAGE_SIZE, NULL, 0, page);
+        buffer_page_unlatch(page);
+    }
+
+    rec = {};
+    rec.type = LOG_OP_END;
+    rec.trx_id = log_op.op_id;
+    lsn = log_append(&rec, NULL, 0, NULL, 0, NULL);
+
+    for (auto &p : log_op.pages) {
+        if (log_op.freed.count(p))
+            continue;
+        page = buffer_read_page(p.first, p.second);
+        ((struct buffer_t *)page)->op_pending = 0;
+        buffer_page_unlatch(page);
+    }
+
+    // No page on the disk points to the freed pages once the operation is
+    // durable. They get its LSN so that recovery does not redo older images
+    // over the free page list. They stay allocated if the log cannot be
+    // written.
+    if (!log_op.freed.empty() && log_flush(lsn) == 0) {
+        freed_page = make_in_momory_page();
+        for (auto &p : log_op.freed) {
+            file_read_page(p.first, p.second, freed_page);
+            page_set_lsn(freed_page, lsn);
+            file_write_page(p.first, p.second, freed_page);
+            buffer_free_file_page(p.first, p.second);
+        }
+        free(freed_page);
+    }
+
+    log_op.pages.clear();
+    log_op.freed.clear();
+    log_op.op_id = 0;
+    return lsn;
+}
+
+// Log a changed page, or add it to the operation of the calling thread.
+void log_page_write(int64_t table_id, pagenum_t pagenum, struct page_t *page,
+                    int *op_pending) {
+    log_record_t rec = {};
+
+    if (log_fd < 0)
+        return;
+    if (log_op.op_id != 0) {
+        if (!*op_pending) {
+            *op_pending = 1;
+            log_op.pages.push_back(std::make_pair(table_id, pagenum));
+        }
+        return;
+    }
+    rec.type = LOG_PAGE;
+    rec.table_id = table_id;
+    rec.pagenum = pagenum;
+    log_append(&rec, page, PAGE_SIZE, NULL, 0, page);
+}
+
+// Keep a page freed by the operation of the calling thread until the
+// operation is logged. Return non-zero if the page can be freed now.
+int log_defer_free(int64_t table_id, pagenum_t pagenum) {
+    if (log_op.op_id == 0)
+        return 1;
+    log_op.freed.insert(std::make_pair(table_id, pagenum));
+    return 0;
+}
+
+// Write a value of a record to its leaf if the leaf is older than lsn.
+// Return non-zero if the leaf does not hold the record.
+static int log_apply_value(int64_t table_id, pagenum_t pagenum, int64_t key,
+                           const char *value, uint16_t val_size, uint64_t lsn) {
+    leaf_node *leaf;
+    int i;
+
+    leaf = (leaf_node *)buffer_read_page(table_id, pagenum);
+    if (lsn != 0 && page_get_lsn((struct page_t *)leaf) >= lsn) {
+        buffer_page_unlatch((struct page_t *)leaf);
+        return 0;
+    }
+    if (!leaf->is_leaf) {
+        buffer_page_unlatch((struct page_t *)leaf);
+        return -1;
+    }
+    i = leaf_lower_bound(leaf, key);
+    if (i == (int)leaf->num_keys || read_leaf_key(leaf, i) != key) {
+        buffer_page_unlatch((struct page_t *)leaf);
+        return -1;
+    }
+    write_leaf_val_size(leaf, val_size, i);
+    write_leaf_value(leaf, value, val_size, i);
+    if (lsn != 0)
+        page_set_lsn((struct page_t *)leaf, lsn);
+    buffer_write_logged_page((struct page_t *)leaf);
+    return 0;
+}
+
+// Write a value of a record to the leaf the record is in now.
+static void log_apply_value_by_key(int64_t table_id, int64_t key,
+                                   const char *value, uint16_t val_size, uint64_t lsn) {
+    pagenum_t pagenum = find_leaf(table_id, key);
+
+    if (pagenum == (pagenum_t)-1 || pagenum == 0)
+        return;
+    log_apply_value(table_id, pagenum, key, value, val_size, lsn);
+}
+
+// Redo a page image if the page is older than it. The free page list of
+// a header page is kept, since the disk always has the latest one.
+static void log_redo_page(int64_t table_id, const log_record_t *rec) {
+    struct page_t *page;
+    header_node *header;
+    pagenum_t free_page_num;
+    uint64_t page_count;
+
+    page = buffer_read_page(table_id, rec->pagenum);
+    if (page_get_lsn(page) >= rec->lsn) {
+        buffer_page_unlatch(page);
+        return;
+    }
+    header = (header_node *)page;
+    free_page_num = header->free_page_num;
+    page_count = header->page_count;
+    memcpy(page, rec + 1, PAGE_SIZE);
+    if (rec->pagenum == 0x0) {
+        header->free_page_num = free_page_num;
+        header->page_count = page_count;
+    }
+    buffer_write_logged_page(page);
+}
+
+// Recover the tables from the log records: redo every finished operation
+// and every update, then undo the updates of unfinished transactions.
+static void log_recover(const std::vector<const log_record_t *> &records) {
+    std::unordered_set<int> ended_ops, ended_trxs;
+    std::map<std::string, int64_t> opened;
+    std::map<int64_t, int64_t> tables;
+    const char *before, *after;
+    char value[MAX_VAL_SIZE];
+    uint16_t val_size;
+    int64_t table_id;
+
+    for (auto rec : records) {
+        if (rec->type == LOG_OP_END)
+            ended_ops.insert(rec->trx_id);
+        else if (rec->type == LOG_COMMIT || rec->type == LOG_ABORT)
+            ended_trxs.insert(rec->trx_id);
+    }
+
+    // Redo.
+    for (auto rec : records) {
+        if (rec->type == LOG_TABLE) {
+            const char *payload = (const char *)(rec + 1);
+            std::string path(payload, strnlen(payload, rec->size - sizeof(log_record_t)));
+            tables.erase(rec->table_id);
+            if (opened.count(path) == 0) {
+                // A table file removed after the crash has nothing to recover.
+                if (access(path.c_str(), F_OK) != 0)
+                    continue;
+                table_id = file_open_table_file(path.c_str());
+                if (table_id <= 0)
+                    continue;
+                opened[path] = table_id;
+            }
+            tables[rec->table_id] = opened[path];
+            continue;
+        }
+        if (tables.count(rec->table_id) == 0)
+            continue;
+        table_id = tables[rec->table_id];
+
+        if (rec->type == LOG_PAGE) {
+            if (rec->trx_id == 0 || ended_ops.count(rec->trx_id))
+                log_redo_page(table_id, rec);
+        }
+        else if (rec->type == LOG_UPDATE) {
+            after = (const char *)(rec + 1) + rec->before_size;
+            if (log_apply_value(table_id, rec->pagenum, rec->key, after, rec->after_size, rec->lsn) != 0)
+                log_apply_value_by_key(table_id, rec->key, after, rec->after_size, rec->lsn);
+        }
+    }
+
+    // Undo, newest change first. Insertions and deletions were redone
+    // with the pages of their operations, if those ended.
+    for (auto it = records.rbegin(); it != records.rend(); ++it) {
+        const log_record_t *rec = *it;
+        if (rec->trx_id == 0 || ended_trxs.count(rec->trx_id) || tables.count(rec->table_id) == 0)
+            continue;
+        table_id = tables[rec->table_id];
+        before = (const char *)(rec + 1);
+        if (rec->type == LOG_UPDATE)
+            log_apply_value_by_key(table_id, rec->key, before, rec->before_size, 0);
+        else if (rec->type == LOG_INSERT && find(table_id, rec->key, value, &val_size) == 0)
+            bpt_delete(table_id, rec->key);
+        else if (rec->type == LOG_DELETE)
+            insert(table_id, rec->key, before, rec->before_size);
+    }
+
+    // Checkpoint, so that the log is not needed any more.
+    buffer_flush_all();
+    file_sync_table_files();
+    file_close_table_file();
+}
+
+// Start an empty log whose first record gets base_lsn.
+static int log_reset(int fd, uint64_t base_lsn) {
+    log_file_header_t header;
+
+    header.magic_num = LOG_MAGIC_NUM;
+    header.base_lsn = base_lsn;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+        || ftruncate(fd, sizeof(header)) != 0)
+        return -1;
+    fsync(fd);
+
+    log_base_lsn = base_lsn;
+    log_buffer.clear();
+    log_buffer_lsn = log_next_lsn = base_lsn;
+    log_flushed_lsn = base_lsn;
+    return 0;
+}
+
+// Open the log file, recover the tables it covers and start a new log.
+int log_open(const char *pathname) {
+    std::vector<const log_record_t *> records;
+    std::vector<char> data;
+    log_file_header_t header;
+    const log_record_t *rec;
+    uint64_t base_lsn = 1;
+    size_t offset;
+    off_t size;
+    int fd;
+
+    // A log still open was left by a crash.
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = -1;
+    log_op.pages.clear();
+    log_op.freed.clear();
+    log_op.op_id = 0;
+
+    fd = open(pathname, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size > 0) {
+        if (size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic_num != LOG_MAGIC_NUM) {
+            close(fd);
+            return -1;
+        }
+        base_lsn = header.base_lsn;
+
+        // Keep the records up to the first one that was not fully written.
+        data.resize(size - sizeof(header));
+        if (pread(fd, data.data(), data.size(), sizeof(header)) != (ssize_t)data.size())
+            data.clear();
+        offset = 0;
+        while (offset + sizeof(log_record_t) <= data.size()) {
+            rec = (const log_record_t *)&data[offset];
+            if (rec->size < sizeof(log_record_t) || rec->size > data.size() - offset
+                || rec->lsn != base_lsn + offset || rec->checksum != log_checksum(rec))
+                break;
+            records.push_back(rec);
+            offset += rec->size;
+        }
+        base_lsn += offset;
+    }
+
+    // Data pages reach the disk lazily from now on.
+    file_set_lazy_writes(1);
+    log_recover(records);
+
+    if (log_reset(fd, base_lsn) != 0) {
+        close(fd);
+        return -1;
+    }
+    log_fd = fd;
+    return 0;
+}
+
+// Write the whole log, make the tables durable and close the log. Every
+// page must already be written.
+void log_close() {
+    if (log_fd < 0)
+        return;
+
+    // The log is kept for recovery if it cannot be written out.
+    if (log_flush(std::numeric_limits<uint64_t>::max()) == 0) {
+        file_sync_table_files();
+        log_reset(log_fd, log_next_lsn);
+    }
+    close(log_fd);
+    log_fd = -1;
+    file_set_lazy_writes(0);
+}
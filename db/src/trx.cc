@@ -1,7 +1,18 @@
 #include "trx.h"
 
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <limits>
+
+#include "log.h"
+
 // Global transaction id.
-int global_trx_id;
+std::atomic<int> global_trx_id(0);
 
 // For using pair as a hash key.
 struct pair_hash {
@@ -11,363 +22,2588 @@ struct pair_hash {
     }
 };
 
+// Name of a lock queue: a record, a block of keys or a whole table.
+struct lock_name_t {
+    int64_t table_id;
+    int64_t key;
+    int level;
+
+    bool operator==(const lock_name_t &other) const {
+        return table_id == other.table_id && key == other.key && level == other.level;
+    }
+};
+
+struct lock_name_hash {
+    std::size_t operator()(const lock_name_t &name) const {
+        return pair_hash()(std::make_pair(name.table_id, name.key)) ^ ((std::size_t)name.level << 20);
+    }
+};
+
+
+// Number of partitions of the lock table.
+#define LOCK_BUCKET_NUMBER 128
+
+// Number of keys whose waits each bucket keeps.
+#define LOCK_HOT_KEY_NUMBER 32
+
+// Contention statistics of a bucket.
+struct lock_bucket_stats_t {
+    uint64_t waits;
+    uint64_t wait_us;
+    uint64_t wait_histogram[LOCK_WAIT_BIN_NUMBER];
+    uint64_t max_queue_length;
+    uint64_t latch_acquires;
+    uint64_t latch_waits;
+    uint64_t latch_wait_ns;
+    uint64_t latch_hold_samples;
+    uint64_t latch_hold_ns;
+    int num_hot_keys;
+    // Kept apart from the bucket, which stays small.
+    lock_key_stats_t *hot_keys;
+};
+
+// A partition of the lock table with its own latch.
+struct lock_bucket_t {
+    pthread_mutex_t latch;
+    std::unordered_map <lock_name_t, lock_table_t, lock_name_hash> table;
+    // Newest commit LSN of a transaction that released a lock here before
+    // its commit was durable. Locks on lock words update it without the
+    // latch.
+    std::atomic<uint64_t> commit_lsn;
+
+    // Updated under the latch.
+    lock_bucket_stats_t stats;
+    // When the holder took the latch, if its hold time is sampled, or 0.
+    uint64_t latched_at;
+};
+
+// A table or block a transaction locked, with the locks it holds below it.
+struct trx_granule_t {
+    lock_t *lock;
+    int child_locks;
+    int child_writes;       // Set once a child lock allows writing.
+    int escalate_at;        // Number of child locks that triggers escalation.
+};
+
+// Bump allocator whose memory is released all at once.
+struct trx_arena_t {
+    std::vector<char *> chunks;
+    size_t used;
+    size_t capacity;
+};
+
+// Concurrency control of a transaction.
+enum trx_mode_t {
+    TRX_LOCKING,        // Strict 2PL, with snapshot reads.
+    TRX_READ_ONLY,      // Snapshot reads only.
+    TRX_OPTIMISTIC,     // Writes are buffered and validated at commit.
+};
+
+// An update buffered by an optimistic transaction.
+struct trx_write_t {
+    int64_t table_id;
+    int64_t key;
+    uint16_t val_size;
+    char value[];
+};
+
+// A change to undo on abort, in the undo log of a transaction. An update
+// in place is undone in place, in the leaf and slot that held the record
+// when it was changed, as long as no page has been freed from the trees
+// since.
+struct trx_undo_rec_t {
+    trx_undo_rec_t *prev;       // The change made before, or NULL.
+    int64_t table_id;
+    int64_t key;
+    pagenum_t pagenum;          // 0 if the change moved the record.
+    uint64_t free_count;        // tree_free_count when it was changed.
+    uint16_t slot;
+    uint16_t before_size;
+    int undo_type;
+    char before[];              // The value before the change.
+};
+
+// Struct of transaction object.
+struct trx_t {
+    // Cleared when the transaction ends.
+    std::atomic<int> trx_id;
+    lock_t *head;
+
+    // Undo log of the transaction, newest change first, and buffered
+    // writes.
+    trx_arena_t undo_arena;
+    trx_undo_rec_t *undo_log;
+
+    // Transactions that the pending lock request waits for.
+    pthread_mutex_t latch;
+    std::vector<int> wait_for;
+    lock_t *waiting_lock;
+
+    // Set when another transaction chose this one to abort, and why.
+    std::atomic<int> abort_requested;
+    std::atomic<int> abort_cause;
+
+    // Cost of aborting the transaction, read by deadlock detection.
+    std::atomic<int> lock_count;
+    std::atomic<size_t> undo_bytes;
+
+    // Commit timestamp of the newest commit the transaction reads.
+    int64_t snapshot_ts;
+
+    // Commit LSN that must be durable before the transaction commits, as
+    // it may have seen the changes of a transaction that released its
+    // locks early.
+    uint64_t depend_lsn;
+
+    int mode;
+
+    // Records read and updates buffered by an optimistic transaction.
+    std::unordered_set<std::pair<int64_t, int64_t>, pair_hash> read_set;
+    std::unordered_map<std::pair<int64_t, int64_t>, trx_write_t *, pair_hash> write_set;
+
+    // Tables and blocks locked by the transaction.
+    std::unordered_map<lock_name_t, trx_granule_t, lock_name_hash> granules;
+
+    // First changes of the records the transaction changed, in order.
+    std::unordered_map<std::pair<int64_t, int64_t>, trx_undo_t *, pair_hash> undo_index;
+    std::vector<trx_undo_t *> undo_records;
+};
+
+
+// Number of partitions of the transaction table.
+#define TRX_SHARD_NUMBER 64
+
+// A partition of the transaction table with its own latch.
+struct trx_shard_t {
+    pthread_mutex_t latch;
+    std::unordered_map<int, trx_t *> table;
+};
+
 
 // Lock Table
-std::unordered_map <std::pair<int64_t, int64_t>, lock_table_t, pair_hash> lock_table;
+lock_bucket_t lock_buckets[LOCK_BUCKET_NUMBER];
+lock_key_stats_t lock_hot_keys[LOCK_BUCKET_NUMBER][LOCK_HOT_KEY_NUMBER];
 // Transaction Table
-std::unordered_map<int, lock_t *> trx_table;
+trx_shard_t trx_shards[TRX_SHARD_NUMBER];
 
+// The transaction last begun or found by this thread.
+static thread_local trx_t *trx_context = NULL;
 
-// Initialize Mutex and conditial variable
-pthread_mutex_t lock_manager_latch = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t trx_manager_latch = PTHREAD_MUTEX_INITIALIZER;
+// Deadlock policy and its lock wait timeout.
+std::atomic<int> deadlock_policy(DEADLOCK_DETECT);
+std::atomic<int> lock_wait_timeout_ms(1000);
 
-// Wait-for graph
-std::unordered_map <int, std::vector<int>> wait_for;
+// Numbers of child locks at which a block or table lock is escalated.
+std::atomic<int> block_escalation_threshold(64);
+std::atomic<int> table_escalation_threshold(1024);
 
-// For checking cycle
-std::unordered_set <int> visited, trc;
+// Background deadlock detector of the timeout policy.
+pthread_t deadlock_detector;
+std::atomic<int> deadlock_detector_running(0);
 
-// Initialize the lock table.
-int init_lock_table() {
-    lock_table.clear();
-    return 0;
+// Timestamp of the last commit whose versions are all installed. Commits
+// of writing transactions are installed one at a time under the latch.
+std::atomic<int64_t> visible_commit_ts(0);
+pthread_mutex_t trx_commit_latch = PTHREAD_MUTEX_INITIALIZER;
+
+// Newest commit LSN among the installed commits.
+std::atomic<uint64_t> visible_commit_lsn(0);
+
+// Whether committing transactions release their locks before their commit
+// is durable.
+std::atomic<int> early_lock_release(1);
+
+// Deadlocks found, and aborted lock requests by cause.
+std::atomic<uint64_t> lock_deadlocks(0);
+std::atomic<uint64_t> lock_aborts[LOCK_ABORT_CAUSE_NUMBER];
+
+static void init_version_store();
+static void init_trx_table();
+
+
+/* LOCK OBJECT POOL.
+ * Lock objects are carved out of slabs and never returned to malloc.
+ * Each thread keeps a free list of its own and moves objects to and from
+ * the global free list in batches, so most allocations and frees take no
+ * latch at all.
+ */
+
+#define LOCK_SLAB_SIZE 1024
+#define LOCK_CACHE_BATCH 64
+
+// Global free list of lock objects.
+struct lock_pool_t {
+    pthread_mutex_t latch;
+    lock_t *free_list;
+    std::vector<lock_t *> slabs;
+};
+
+lock_pool_t lock_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, {} };
+
+// Free lock objects of this thread, linked through next_trx_lock.
+struct lock_cache_t {
+    lock_t *head;
+    int count;
+
+    ~lock_cache_t();
+};
+
+static thread_local lock_cache_t lock_cache = { NULL, 0 };
+
+// Move a chain of free lock objects to the global free list.
+static void lock_pool_put(lock_t *head, lock_t *tail) {
+    pthread_mutex_lock(&lock_pool.latch);
+    tail->next_trx_lock = lock_pool.free_list;
+    lock_pool.free_list = head;
+    pthread_mutex_unlock(&lock_pool.latch);
 }
 
-void lock_update_wait_for(lock_t *new_lock) {
-    lock_t *cur_lock;
-    int prev_lock_exist, trx_exist, i, is_shared_lock;
-
-    prev_lock_exist = 0;
-    is_shared_lock = !new_lock->lock_mode;
-    cur_lock = new_lock->prev;
-    while (cur_lock != NULL) {
-        // If the record key is different
-        if (cur_lock->key != new_lock->key) {
-            cur_lock = cur_lock->prev;
-            continue;
-        }
+// Hand the free lock objects of an exiting thread back to the pool.
+lock_cache_t::~lock_cache_t() {
+    lock_t *tail = head;
+    if (head == NULL) return;
+    while (tail->next_trx_lock != NULL) tail = tail->next_trx_lock;
+    lock_pool_put(head, tail);
+    head = NULL, count = 0;
+}
 
-        if (cur_lock->lock_mode == 1) is_shared_lock = 0;
+// Refill the free list of this thread with a batch from the pool.
+static void lock_cache_refill() {
+    lock_t *slab;
+    int i;
 
-        // Check the trx id already exists in the wait-for graph
-        trx_exist = 0;
-        for (i = 0; i < wait_for[new_lock->trx_id].size(); i++) {
-            if (wait_for[new_lock->trx_id][i] == cur_lock->trx_id) {
-                trx_exist = 1;
-                break;
-            }
+    pthread_mutex_lock(&lock_pool.latch);
+    if (lock_pool.free_list == NULL) {
+        slab = (lock_t *)malloc(LOCK_SLAB_SIZE * sizeof(lock_t));
+        if (slab == NULL) {
+            perror("lock creation");
+            exit(EXIT_FAILURE);
         }
-        if (!trx_exist && !is_shared_lock) wait_for[new_lock->trx_id].push_back(cur_lock->trx_id);
-
-        // Set flag to 1 when the previous acquired lock mode is read
-        if (prev_lock_exist == 0 && new_lock->lock_mode == 0 && cur_lock->lock_mode == 0 && cur_lock->flag == 1) {
-            new_lock->flag = 1;
+        for (i = 0; i < LOCK_SLAB_SIZE; i++) {
+            pthread_cond_init(&slab[i].cond, NULL);
+            slab[i].next_trx_lock = i + 1 < LOCK_SLAB_SIZE ? &slab[i + 1] : NULL;
         }
-        prev_lock_exist = 1;
-
-        cur_lock = cur_lock->prev;
+        lock_pool.slabs.push_back(slab);
+        lock_pool.free_list = slab;
     }
-    // Set flag to 1 when there are not any lock object that has the same record key
-    if (prev_lock_exist == 0) new_lock->flag = 1;
+    for (i = 0; i < LOCK_CACHE_BATCH && lock_pool.free_list != NULL; i++) {
+        lock_t *lock_obj = lock_pool.free_list;
+        lock_pool.free_list = lock_obj->next_trx_lock;
+        lock_obj->next_trx_lock = lock_cache.head;
+        lock_cache.head = lock_obj;
+        lock_cache.count++;
+    }
+    pthread_mutex_unlock(&lock_pool.latch);
 }
 
-int lock_check_deadlock(int trx_id) {
-    if (trc.find(trx_id) != trc.end()) return 1;
-    if (visited.find(trx_id) != visited.end()) return 0;
-    trc.insert(trx_id);
+// Allocate a lock object. Its condition variable is already initialized.
+static lock_t *lock_alloc() {
+    lock_t *lock_obj;
+
+    if (lock_cache.head == NULL) lock_cache_refill();
+    lock_obj = lock_cache.head;
+    lock_cache.head = lock_obj->next_trx_lock;
+    lock_cache.count--;
+    return lock_obj;
+}
 
+/* Free a chain of count lock objects linked through next_trx_lock, like
+ * the lock list of a finished transaction. The chain joins the free list
+ * of this thread, and a batch goes back to the pool once it grows long.
+ */
+static void lock_free_chain(lock_t *head, lock_t *tail, int count) {
+    lock_t *batch_head, *batch_tail;
     int i;
-    for (i = 0; i < wait_for[trx_id].size(); i++) {
-        if (trx_find(wait_for[trx_id][i]) != 0) continue;
-        if (lock_check_deadlock(wait_for[trx_id][i]) == 1) return 1;
+
+    if (head == NULL) return;
+    tail->next_trx_lock = lock_cache.head;
+    lock_cache.head = head;
+    lock_cache.count += count;
+
+    while (lock_cache.count > 2 * LOCK_CACHE_BATCH) {
+        batch_head = batch_tail = lock_cache.head;
+        for (i = 1; i < LOCK_CACHE_BATCH; i++) batch_tail = batch_tail->next_trx_lock;
+        lock_cache.head = batch_tail->next_trx_lock;
+        lock_cache.count -= LOCK_CACHE_BATCH;
+        lock_pool_put(batch_head, batch_tail);
     }
-    visited.insert(trx_id);
-    trc.erase(trx_id);
-    return 0;
 }
 
-// Acquire a lock.
-lock_t *lock_acquire(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int lock_mode) {
-    //  Latch
-    pthread_mutex_lock(&lock_manager_latch);
 
-    lock_table_t *node;
-    lock_t *new_lock, *cur_lock, *iso_check_lock;
-    int is_not_isolated = 0;
-
-    node = &lock_table[std::make_pair(table_id, pagenum)];
-    node->table_id = table_id;
-    node->pagenum = pagenum;
-
-    // Check the lock object of the same trx already exists
-    cur_lock = node->head;
-    while (cur_lock != NULL) {
-        if (cur_lock->key != key) {
-            cur_lock = cur_lock->next;
-            continue;
-        }
+/* UNDO ARENA. */
 
-        // Check whether the S lock is not alone
-        if (cur_lock->trx_id != trx_id) {
-            is_not_isolated = 1;
-            cur_lock = cur_lock->next;
-            continue;
-        }
+#define TRX_ARENA_CHUNK_SIZE 4096
 
-        // Change S lock to X lock if it is alone
-        if (lock_mode == 1 && cur_lock->lock_mode == 0) {
-            iso_check_lock = cur_lock->next;
-            while (iso_check_lock != NULL) {
-                if (iso_check_lock->key == key && iso_check_lock->flag == 1) is_not_isolated = 1;
-                iso_check_lock = iso_check_lock->next;
-            }
-            if (is_not_isolated) {
-                // Unlatch
-                pthread_mutex_unlock(&lock_manager_latch);
+// Allocate memory that lives until the transaction ends.
+static char *trx_arena_alloc(trx_arena_t *arena, size_t size) {
+    char *chunk;
 
-                trx_abort(trx_id);
-                return NULL;
-            }
-            cur_lock->lock_mode = 1;
+    // Allocations larger than a chunk get a chunk of their own.
+    if (size > TRX_ARENA_CHUNK_SIZE) {
+        chunk = (char *)malloc(size);
+        if (chunk == NULL) {
+            perror("undo arena");
+            exit(EXIT_FAILURE);
+        }
+        arena->chunks.insert(arena->chunks.begin(), chunk);
+        return chunk;
+    }
+    if (arena->chunks.empty() || arena->used + size > arena->capacity) {
+        chunk = (char *)malloc(TRX_ARENA_CHUNK_SIZE);
+        if (chunk == NULL) {
+            perror("undo arena");
+            exit(EXIT_FAILURE);
         }
+        arena->chunks.push_back(chunk);
+        arena->used = 0;
+        arena->capacity = TRX_ARENA_CHUNK_SIZE;
+    }
+    chunk = arena->chunks.back() + arena->used;
+    arena->used += (size + 7) & ~(size_t)7;
+    return chunk;
+}
 
-        // Unlatch
-        pthread_mutex_unlock(&lock_manager_latch);
-        return cur_lock;
+// Release every allocation of an arena at once.
+static void trx_arena_clear(trx_arena_t *arena) {
+    size_t i;
+    for (i = 0; i < arena->chunks.size(); i++) free(arena->chunks[i]);
+    arena->chunks.clear();
+    arena->used = arena->capacity = 0;
+}
 
-        cur_lock = cur_lock->next;
-    }
 
-    // Create a new lock object
-    new_lock = (lock_t *)malloc(sizeof(lock_t));
-    if (new_lock == NULL) {
-        perror("lock creation");
-        exit(EXIT_FAILURE);
-    }
+/* TRANSACTION OBJECT POOL.
+ * Transaction objects are recycled and never returned to malloc, so a
+ * stale pointer to one still points to a transaction object, whose id
+ * tells whether it is still the same transaction. Each thread keeps a few
+ * free objects of its own.
+ */
 
-    // Locate the new lock to the tail of the node and set flag
-    new_lock->key = key;
-    new_lock->lock_mode = lock_mode;
-    new_lock->next = NULL;
-    new_lock->prev = node->tail;
-    new_lock->sentinel = node;
-    new_lock->trx_id = trx_id;
-    new_lock->original_value = NULL;
-    trx_insert(trx_id, new_lock);
+#define TRX_CACHE_SIZE 16
 
-    if (node->tail != NULL) {
-        node->tail->next = new_lock;
-        new_lock->flag = 0;
-    } else {
-        node->head = new_lock;
-        new_lock->flag = 1;
+// Global free list of transaction objects.
+struct trx_pool_t {
+    pthread_mutex_t latch;
+    std::vector<trx_t *> free_list;
+};
+
+trx_pool_t trx_pool = { PTHREAD_MUTEX_INITIALIZER, {} };
+
+// Free transaction objects of this thread.
+struct trx_cache_t {
+    std::vector<trx_t *> free_list;
+
+    ~trx_cache_t();
+};
+
+static thread_local trx_cache_t trx_cache;
+
+// Move free transaction objects of this thread to the pool, down to keep.
+static void trx_cache_drain(size_t keep) {
+    pthread_mutex_lock(&trx_pool.latch);
+    while (trx_cache.free_list.size() > keep) {
+        trx_pool.free_list.push_back(trx_cache.free_list.back());
+        trx_cache.free_list.pop_back();
     }
-    node->tail = new_lock;
+    pthread_mutex_unlock(&trx_pool.latch);
+}
 
-    // Update wait-for graph
-    lock_update_wait_for(new_lock);
+// Hand the free transaction objects of an exiting thread back to the pool.
+trx_cache_t::~trx_cache_t() {
+    if (!free_list.empty()) trx_cache_drain(0);
+}
 
-    //  Check the deadlock
-    trc.clear();
-    visited.clear();
-    if (lock_check_deadlock(trx_id) == 1) {
-        //  Unlatch
-        pthread_mutex_unlock(&lock_manager_latch);
+// Allocate a transaction object with an empty lock list and arena.
+static trx_t *trx_alloc() {
+    trx_t *trx;
 
-        trx_abort(trx_id);
-        return NULL;
+    if (trx_cache.free_list.empty()) {
+        pthread_mutex_lock(&trx_pool.latch);
+        while (!trx_pool.free_list.empty() && trx_cache.free_list.size() < TRX_CACHE_SIZE / 2) {
+            trx_cache.free_list.push_back(trx_pool.free_list.back());
+            trx_pool.free_list.pop_back();
+        }
+        pthread_mutex_unlock(&trx_pool.latch);
+    }
+    if (trx_cache.free_list.empty()) {
+        trx = new trx_t;
+        trx->trx_id = 0;
+        trx->head = NULL;
+        trx->undo_arena.used = trx->undo_arena.capacity = 0;
+        trx->undo_log = NULL;
+        pthread_mutex_init(&trx->latch, NULL);
+        return trx;
     }
-    //  Wait until flag changes to 1
-    while (new_lock->flag == 0) pthread_cond_wait(&cond, &lock_manager_latch);
+    trx = trx_cache.free_list.back();
+    trx_cache.free_list.pop_back();
+    return trx;
+}
 
-    //  Unlatch
-    pthread_mutex_unlock(&lock_manager_latch);
-    return new_lock;
-};
+// Recycle a transaction object.
+static void trx_free(trx_t *trx) {
+    trx_cache.free_list.push_back(trx);
+    if (trx_cache.free_list.size() > TRX_CACHE_SIZE) trx_cache_drain(TRX_CACHE_SIZE / 2);
+}
 
-// Release the lock.
-int lock_release(lock_t *lock_obj) {
-    //  Latch.
-    pthread_mutex_lock(&lock_manager_latch);
 
-    lock_table_t *node;
-    lock_t *first_lock;
-    int lock_mode;
-    int64_t key;
+// Find the bucket of a lock queue.
+static lock_bucket_t *lock_get_bucket(const lock_name_t &name) {
+    return &lock_buckets[lock_name_hash()(name) % LOCK_BUCKET_NUMBER];
+}
 
-    node = lock_obj->sentinel;
-    lock_mode = lock_obj->lock_mode;
-    key = lock_obj->key;
+// The name of the queue of a lock.
+static lock_name_t lock_get_name(lock_t *lock_obj) {
+    return lock_name_t{ lock_obj->table_id, lock_obj->key, lock_obj->level };
+}
 
-    // Update pointers
-    if (lock_obj->prev == NULL) {
-        node->head = lock_obj->next;
-        if (lock_obj->next == NULL)
-            node->tail = NULL;
-        else
-            lock_obj->next->prev = NULL;
-    } else {
-        lock_obj->prev->next = lock_obj->next;
-        if (lock_obj->next == NULL)
-            node->tail = lock_obj->prev;
-        else
-            lock_obj->next->prev = lock_obj->prev;
-    }
+/* LOCK WORDS.
+ * A record lock that no other transaction wants is granted with a
+ * compare-and-swap on a lock word, without the bucket latch or a queue.
+ * Records share the words their names hash to. The top bits of a word
+ * count the queues of its records, and the low bits hold the lock granted
+ * on it and its mode. A lock is only granted on a word while none of its
+ * records has a queue, and the request that creates the queue of a record
+ * first moves the lock granted on the word for the record there.
+ */
+
+#define LOCK_WORD_NUMBER 65536
+#define LOCK_WORD_QUEUE ((uint64_t)1 << 48)
+#define LOCK_WORD_HOLDER (LOCK_WORD_QUEUE - 1)
+#define LOCK_WORD_MODE ((uint64_t)7)
+
+std::atomic<uint64_t> lock_words[LOCK_WORD_NUMBER];
+
+// Whether uncontended record locks are granted on their lock words.
+std::atomic<int> lock_fast_path(1);
+
+// Find the lock word of a record. The records of a word share a bucket.
+static std::atomic<uint64_t> *lock_get_word(const lock_name_t &name) {
+    return &lock_words[lock_name_hash()(name) % LOCK_WORD_NUMBER];
+}
 
-    // Free the lock object
-    free(lock_obj);
+// The lock granted on a lock word, or NULL.
+static lock_t *lock_word_holder(uint64_t word) {
+    return (lock_t *)(uintptr_t)(word & LOCK_WORD_HOLDER & ~LOCK_WORD_MODE);
+}
 
-    // Find the first lock object that has the same key
-    first_lock = node->head;
-    while (first_lock != NULL) {
-        if (first_lock->key == key) break;
-        first_lock = first_lock->next;
+// Initialize the lock table.
+int init_lock_table() {
+    int i;
+    for (i = 0; i < LOCK_BUCKET_NUMBER; i++) {
+        pthread_mutex_init(&lock_buckets[i].latch, NULL);
+        lock_buckets[i].table.clear();
+        lock_buckets[i].commit_lsn = 0;
+        lock_buckets[i].stats = lock_bucket_stats_t();
+        lock_buckets[i].stats.hot_keys = lock_hot_keys[i];
+        lock_buckets[i].latched_at = 0;
     }
+    for (i = 0; i < LOCK_WORD_NUMBER; i++) lock_words[i] = 0;
+    lock_deadlocks = 0;
+    for (i = 0; i < LOCK_ABORT_CAUSE_NUMBER; i++) lock_aborts[i] = 0;
+    init_trx_table();
+    init_version_store();
+    return 0;
+}
 
-    //  Matcing key lock object does not exist
-    if (first_lock == NULL) {
-        // Lock object list is empty, erase the entry
-        if (node->head == NULL) lock_table.erase(std::make_pair(node->table_id, node->pagenum));
-        // Unlatch.
-        pthread_mutex_unlock(&lock_manager_latch);
-        return 0;
+/* LOCK STATISTICS.
+ * Buckets count their waits and latch use under their own latch, so an
+ * uncontended request only pays for counting its latch acquisition. A
+ * latch wait is timed only when the latch is taken, and hold times only
+ * for one acquisition in LOCK_LATCH_SAMPLE_PERIOD of each thread.
+ */
+
+#define LOCK_LATCH_SAMPLE_PERIOD 64
+
+static thread_local unsigned int lock_latch_count = 0;
+
+static uint64_t lock_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Latch a bucket.
+static void lock_latch(lock_bucket_t *bucket) {
+    uint64_t start;
+
+    if (pthread_mutex_trylock(&bucket->latch) != 0) {
+        start = lock_now_ns();
+        pthread_mutex_lock(&bucket->latch);
+        bucket->stats.latch_waits++;
+        bucket->stats.latch_wait_ns += lock_now_ns() - start;
     }
+    bucket->stats.latch_acquires++;
+    if (++lock_latch_count % LOCK_LATCH_SAMPLE_PERIOD == 0)
+        bucket->latched_at = lock_now_ns();
+}
 
-    //  Awake the first lock object if its lock mode is exclusive
-    if (first_lock->lock_mode == 1) {
-        first_lock->flag = 1;
-        pthread_cond_broadcast(&cond);
+// Unlatch a bucket.
+static void lock_unlatch(lock_bucket_t *bucket) {
+    if (bucket->latched_at != 0) {
+        bucket->stats.latch_hold_samples++;
+        bucket->stats.latch_hold_ns += lock_now_ns() - bucket->latched_at;
+        bucket->latched_at = 0;
     }
-    // Awake multiple lock objects if their lock mode is shared
-    else if (lock_mode == 1) {
-        while (first_lock != NULL) {
-            if (first_lock->key == key && first_lock->lock_mode == 1) break;
+    pthread_mutex_unlock(&bucket->latch);
+}
 
-            if (first_lock->key == key) first_lock->flag = 1;
-            first_lock = first_lock->next;
-        }
-        pthread_cond_broadcast(&cond);
+// The histogram bin of a wait.
+static int lock_wait_bin(uint64_t wait_us) {
+    int bin = 0;
+    while (wait_us != 0 && bin < LOCK_WAIT_BIN_NUMBER - 1) wait_us >>= 1, bin++;
+    return bin;
+}
+
+/* Count a wait for a queue that held queue_length lock objects when the
+ * wait began. A key that is not among the hot keys of the bucket replaces
+ * the one with the fewest waits once they are full, and takes over its
+ * count. The caller must hold the bucket latch.
+ */
+static void lock_add_wait(lock_bucket_t *bucket, lock_table_t *node, uint64_t wait_ns, int queue_length) {
+    lock_bucket_stats_t *stats = &bucket->stats;
+    lock_key_stats_t *key_stats;
+    uint64_t wait_us = wait_ns / 1000, inherited = 0;
+    int i, coldest = 0, bin = lock_wait_bin(wait_us);
+
+    stats->waits++;
+    stats->wait_us += wait_us;
+    stats->wait_histogram[bin]++;
+
+    for (i = 0; i < stats->num_hot_keys; i++) {
+        key_stats = &stats->hot_keys[i];
+        if (key_stats->table_id == node->table_id && key_stats->key == node->key &&
+            key_stats->level == node->level) break;
+        if (key_stats->waits < stats->hot_keys[coldest].waits) coldest = i;
+    }
+    key_stats = &stats->hot_keys[i < LOCK_HOT_KEY_NUMBER ? i : coldest];
+    if (i == stats->num_hot_keys) {
+        if (i < LOCK_HOT_KEY_NUMBER)
+            stats->num_hot_keys++;
+        else
+            inherited = key_stats->waits;
+        memset(key_stats, 0, sizeof(*key_stats));
+        key_stats->table_id = node->table_id;
+        key_stats->key = node->key;
+        key_stats->level = node->level;
+        key_stats->waits = key_stats->inherited_waits = inherited;
     }
 
-    //  Unlatch.
-    pthread_mutex_unlock(&lock_manager_latch);
+    key_stats->waits++;
+    key_stats->wait_us += wait_us;
+    if (wait_us > key_stats->max_wait_us) key_stats->max_wait_us = wait_us;
+    if ((uint64_t)queue_length > key_stats->max_queue_length) key_stats->max_queue_length = queue_length;
+    key_stats->wait_histogram[bin]++;
+}
+
+// Count an aborted lock request.
+static void lock_add_abort(int cause) {
+    lock_aborts[cause]++;
+}
+
+// Gather the contention statistics of every bucket.
+int lock_get_stats(struct lock_stats_t *stats) {
+    lock_bucket_stats_t *bucket_stats;
+    int i, bin;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < LOCK_BUCKET_NUMBER; i++) {
+        bucket_stats = &lock_buckets[i].stats;
+        pthread_mutex_lock(&lock_buckets[i].latch);
+        stats->waits += bucket_stats->waits;
+        stats->wait_us += bucket_stats->wait_us;
+        for (bin = 0; bin < LOCK_WAIT_BIN_NUMBER; bin++)
+            stats->wait_histogram[bin] += bucket_stats->wait_histogram[bin];
+        if (bucket_stats->max_queue_length > stats->max_queue_length)
+            stats->max_queue_length = bucket_stats->max_queue_length;
+        stats->latch_acquires += bucket_stats->latch_acquires;
+        stats->latch_waits += bucket_stats->latch_waits;
+        stats->latch_wait_ns += bucket_stats->latch_wait_ns;
+        stats->latch_hold_samples += bucket_stats->latch_hold_samples;
+        stats->latch_hold_ns += bucket_stats->latch_hold_ns;
+        pthread_mutex_unlock(&lock_buckets[i].latch);
+    }
+    stats->deadlocks = lock_deadlocks;
+    for (i = 0; i < LOCK_ABORT_CAUSE_NUMBER; i++) stats->aborts[i] = lock_aborts[i];
     return 0;
 }
 
-int trx_insert(int trx_id, lock_t *new_lock) {
-    // Latch.
-    pthread_mutex_lock(&trx_manager_latch);
+// Find up to limit keys with the longest total wait, longest first.
+// Returns the number of keys found.
+int lock_get_hot_keys(int limit, std::vector<struct lock_key_stats_t> *keys) {
+    lock_bucket_stats_t *bucket_stats;
+    int i;
 
-    if (trx_table.find(trx_id) == trx_table.end()) {
-        // Unlatch.
-        pthread_mutex_unlock(&trx_manager_latch);
-        return -1;
+    keys->clear();
+    for (i = 0; i < LOCK_BUCKET_NUMBER; i++) {
+        bucket_stats = &lock_buckets[i].stats;
+        pthread_mutex_lock(&lock_buckets[i].latch);
+        keys->insert(keys->end(), bucket_stats->hot_keys, bucket_stats->hot_keys + bucket_stats->num_hot_keys);
+        pthread_mutex_unlock(&lock_buckets[i].latch);
     }
+    std::sort(keys->begin(), keys->end(), [](const lock_key_stats_t &a, const lock_key_stats_t &b) {
+        return a.wait_us != b.wait_us ? a.wait_us > b.wait_us : a.waits > b.waits;
+    });
+    if (limit >= 0 && keys->size() > (size_t)limit) keys->resize(limit);
+    return (int)keys->size();
+}
 
-    new_lock->next_trx_lock = trx_table[trx_id];
-    trx_table[trx_id] = new_lock;
+#define LOCK_MODE_NUMBER 6
 
-    // Unlatch.
-    pthread_mutex_unlock(&trx_manager_latch);
-    return 0;
+// Compatibility of lock modes, in the order S, X, U, IS, IX, SIX.
+static const char lock_compatibility[LOCK_MODE_NUMBER][LOCK_MODE_NUMBER] = {
+    { 1, 0, 1, 1, 0, 0 },
+    { 0, 0, 0, 0, 0, 0 },
+    { 1, 0, 0, 1, 0, 0 },
+    { 1, 0, 1, 1, 1, 1 },
+    { 0, 0, 0, 1, 1, 0 },
+    { 0, 0, 0, 1, 0, 0 },
+};
+
+// Whether a held mode allows everything a requested one does.
+static const char lock_coverage[LOCK_MODE_NUMBER][LOCK_MODE_NUMBER] = {
+    { 1, 0, 0, 1, 0, 0 },
+    { 1, 1, 1, 1, 1, 1 },
+    { 1, 0, 1, 1, 0, 0 },
+    { 0, 0, 0, 1, 0, 0 },
+    { 0, 0, 0, 1, 1, 0 },
+    { 1, 0, 0, 1, 1, 1 },
+};
+
+// Whether locks of two modes can be granted to different transactions.
+static int lock_compatible(int mode_a, int mode_b) {
+    return lock_compatibility[mode_a][mode_b];
 }
 
-int trx_find(int trx_id) {
-    // Latch.
-    pthread_mutex_lock(&trx_manager_latch);
+// Whether a held lock mode already allows a requested one.
+static int lock_covers(int held_mode, int requested_mode) {
+    return lock_coverage[held_mode][requested_mode];
+}
 
-    if (trx_table.find(trx_id) == trx_table.end()) {
-        // Unlatch.
-        pthread_mutex_unlock(&trx_manager_latch);
-        return -1;
+// The weakest mode that allows both of two modes.
+static int lock_combine(int mode_a, int mode_b) {
+    if (lock_covers(mode_a, mode_b)) return mode_a;
+    if (lock_covers(mode_b, mode_a)) return mode_b;
+    if ((mode_a == LOCK_SHARED && mode_b == LOCK_INTENTION_EXCLUSIVE) ||
+        (mode_a == LOCK_INTENTION_EXCLUSIVE && mode_b == LOCK_SHARED))
+        return LOCK_SHARED_INTENTION_EXCLUSIVE;
+    return LOCK_EXCLUSIVE;
+}
+
+// The mode to hold on the tables and blocks above a lock.
+static int lock_intention(int lock_mode) {
+    if (lock_mode == LOCK_SHARED || lock_mode == LOCK_INTENTION_SHARED)
+        return LOCK_INTENTION_SHARED;
+    return LOCK_INTENTION_EXCLUSIVE;
+}
+
+/* Set the flag of a new lock object and collect the transactions it waits
+ * for. A request waits if a lock ahead of it conflicts with it or is still
+ * waiting itself, and locks of its own transaction never conflict with it.
+ * A waiting request waits for every transaction ahead of it, since a reader
+ * ahead may also upgrade in front of it. The caller must hold the bucket
+ * latch.
+ */
+static void lock_find_conflicts(lock_t *new_lock, std::vector<int> *conflicts) {
+    lock_t *cur_lock;
+    size_t i;
+    int trx_exist;
+
+    new_lock->flag = 1;
+    for (cur_lock = new_lock->prev; cur_lock != NULL; cur_lock = cur_lock->prev) {
+        if (cur_lock->trx_id == new_lock->trx_id) continue;
+        if (cur_lock->flag == 0 || !lock_compatible(cur_lock->lock_mode, new_lock->lock_mode))
+            new_lock->flag = 0;
+
+        // Check the trx id already exists in the wait-for list
+        trx_exist = 0;
+        for (i = 0; i < conflicts->size(); i++) {
+            if ((*conflicts)[i] == cur_lock->trx_id) {
+                trx_exist = 1;
+                break;
+            }
+        }
+        if (!trx_exist) conflicts->push_back(cur_lock->trx_id);
     }
-    // Unlatch.
-    pthread_mutex_unlock(&trx_manager_latch);
-    return 0;
+    if (new_lock->flag == 1) conflicts->clear();
 }
 
-int trx_abort(int trx_id) {
-    leaf_node *abort_page;
-    lock_t *cur_lock, *next_lock;
+// Initialize the latches of the transaction table.
+static void init_trx_table() {
     int i;
+    for (i = 0; i < TRX_SHARD_NUMBER; i++)
+        pthread_mutex_init(&trx_shards[i].latch, NULL);
+}
 
-    // Latch.
-    pthread_mutex_lock(&trx_manager_latch);
+// Find the partition of the transaction table of a transaction.
+static trx_shard_t *trx_get_shard(int trx_id) {
+    return &trx_shards[(unsigned int)trx_id % TRX_SHARD_NUMBER];
+}
 
-    cur_lock = trx_table[trx_id];
+// Find a transaction under the latch of its partition, which the caller
+// must hold.
+static trx_t *trx_lookup(trx_shard_t *shard, int trx_id) {
+    auto it = shard->table.find(trx_id);
+    return it != shard->table.end() ? it->second : NULL;
+}
 
-    // Erase the trx
-    trx_table.erase(trx_id);
+/* Find a transaction. Only its own thread may use it without the latch.
+ * The transaction a thread works on is usually the one it last used, and
+ * checking that it is still alive takes a single atomic load.
+ */
+static trx_t *trx_get(int trx_id) {
+    trx_shard_t *shard;
+    trx_t *trx;
 
-    // Unlatch.
-    pthread_mutex_unlock(&trx_manager_latch);
+    // Ids of ended transactions are 0, and no transaction has one.
+    if (trx_id <= 0)
+        return NULL;
 
-    while (cur_lock != NULL) {
-        next_lock = cur_lock->next_trx_lock;
-        // If the update of the page was conducted
-        if (cur_lock->lock_mode == 1 && cur_lock->original_value != NULL) {
-            // Read the page that I want to abort
-            abort_page = (leaf_node *)buffer_read_page(cur_lock->sentinel->table_id, cur_lock->sentinel->pagenum);
+    trx = trx_context;
+    if (trx != NULL && trx->trx_id == trx_id)
+        return trx;
 
-            for (i = 0; i < abort_page->num_keys; i++)
-                if (read_leaf_key(abort_page, i) == cur_lock->key) break;
+    shard = trx_get_shard(trx_id);
+    pthread_mutex_lock(&shard->latch);
+    trx = trx_lookup(shard, trx_id);
+    pthread_mutex_unlock(&shard->latch);
+    if (trx != NULL) trx_context = trx;
+    return trx;
+}
 
-            // Rollback the value
-            write_leaf_value(abort_page, cur_lock->original_value, read_leaf_val_size(abort_page, i), i);
+// Replace the wait-for edges and the pending request of a transaction.
+static void trx_set_wait_for(trx_t *trx, const std::vector<int> &conflicts, lock_t *waiting_lock) {
+    pthread_mutex_lock(&trx->latch);
+    trx->wait_for = conflicts;
+    trx->waiting_lock = waiting_lock;
+    pthread_mutex_unlock(&trx->latch);
+}
 
-            buffer_page_unlatch((struct page_t *)abort_page);
-            free(cur_lock->original_value);
-            cur_lock->original_value = NULL;
-        }
-        // Release the lock
-        lock_release(cur_lock);
-        cur_lock = next_lock;
+/* Copy the wait-for edges of a transaction. Returns -1 if it has finished
+ * or was asked to abort, since it will not wait for long either way.
+ */
+static int trx_get_wait_for(int trx_id, std::vector<int> *edges) {
+    trx_shard_t *shard = trx_get_shard(trx_id);
+    trx_t *trx;
+
+    pthread_mutex_lock(&shard->latch);
+    trx = trx_lookup(shard, trx_id);
+    if (trx == NULL || trx->abort_requested) {
+        pthread_mutex_unlock(&shard->latch);
+        return -1;
     }
+    pthread_mutex_lock(&trx->latch);
+    *edges = trx->wait_for;
+    pthread_mutex_unlock(&trx->latch);
+    pthread_mutex_unlock(&shard->latch);
     return 0;
 }
 
-int trx_begin(void) {
-    // Latch.
-    pthread_mutex_lock(&trx_manager_latch);
-
-    int trx_id = ++global_trx_id;
-    trx_table[trx_id] = NULL;
+void lock_update_wait_for(lock_t *new_lock) {
+    std::vector<int> conflicts;
+    trx_t *trx;
 
-    // Unlatch.
-    pthread_mutex_unlock(&trx_manager_latch);
-    return trx_id;
+    lock_find_conflicts(new_lock, &conflicts);
+    trx = trx_get(new_lock->trx_id);
+    if (trx != NULL) trx_set_wait_for(trx, conflicts, new_lock->flag ? NULL : new_lock);
 }
-int trx_commit(int trx_id) {
-    lock_t *cur_lock;
-    lock_t *next_lock;
 
-    // Latch.
-    pthread_mutex_lock(&trx_manager_latch);
+// Depth-first search for a cycle through the wait-for edges. The path
+// holds the transactions on the way, and ends with the cycle if one is found.
+static int lock_find_cycle(int trx_id, std::unordered_set<int> &visited, std::unordered_set<int> &trc,
+                           std::vector<int> &path) {
+    std::vector<int> edges;
+    size_t i;
 
-    // If trx has been aborted
-    if (trx_table.find(trx_id) == trx_table.end()) {
-        // Unlatch.
-        pthread_mutex_unlock(&trx_manager_latch);
-        return 0;
+    if (trc.find(trx_id) != trc.end()) {
+        path.push_back(trx_id);
+        return 1;
+    }
+    if (visited.find(trx_id) != visited.end()) return 0;
+    if (trx_get_wait_for(trx_id, &edges) != 0) return 0;
+    trc.insert(trx_id);
+    path.push_back(trx_id);
+
+    for (i = 0; i < edges.size(); i++) {
+        if (lock_find_cycle(edges[i], visited, trc, path) == 1) return 1;
+    }
+    visited.insert(trx_id);
+    trc.erase(trx_id);
+    path.pop_back();
+    return 0;
+}
+
+/* Choose the cheapest transaction of a cycle to abort: the one holding the
+ * fewest locks, then the one with the fewest undo bytes, then the youngest.
+ * The path ends with the cycle, whose first member is repeated at the end.
+ */
+static int lock_choose_victim(const std::vector<int> &path) {
+    int i, victim = 0, victim_locks = 0, locks;
+    size_t victim_undo = 0, undo;
+    trx_shard_t *shard;
+    trx_t *trx;
+
+    for (i = path.size() - 2; i >= 0; i--) {
+        shard = trx_get_shard(path[i]);
+        pthread_mutex_lock(&shard->latch);
+        trx = trx_lookup(shard, path[i]);
+        if (trx != NULL) {
+            locks = trx->lock_count;
+            undo = trx->undo_bytes;
+            if (victim == 0 || locks < victim_locks ||
+                (locks == victim_locks && (undo < victim_undo ||
+                                           (undo == victim_undo && trx->trx_id > victim)))) {
+                victim = trx->trx_id;
+                victim_locks = locks;
+                victim_undo = undo;
+            }
+        }
+        pthread_mutex_unlock(&shard->latch);
+        if (path[i] == path.back()) break;
     }
+    return victim;
+}
 
-    cur_lock = trx_table[trx_id];
+// Find a cycle through a transaction and return the transaction to abort,
+// or 0 if there is no cycle.
+static int lock_find_victim(int trx_id) {
+    std::unordered_set<int> visited, trc;
+    std::vector<int> path;
 
-    // Erase the trx
-    trx_table.erase(trx_id);
+    if (lock_find_cycle(trx_id, visited, trc, path) == 0) return 0;
+    return lock_choose_victim(path);
+}
 
-    // Unlatch.
-    pthread_mutex_unlock(&trx_manager_latch);
+/* A new edge can only close a cycle through the transaction that added
+ * it, so the search starts there and only walks the waiting transactions
+ * it reaches; nothing is kept between searches. Every waiter publishes
+ * its edges before it searches, and the edges of a deadlocked transaction
+ * stay until it is aborted, so the last member of a cycle to start
+ * waiting always sees the whole cycle.
+ */
+int lock_check_deadlock(int trx_id) {
+    std::unordered_set<int> visited, trc;
+    std::vector<int> path;
+    return lock_find_cycle(trx_id, visited, trc, path);
+}
 
-    while (cur_lock != NULL) {
-        next_lock = cur_lock->next_trx_lock;
-        if(cur_lock->original_value != NULL)
-            free(cur_lock->original_value);
-        lock_release(cur_lock);
-        cur_lock = next_lock;
+/* Ask a transaction to abort for a cause. If it is waiting for a lock, its
+ * thread is woken up and aborts itself; otherwise it aborts at its next
+ * lock request.
+ */
+static void trx_request_abort(int trx_id, int cause) {
+    trx_shard_t *shard = trx_get_shard(trx_id);
+    trx_t *trx;
+    lock_t *waiting_lock;
+    lock_bucket_t *bucket;
+
+    pthread_mutex_lock(&shard->latch);
+    trx = trx_lookup(shard, trx_id);
+    if (trx == NULL) {
+        pthread_mutex_unlock(&shard->latch);
+        return;
     }
-    
-    return trx_id;
-}
\ No newline at end of file
+    trx->abort_cause = cause;
+    trx->abort_requested = 1;
+
+    // The pending request cannot be freed while the trx latch is held.
+    pthread_mutex_lock(&trx->latch);
+    waiting_lock = trx->waiting_lock;
+    if (waiting_lock != NULL) {
+        bucket = waiting_lock->sentinel->bucket;
+        lock_latch(bucket);
+        if (waiting_lock->flag == 0) pthread_cond_signal(&waiting_lock->cond);
+        lock_unlatch(bucket);
+    }
+    pthread_mutex_unlock(&trx->latch);
+    pthread_mutex_unlock(&shard->latch);
+}
+
+/* Decide whether a request that conflicts with the given transactions may
+ * wait, under the current deadlock policy. Returns 0 after publishing the
+ * wait-for edges, or -1 if the requesting transaction must abort, with the
+ * cause in its abort_cause.
+ */
+static int lock_prepare_wait(trx_t *trx, lock_t *new_lock, const std::vector<int> &conflicts) {
+    size_t i;
+    int victim;
+
+    switch (deadlock_policy.load()) {
+    case DEADLOCK_NO_WAIT:
+        trx->abort_cause = LOCK_ABORT_NO_WAIT;
+        return -1;
+
+    // An older transaction waits for younger ones, a younger one dies.
+    case DEADLOCK_WAIT_DIE:
+        for (i = 0; i < conflicts.size(); i++) {
+            if (conflicts[i] < trx->trx_id) {
+                trx->abort_cause = LOCK_ABORT_NO_WAIT;
+                return -1;
+            }
+        }
+        trx_set_wait_for(trx, conflicts, new_lock);
+        return 0;
+
+    // An older transaction wounds younger ones, a younger one waits.
+    case DEADLOCK_WOUND_WAIT:
+        trx_set_wait_for(trx, conflicts, new_lock);
+        for (i = 0; i < conflicts.size(); i++)
+            if (conflicts[i] > trx->trx_id) trx_request_abort(conflicts[i], LOCK_ABORT_WOUNDED);
+        return 0;
+
+    // Waits time out, and the background detector breaks cycles.
+    case DEADLOCK_TIMEOUT:
+        trx_set_wait_for(trx, conflicts, new_lock);
+        return 0;
+
+    // Abort the cheapest member of each cycle. Another transaction is woken
+    // up to abort itself, and the search goes on for cycles without it.
+    default:
+        trx_set_wait_for(trx, conflicts, new_lock);
+        while ((victim = lock_find_victim(trx->trx_id)) != 0) {
+            lock_deadlocks++;
+            if (victim == trx->trx_id) {
+                trx->abort_cause = LOCK_ABORT_DEADLOCK;
+                return -1;
+            }
+            trx_request_abort(victim, LOCK_ABORT_DEADLOCK);
+        }
+        return 0;
+    }
+}
+
+// Search every waiting transaction for a cycle and break the cycles found.
+static void *lock_detector_func(void *) {
+    std::vector<int> waiting;
+    size_t i;
+    int j, interval_ms, victim;
+
+    while (deadlock_detector_running) {
+        interval_ms = lock_wait_timeout_ms / 2 > 0 ? lock_wait_timeout_ms / 2 : 1;
+        usleep(interval_ms * 1000);
+
+        waiting.clear();
+        for (j = 0; j < TRX_SHARD_NUMBER; j++) {
+            pthread_mutex_lock(&trx_shards[j].latch);
+            for (auto &entry : trx_shards[j].table) {
+                pthread_mutex_lock(&entry.second->latch);
+                if (entry.second->waiting_lock != NULL) waiting.push_back(entry.first);
+                pthread_mutex_unlock(&entry.second->latch);
+            }
+            pthread_mutex_unlock(&trx_shards[j].latch);
+        }
+
+        for (i = 0; i < waiting.size(); i++) {
+            while ((victim = lock_find_victim(waiting[i])) != 0) {
+                lock_deadlocks++;
+                trx_request_abort(victim, LOCK_ABORT_DEADLOCK);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Choose whether committing transactions release their locks before their
+// commit is durable.
+int lock_set_early_release(int enabled) {
+    early_lock_release = enabled != 0;
+    return 0;
+}
+
+// Choose whether uncontended record locks are granted on lock words.
+int lock_set_fast_path(int enabled) {
+    lock_fast_path = enabled != 0;
+    return 0;
+}
+
+// Make a transaction granted a lock in a bucket wait for the commits that
+// released locks there early.
+static void lock_add_dependency(trx_t *trx, lock_bucket_t *bucket) {
+    uint64_t commit_lsn = bucket->commit_lsn;
+    if (commit_lsn > trx->depend_lsn)
+        trx->depend_lsn = commit_lsn;
+}
+
+// Record the commit of a transaction that releases locks in a bucket before
+// the commit is durable.
+static void lock_add_commit(lock_bucket_t *bucket, uint64_t commit_lsn) {
+    uint64_t cur = bucket->commit_lsn;
+    while (commit_lsn > cur && !bucket->commit_lsn.compare_exchange_weak(cur, commit_lsn)) {}
+}
+
+/* Grant a record lock on its lock word, or upgrade the lock the transaction
+ * holds there. Returns NULL if the request needs the queue: another
+ * transaction holds the word, or one of its records has a queue.
+ */
+static lock_t *lock_word_acquire(trx_t *trx, const lock_name_t &name, pagenum_t pagenum, int lock_mode) {
+    std::atomic<uint64_t> *word = lock_get_word(name);
+    uint64_t cur = *word;
+    lock_t *lock_obj = lock_word_holder(cur);
+    int held_mode;
+
+    // Only a lock of the trx carries its id, and only others move it off
+    // the word.
+    if (lock_obj != NULL) {
+        if (lock_obj->trx_id != trx->trx_id || lock_obj->key != name.key ||
+            lock_obj->table_id != name.table_id)
+            return NULL;
+        while (lock_word_holder(cur) == lock_obj) {
+            held_mode = (int)(cur & LOCK_WORD_MODE);
+            if (lock_covers(held_mode, lock_mode)) return lock_obj;
+            if (word->compare_exchange_weak(cur, (cur & ~LOCK_WORD_MODE) | lock_combine(held_mode, lock_mode)))
+                return lock_obj;
+        }
+        return NULL;
+    }
+    if (cur != 0) return NULL;
+
+    lock_obj = lock_alloc();
+    lock_obj->table_id = name.table_id;
+    lock_obj->key = name.key;
+    lock_obj->level = name.level;
+    lock_obj->pagenum = pagenum;
+    lock_obj->lock_mode = lock_mode;
+    lock_obj->fast = 1;
+    lock_obj->prev = lock_obj->next = NULL;
+    lock_obj->sentinel = NULL;
+    lock_obj->flag = 1;
+    lock_obj->trx_id = trx->trx_id;
+    if (!word->compare_exchange_strong(cur, (uint64_t)(uintptr_t)lock_obj | (uint64_t)lock_mode)) {
+        lock_free_chain(lock_obj, lock_obj, 1);
+        return NULL;
+    }
+
+    // Only the thread of the trx touches its lock list.
+    lock_obj->next_trx_lock = trx->head;
+    trx->head = lock_obj;
+    trx->lock_count++;
+    lock_add_dependency(trx, lock_get_bucket(name));
+    return lock_obj;
+}
+
+/* Count a new queue of a record on its lock word, and move the lock granted
+ * on the word for the record to the head of the queue. Its mode was kept
+ * on the word until then. The caller must hold the bucket latch.
+ */
+static void lock_word_add_queue(lock_table_t *node, const lock_name_t &name) {
+    std::atomic<uint64_t> *word = lock_get_word(name);
+    uint64_t cur = word->fetch_add(LOCK_WORD_QUEUE) + LOCK_WORD_QUEUE;
+    lock_t *lock_obj;
+
+    do {
+        lock_obj = lock_word_holder(cur);
+        if (lock_obj == NULL || lock_obj->key != name.key || lock_obj->table_id != name.table_id)
+            return;
+    } while (!word->compare_exchange_weak(cur, cur & ~LOCK_WORD_HOLDER));
+
+    lock_obj->lock_mode = (int)(cur & LOCK_WORD_MODE);
+    lock_obj->sentinel = node;
+    lock_obj->prev = lock_obj->next = NULL;
+    node->head = node->tail = lock_obj;
+    node->length = 1;
+}
+
+// Release a lock granted on its lock word. Returns -1 if another request
+// moved it to the queue of its record.
+static int lock_word_release(lock_t *lock_obj) {
+    std::atomic<uint64_t> *word = lock_get_word(lock_get_name(lock_obj));
+    uint64_t cur = *word;
+
+    while (lock_word_holder(cur) == lock_obj)
+        if (word->compare_exchange_weak(cur, cur & ~LOCK_WORD_HOLDER)) return 0;
+    return -1;
+}
+
+// Choose how deadlocks are handled.
+int lock_set_deadlock_policy(int policy, int timeout_ms) {
+    if (policy < DEADLOCK_DETECT || policy > DEADLOCK_WOUND_WAIT || timeout_ms <= 0)
+        return -1;
+
+    if (deadlock_detector_running) {
+        deadlock_detector_running = 0;
+        pthread_join(deadlock_detector, NULL);
+    }
+    deadlock_policy = policy;
+    lock_wait_timeout_ms = timeout_ms;
+    if (policy == DEADLOCK_TIMEOUT) {
+        deadlock_detector_running = 1;
+        pthread_create(&deadlock_detector, NULL, lock_detector_func, NULL);
+    }
+    return 0;
+}
+
+/* Request a lock on the queue of a name for a transaction. Returns the
+ * granted lock, or NULL if the transaction was aborted. Without wait, a
+ * request that cannot be granted at once is withdrawn and NULL is returned
+ * with the transaction still alive.
+ */
+static lock_t *lock_request(trx_t *trx, const lock_name_t &name, pagenum_t pagenum, int lock_mode, int wait) {
+    lock_bucket_t *bucket = lock_get_bucket(name);
+    lock_table_t *node;
+    lock_t *new_lock, *cur_lock, *held_lock, *last_granted, *prev_lock;
+    std::vector<int> conflicts;
+    struct timespec deadline;
+    uint64_t wait_start;
+    int timed_out = 0, granted, queue_length, cause;
+    int trx_id = trx->trx_id;
+
+    if (name.level == LOCK_LEVEL_RECORD && lock_fast_path) {
+        new_lock = lock_word_acquire(trx, name, pagenum, lock_mode);
+        if (new_lock != NULL) return new_lock;
+    }
+
+    //  Latch
+    lock_latch(bucket);
+
+    auto inserted = bucket->table.try_emplace(name);
+    node = &inserted.first->second;
+    if (inserted.second) {
+        node->table_id = name.table_id;
+        node->key = name.key;
+        node->level = name.level;
+        node->bucket = bucket;
+        if (name.level == LOCK_LEVEL_RECORD) lock_word_add_queue(node, name);
+    }
+
+    // Find the strongest lock the trx already holds on the record. Granted
+    // locks always come first in the queue.
+    held_lock = last_granted = NULL;
+    for (cur_lock = node->head; cur_lock != NULL && cur_lock->flag == 1; cur_lock = cur_lock->next) {
+        last_granted = cur_lock;
+        if (cur_lock->trx_id != trx_id) continue;
+        if (held_lock == NULL || lock_covers(cur_lock->lock_mode, held_lock->lock_mode))
+            held_lock = cur_lock;
+    }
+
+    if (held_lock != NULL) {
+        if (lock_covers(held_lock->lock_mode, lock_mode)) {
+            // Unlatch
+            lock_unlatch(bucket);
+            return held_lock;
+        }
+        lock_add_dependency(trx, bucket);
+
+        // Upgrade to a mode that allows both, in place if no other holder
+        // conflicts
+        lock_mode = lock_combine(held_lock->lock_mode, lock_mode);
+        for (cur_lock = node->head; cur_lock != last_granted->next; cur_lock = cur_lock->next)
+            if (cur_lock->trx_id != trx_id && !lock_compatible(cur_lock->lock_mode, lock_mode)) break;
+        if (cur_lock == last_granted->next) {
+            held_lock->lock_mode = lock_mode;
+            // Unlatch
+            lock_unlatch(bucket);
+            return held_lock;
+        }
+    }
+
+    // Create a new lock object
+    new_lock = lock_alloc();
+
+    new_lock->table_id = name.table_id;
+    new_lock->key = name.key;
+    new_lock->level = name.level;
+    new_lock->pagenum = pagenum;
+    new_lock->lock_mode = lock_mode;
+    new_lock->fast = 0;
+    new_lock->sentinel = node;
+    new_lock->trx_id = trx_id;
+
+    // Only the thread of the trx touches its lock list.
+    new_lock->next_trx_lock = trx->head;
+    trx->head = new_lock;
+    trx->lock_count++;
+
+    // A new request goes to the tail of the queue. An upgrade waits at the
+    // front instead, right behind the holders, for the others to leave.
+    prev_lock = held_lock != NULL ? last_granted : node->tail;
+    new_lock->prev = prev_lock;
+    new_lock->next = prev_lock != NULL ? prev_lock->next : node->head;
+    if (prev_lock != NULL)
+        prev_lock->next = new_lock;
+    else
+        node->head = new_lock;
+    if (new_lock->next != NULL)
+        new_lock->next->prev = new_lock;
+    else
+        node->tail = new_lock;
+    if ((uint64_t)++node->length > bucket->stats.max_queue_length)
+        bucket->stats.max_queue_length = node->length;
+
+    // Granted without waiting
+    lock_find_conflicts(new_lock, &conflicts);
+    if (new_lock->flag == 1) {
+        lock_add_dependency(trx, bucket);
+        //  Unlatch
+        lock_unlatch(bucket);
+        return new_lock;
+    }
+
+    // Apply the deadlock policy without the bucket latch.
+    queue_length = node->length;
+    lock_unlatch(bucket);
+    if (!wait) {
+        trx->head = new_lock->next_trx_lock;
+        trx->lock_count--;
+        lock_release(new_lock);
+        return NULL;
+    }
+    wait_start = lock_now_ns();
+    if (lock_prepare_wait(trx, new_lock, conflicts) != 0) {
+        lock_add_abort(held_lock != NULL ? LOCK_ABORT_UPGRADE : trx->abort_cause.load());
+        trx_abort(trx_id);
+        return NULL;
+    }
+
+    //  Wait until flag changes to 1, the trx is chosen to abort or the wait
+    //  times out
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += lock_wait_timeout_ms / 1000;
+    deadline.tv_nsec += (long)(lock_wait_timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+
+    lock_latch(bucket);
+    // Others take the latch while this thread waits, so its hold is not
+    // sampled.
+    bucket->latched_at = 0;
+    while (new_lock->flag == 0 && !trx->abort_requested && !timed_out) {
+        if (deadlock_policy == DEADLOCK_TIMEOUT)
+            timed_out = pthread_cond_timedwait(&new_lock->cond, &bucket->latch, &deadline) == ETIMEDOUT;
+        else
+            pthread_cond_wait(&new_lock->cond, &bucket->latch);
+    }
+    granted = new_lock->flag;
+    if (granted)
+        lock_add_dependency(trx, bucket);
+    lock_add_wait(bucket, node, lock_now_ns() - wait_start, queue_length);
+
+    //  Unlatch
+    lock_unlatch(bucket);
+
+    conflicts.clear();
+    trx_set_wait_for(trx, conflicts, NULL);
+    if (!granted) {
+        cause = trx->abort_requested ? trx->abort_cause.load() : LOCK_ABORT_TIMEOUT;
+        lock_add_abort(held_lock != NULL ? LOCK_ABORT_UPGRADE : cause);
+        trx_abort(trx_id);
+        return NULL;
+    }
+    return new_lock;
+}
+
+// Grant a lock and wake only the thread waiting for it.
+// The caller must hold the bucket latch.
+static void lock_grant(lock_t *lock_obj) {
+    if (lock_obj->flag == 1) return;
+    lock_obj->flag = 1;
+    pthread_cond_signal(&lock_obj->cond);
+}
+
+/* Grant the waiting requests at the front of a queue, in order, until one
+ * conflicts with the locks ahead of it. Locks ahead of a request that
+ * belong to its own transaction, like the lock an upgrade started from,
+ * never conflict with it. The caller must hold the bucket latch.
+ */
+static void lock_grant_waiters(lock_table_t *node) {
+    lock_t *cur_lock, *ahead;
+    int owner = 0, modes = 0, mode;
+
+    // owner is the only transaction ahead, or -1 if there are more, and
+    // modes has a bit for every lock mode ahead.
+    for (cur_lock = node->head; cur_lock != NULL; cur_lock = cur_lock->next) {
+        if (cur_lock->flag == 0) {
+            for (mode = 0; mode < LOCK_MODE_NUMBER; mode++)
+                if ((modes >> mode & 1) && !lock_compatible(mode, cur_lock->lock_mode)) break;
+
+            // A conflicting mode ahead may belong to its own transaction.
+            if (mode < LOCK_MODE_NUMBER && owner != 0 && owner != cur_lock->trx_id) {
+                for (ahead = node->head; ahead != cur_lock; ahead = ahead->next)
+                    if (ahead->trx_id != cur_lock->trx_id &&
+                        !lock_compatible(ahead->lock_mode, cur_lock->lock_mode)) return;
+            }
+            lock_grant(cur_lock);
+        }
+        owner = owner == 0 || owner == cur_lock->trx_id ? cur_lock->trx_id : -1;
+        modes |= 1 << cur_lock->lock_mode;
+    }
+}
+
+// Take a lock out of its queue and grant the requests behind it.
+// The caller must hold the bucket latch.
+static void lock_unlink_latched(lock_t *lock_obj) {
+    lock_table_t *node = lock_obj->sentinel;
+    lock_bucket_t *bucket = node->bucket;
+
+    // Update pointers
+    if (lock_obj->prev == NULL) {
+        node->head = lock_obj->next;
+        if (lock_obj->next == NULL)
+            node->tail = NULL;
+        else
+            lock_obj->next->prev = NULL;
+    } else {
+        lock_obj->prev->next = lock_obj->next;
+        if (lock_obj->next == NULL)
+            node->tail = lock_obj->prev;
+        else
+            lock_obj->next->prev = lock_obj->prev;
+    }
+    node->length--;
+
+    // Lock object list is empty, erase the entry
+    if (node->head == NULL) {
+        if (node->level == LOCK_LEVEL_RECORD)
+            lock_get_word(lock_get_name(lock_obj))->fetch_sub(LOCK_WORD_QUEUE);
+        bucket->table.erase(lock_name_t{ node->table_id, node->key, node->level });
+        return;
+    }
+
+    lock_grant_waiters(node);
+}
+
+// Take a lock off its lock word, or out of its queue and grant the
+// requests behind it. The lock object itself is left to the caller.
+static void lock_unlink(lock_t *lock_obj) {
+    lock_bucket_t *bucket = lock_get_bucket(lock_get_name(lock_obj));
+
+    if (lock_obj->fast && lock_word_release(lock_obj) == 0) return;
+
+    //  Latch.
+    lock_latch(bucket);
+    lock_unlink_latched(lock_obj);
+    //  Unlatch.
+    lock_unlatch(bucket);
+}
+
+/* Release every lock of a transaction. Locks still on their lock words
+ * are released there, and the others taking the latch of each bucket
+ * once. commit_lsn is recorded in the buckets when the commit of the
+ * transaction may not be durable yet, so the transactions granted locks
+ * there next wait for it.
+ */
+static void lock_release_all(trx_t *trx, uint64_t commit_lsn) {
+    static thread_local std::vector<std::pair<lock_bucket_t *, lock_t *>> locks;
+    lock_bucket_t *bucket;
+    lock_t *cur_lock, *tail = NULL;
+    size_t i, j;
+    int count = 0;
+
+    if (trx->head == NULL) return;
+
+    locks.clear();
+    for (cur_lock = trx->head; cur_lock != NULL; cur_lock = cur_lock->next_trx_lock) {
+        tail = cur_lock;
+        count++;
+        bucket = lock_get_bucket(lock_get_name(cur_lock));
+        if (cur_lock->fast) {
+            if (commit_lsn != 0) lock_add_commit(bucket, commit_lsn);
+            if (lock_word_release(cur_lock) == 0) continue;
+        }
+        locks.push_back(std::make_pair(bucket, cur_lock));
+    }
+    std::sort(locks.begin(), locks.end());
+
+    for (i = 0; i < locks.size(); i = j) {
+        bucket = locks[i].first;
+        lock_latch(bucket);
+        lock_add_commit(bucket, commit_lsn);
+        for (j = i; j < locks.size() && locks[j].first == bucket; j++)
+            lock_unlink_latched(locks[j].second);
+        lock_unlatch(bucket);
+    }
+
+    // The lock list is already chained, so it is freed in one step.
+    lock_free_chain(trx->head, tail, count);
+    trx->head = NULL;
+    trx->lock_count = 0;
+}
+
+// Release the lock.
+int lock_release(lock_t *lock_obj) {
+    lock_unlink(lock_obj);
+    lock_free_chain(lock_obj, lock_obj, 1);
+    return 0;
+}
+
+/* LOCK HIERARCHY.
+ * A record lock is taken under intention locks on its block and its table.
+ * Once a transaction holds many locks below a block or a table, they are
+ * replaced with a single shared or exclusive lock on it, and later requests
+ * below it are granted by that lock without a queue of their own.
+ */
+
+// Choose the numbers of child locks at which blocks and tables escalate.
+int lock_set_escalation_threshold(int block_threshold, int table_threshold) {
+    if (block_threshold <= 0 || table_threshold <= 0)
+        return -1;
+    block_escalation_threshold = block_threshold;
+    table_escalation_threshold = table_threshold;
+    return 0;
+}
+
+// Whether a lock of a transaction lies below a block or table.
+static int lock_is_child(lock_t *lock_obj, const lock_name_t &name) {
+    if (lock_obj->table_id != name.table_id || lock_obj->level >= name.level) return 0;
+    if (name.level == LOCK_LEVEL_TABLE) return 1;
+    return lock_obj->key >> LOCK_BLOCK_SHIFT == name.key;
+}
+
+/* Replace the locks a transaction holds below a block or table with one
+ * lock on it. Escalation never waits: if another transaction holds a
+ * conflicting lock, the transaction keeps its locks and tries again once
+ * it holds twice as many. Returns 0 if the locks were replaced.
+ */
+static int lock_escalate(trx_t *trx, const lock_name_t &name, trx_granule_t *granule,
+                          trx_granule_t *parent) {
+    lock_t *lock_obj, **link, *released = NULL, *tail = NULL;
+    int count = 0;
+
+    lock_obj = lock_request(trx, name, 0, granule->child_writes ? LOCK_EXCLUSIVE : LOCK_SHARED, 0);
+    if (lock_obj == NULL) {
+        granule->escalate_at *= 2;
+        return -1;
+    }
+    granule->lock = lock_obj;
+
+    // Only the thread of the trx touches its lock list.
+    for (link = &trx->head; *link != NULL;) {
+        lock_obj = *link;
+        if (!lock_is_child(lock_obj, name)) {
+            link = &lock_obj->next_trx_lock;
+            continue;
+        }
+        *link = lock_obj->next_trx_lock;
+        lock_unlink(lock_obj);
+        lock_obj->next_trx_lock = released;
+        released = lock_obj;
+        if (tail == NULL) tail = lock_obj;
+        count++;
+    }
+    lock_free_chain(released, tail, count);
+    trx->lock_count -= count;
+    granule->child_locks = 0;
+    granule->escalate_at = block_escalation_threshold;
+    if (parent != NULL) parent->child_locks -= count;
+
+    // The block locks of an escalated table are gone.
+    if (name.level == LOCK_LEVEL_TABLE) {
+        for (auto it = trx->granules.begin(); it != trx->granules.end();) {
+            if (it->first.table_id == name.table_id && it->first.level != LOCK_LEVEL_TABLE)
+                it = trx->granules.erase(it);
+            else
+                ++it;
+        }
+        granule->escalate_at = table_escalation_threshold;
+    }
+    return 0;
+}
+
+/* Lock a record, block or table for a transaction, after taking intention
+ * locks on the block and table above it. A lock above that already covers
+ * the request is returned instead. Returns NULL if the transaction was
+ * aborted, or without wait, if a lock could not be granted at once.
+ */
+static lock_t *lock_granule(trx_t *trx, const lock_name_t &name, pagenum_t pagenum, int lock_mode,
+                            int wait) {
+    trx_granule_t *parents[2], *granule = NULL;
+    lock_name_t parent_names[2];
+    lock_t *lock_obj;
+    int i, level, intention, count;
+    int num_parents = 0;
+
+    intention = lock_intention(lock_mode);
+    for (level = LOCK_LEVEL_TABLE; level > name.level; level--) {
+        lock_name_t parent_name = { name.table_id, 0, level };
+        if (level == LOCK_LEVEL_BLOCK) parent_name.key = name.key >> LOCK_BLOCK_SHIFT;
+
+        auto it = trx->granules.find(parent_name);
+        if (it == trx->granules.end()) {
+            it = trx->granules.emplace(parent_name, trx_granule_t{ NULL, 0, 0, 0 }).first;
+            it->second.escalate_at = level == LOCK_LEVEL_TABLE ? table_escalation_threshold
+                                                               : block_escalation_threshold;
+        }
+        if (it->second.lock != NULL && lock_covers(it->second.lock->lock_mode, lock_mode))
+            return it->second.lock;
+        if (it->second.lock == NULL || !lock_covers(it->second.lock->lock_mode, intention)) {
+            lock_obj = lock_request(trx, parent_name, 0, intention, wait);
+            if (lock_obj == NULL)
+                return NULL;
+            it->second.lock = lock_obj;
+        }
+        parent_names[num_parents] = parent_name;
+        parents[num_parents++] = &it->second;
+    }
+
+    if (name.level != LOCK_LEVEL_RECORD) {
+        granule = &trx->granules[name];
+        if (granule->lock != NULL && lock_covers(granule->lock->lock_mode, lock_mode))
+            return granule->lock;
+        if (granule->lock == NULL)
+            granule->escalate_at = name.level == LOCK_LEVEL_TABLE ? table_escalation_threshold
+                                                                  : block_escalation_threshold;
+    }
+
+    count = trx->lock_count;
+    lock_obj = lock_request(trx, name, pagenum, lock_mode, wait);
+    if (lock_obj == NULL)
+        return NULL;
+    if (granule != NULL)
+        granule->lock = lock_obj;
+
+    // Count the new lock below the block and table, and escalate the lowest
+    // one that holds too many. The new lock is then covered by, and
+    // replaced with, the escalated one.
+    count = trx->lock_count - count;
+    for (i = 0; i < num_parents; i++) {
+        parents[i]->child_locks += count;
+        if (intention == LOCK_INTENTION_EXCLUSIVE) parents[i]->child_writes = 1;
+    }
+    for (i = num_parents - 1; i >= 0; i--) {
+        if (parents[i]->child_locks >= parents[i]->escalate_at) {
+            if (lock_escalate(trx, parent_names[i], parents[i], i > 0 ? parents[0] : NULL) == 0)
+                return parents[i]->lock;
+            break;
+        }
+    }
+    return lock_obj;
+}
+
+// Acquire a lock on a record.
+lock_t *lock_acquire(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int lock_mode) {
+    trx_t *trx;
+
+    // Another transaction chose this one to abort
+    // Only a locking trx takes locks, and writes through them
+    trx = trx_get(trx_id);
+    if (trx == NULL || trx->mode != TRX_LOCKING)
+        return NULL;
+    if (trx->abort_requested) {
+        lock_add_abort(trx->abort_cause);
+        trx_abort(trx_id);
+        return NULL;
+    }
+    return lock_granule(trx, lock_name_t{ table_id, key, LOCK_LEVEL_RECORD }, pagenum, lock_mode, 1);
+}
+
+/* Lock every key from begin_key to end_key, whether or not a record has
+ * it, by locking the blocks of the range. A range over more blocks than a
+ * block escalates at locks the whole table instead.
+ */
+int lock_acquire_range(int64_t table_id, int64_t begin_key, int64_t end_key, int trx_id, int lock_mode) {
+    int64_t block, begin_block, end_block;
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL || trx->mode != TRX_LOCKING)
+        return -1;
+    if (trx->abort_requested) {
+        lock_add_abort(trx->abort_cause);
+        trx_abort(trx_id);
+        return -1;
+    }
+    if (begin_key > end_key)
+        return 0;
+
+    begin_block = begin_key >> LOCK_BLOCK_SHIFT;
+    end_block = end_key >> LOCK_BLOCK_SHIFT;
+    if ((uint64_t)end_block - (uint64_t)begin_block >= (uint64_t)block_escalation_threshold)
+        return lock_granule(trx, lock_name_t{ table_id, 0, LOCK_LEVEL_TABLE }, 0, lock_mode, 1) != NULL ? 0 : -1;
+
+    for (block = begin_block; block <= end_block; block++) {
+        if (lock_granule(trx, lock_name_t{ table_id, block, LOCK_LEVEL_BLOCK }, 0, lock_mode, 1) == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/* VERSION STORE.
+ * An update keeps the committed value it overwrites, so that readers can
+ * see the records as of the start of their transaction without locking.
+ * The page holds the newest value, and older values are chained from the
+ * record's entry, newest first. A version is freed once every active
+ * snapshot is newer than the version that replaced it.
+ */
+
+#define VERSION_BUCKET_NUMBER 128
+
+// A committed value of a record, replaced by a later one.
+struct version_t {
+    int64_t commit_ts;
+    uint16_t val_size;
+    version_t *older;
+    char value[];
+};
+
+// The versions of a record, kept once it has been updated.
+struct record_version_t {
+    int writer_trx;         // Transaction with an uncommitted update, or 0.
+    int64_t commit_ts;      // Commit of the value on the page.
+    version_t *versions;
+};
+
+// A partition of the version store with its own latch.
+struct version_bucket_t {
+    pthread_mutex_t latch;
+    std::unordered_map <std::pair<int64_t, int64_t>, record_version_t, pair_hash> table;
+};
+
+version_bucket_t version_buckets[VERSION_BUCKET_NUMBER];
+
+// Records to look at for garbage, in commit order. Guarded by the garbage
+// collection latch, which is taken after the commit latch.
+std::deque<std::pair<int64_t, std::pair<int64_t, int64_t>>> version_gc_queue;
+pthread_mutex_t version_gc_latch = PTHREAD_MUTEX_INITIALIZER;
+
+// Held by the thread collecting garbage.
+pthread_mutex_t version_collect_latch = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the version bucket of a record.
+static version_bucket_t *version_get_bucket(int64_t table_id, int64_t key) {
+    return &version_buckets[pair_hash()(std::make_pair(table_id, key)) % VERSION_BUCKET_NUMBER];
+}
+
+// Free a chain of versions.
+static void version_free_chain(version_t *version) {
+    version_t *older;
+    for (; version != NULL; version = older) {
+        older = version->older;
+        free(version);
+    }
+}
+
+// Initialize the version store.
+static void init_version_store() {
+    int i;
+    for (i = 0; i < VERSION_BUCKET_NUMBER; i++) {
+        pthread_mutex_init(&version_buckets[i].latch, NULL);
+        for (auto &entry : version_buckets[i].table) version_free_chain(entry.second.versions);
+        version_buckets[i].table.clear();
+    }
+    version_gc_queue.clear();
+    visible_commit_lsn = 0;
+}
+
+// Free the versions of a record that no snapshot from min_snapshot_ts on
+// can see, and the entry itself once it has no use left.
+// The caller must hold the bucket latch.
+static void version_prune(version_bucket_t *bucket, int64_t table_id, int64_t key, int64_t min_snapshot_ts) {
+    record_version_t *record;
+    version_t **link;
+    int64_t newer_ts;
+
+    auto it = bucket->table.find(std::make_pair(table_id, key));
+    if (it == bucket->table.end()) return;
+    record = &it->second;
+
+    // A version is visible to the snapshots between its commit and the
+    // commit of the next newer one.
+    newer_ts = record->writer_trx != 0 ? std::numeric_limits<int64_t>::max() : record->commit_ts;
+    for (link = &record->versions; *link != NULL; link = &(*link)->older) {
+        if (newer_ts <= min_snapshot_ts) {
+            version_free_chain(*link);
+            *link = NULL;
+            break;
+        }
+        newer_ts = (*link)->commit_ts;
+    }
+    if (record->versions == NULL && record->writer_trx == 0 && record->commit_ts <= min_snapshot_ts)
+        bucket->table.erase(it);
+}
+
+/* Find the oldest snapshot of the active transactions. A transaction that
+ * begins after its partition was visited takes a snapshot no older than
+ * the commit read here first.
+ */
+static int64_t trx_min_snapshot() {
+    int64_t min_snapshot_ts = visible_commit_ts;
+    int i;
+
+    for (i = 0; i < TRX_SHARD_NUMBER; i++) {
+        pthread_mutex_lock(&trx_shards[i].latch);
+        for (auto &entry : trx_shards[i].table)
+            if (entry.second->snapshot_ts < min_snapshot_ts) min_snapshot_ts = entry.second->snapshot_ts;
+        pthread_mutex_unlock(&trx_shards[i].latch);
+    }
+    return min_snapshot_ts;
+}
+
+// Prune the records whose last commit every snapshot can see. It runs
+// after a commit without the commit latch, and only one thread collects
+// at a time, so commits never wait for the walk of the shards.
+static void version_collect_garbage() {
+    std::vector<std::pair<int64_t, int64_t>> records;
+    version_bucket_t *bucket;
+    int64_t min_snapshot_ts;
+
+    if (pthread_mutex_trylock(&version_collect_latch) != 0)
+        return;
+    pthread_mutex_lock(&version_gc_latch);
+    if (version_gc_queue.empty()) {
+        pthread_mutex_unlock(&version_gc_latch);
+        pthread_mutex_unlock(&version_collect_latch);
+        return;
+    }
+    pthread_mutex_unlock(&version_gc_latch);
+
+    min_snapshot_ts = trx_min_snapshot();
+    pthread_mutex_lock(&version_gc_latch);
+    while (!version_gc_queue.empty() && version_gc_queue.front().first <= min_snapshot_ts) {
+        records.push_back(version_gc_queue.front().second);
+        version_gc_queue.pop_front();
+    }
+    pthread_mutex_unlock(&version_gc_latch);
+
+    for (auto &record : records) {
+        bucket = version_get_bucket(record.first, record.second);
+        pthread_mutex_lock(&bucket->latch);
+        version_prune(bucket, record.first, record.second, min_snapshot_ts);
+        pthread_mutex_unlock(&bucket->latch);
+    }
+    pthread_mutex_unlock(&version_collect_latch);
+}
+
+/* Keep the committed value of a record that a transaction is about to
+ * change for the first time, or VERSION_ABSENT as its size if the record
+ * does not exist yet. Fails if a transaction committed a change of the
+ * record after the snapshot of this one, since this change would overwrite
+ * a value it never saw. The caller must hold the exclusive lock.
+ */
+int trx_add_version(int trx_id, int64_t table_id, int64_t key, const char *value, uint16_t val_size) {
+    version_bucket_t *bucket = version_get_bucket(table_id, key);
+    record_version_t *record;
+    version_t *version;
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL)
+        return -1;
+
+    pthread_mutex_lock(&bucket->latch);
+    auto it = bucket->table.find(std::make_pair(table_id, key));
+    if (it == bucket->table.end()) {
+        record = &bucket->table[std::make_pair(table_id, key)];
+        record->writer_trx = 0;
+        record->commit_ts = 0;
+        record->versions = NULL;
+    } else {
+        record = &it->second;
+    }
+
+    if (record->commit_ts > trx->snapshot_ts) {
+        pthread_mutex_unlock(&bucket->latch);
+        return -1;
+    }
+
+    version = (version_t *)malloc(sizeof(version_t) + (val_size != VERSION_ABSENT ? val_size : 0));
+    if (version == NULL) {
+        perror("version creation");
+        exit(EXIT_FAILURE);
+    }
+    version->commit_ts = record->commit_ts;
+    version->val_size = val_size;
+    version->older = record->versions;
+    if (val_size != VERSION_ABSENT)
+        memcpy(version->value, value, val_size);
+    record->versions = version;
+    record->writer_trx = trx_id;
+
+    pthread_mutex_unlock(&bucket->latch);
+    return 0;
+}
+
+/* Read the value of a record visible to the snapshot of a transaction. The
+ * page is read under the bucket latch, so an update cannot reach the page
+ * between the check of the record's versions and the read. pagenum is the
+ * leaf the record would be in, or 0 if the table is empty. An optimistic
+ * transaction reads its own buffered update, and validates the records it
+ * read when it commits.
+ */
+int trx_read_version(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key,
+                     char *ret_val, uint16_t *val_size) {
+    version_bucket_t *bucket = version_get_bucket(table_id, key);
+    record_version_t *record = NULL;
+    version_t *version;
+    leaf_node *leaf;
+    trx_t *trx;
+    int i, ret = -1;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL)
+        return -1;
+
+    if (trx->mode == TRX_OPTIMISTIC) {
+        auto write = trx->write_set.find(std::make_pair(table_id, key));
+        if (write != trx->write_set.end()) {
+            *val_size = write->second->val_size;
+            memcpy(ret_val, write->second->value, *val_size);
+            return 0;
+        }
+        trx->read_set.insert(std::make_pair(table_id, key));
+    }
+
+    pthread_mutex_lock(&bucket->latch);
+    auto it = bucket->table.find(std::make_pair(table_id, key));
+    if (it != bucket->table.end()) record = &it->second;
+
+    // The value on the page is the newest one, or its own update.
+    if (record == NULL || record->writer_trx == trx_id ||
+        (record->writer_trx == 0 && record->commit_ts <= trx->snapshot_ts)) {
+        if (pagenum == 0) {
+            pthread_mutex_unlock(&bucket->latch);
+            return -1;
+        }
+        leaf = (leaf_node *)buffer_read_page(table_id, pagenum);
+        i = leaf_lower_bound(leaf, key);
+        if (i < (int)leaf->num_keys && read_leaf_key(leaf, i) == key) {
+            *val_size = read_leaf_val_size(leaf, i);
+            read_leaf_value(leaf, ret_val, i);
+            ret = 0;
+        }
+        buffer_page_unlatch((struct page_t *)leaf);
+    } else {
+        for (version = record->versions; version != NULL; version = version->older) {
+            if (version->commit_ts <= trx->snapshot_ts) {
+                // The record was inserted after the snapshot.
+                if (version->val_size == VERSION_ABSENT) break;
+                *val_size = version->val_size;
+                memcpy(ret_val, version->value, version->val_size);
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&bucket->latch);
+    return ret;
+}
+
+// Whether a transaction changed any record.
+static int trx_has_changes(trx_t *trx) {
+    size_t i;
+
+    for (i = 0; i < trx->undo_records.size(); i++)
+        if (trx->undo_records[i]->undo_type != UNDO_NONE) return 1;
+    return 0;
+}
+
+// Make the updates of a committing transaction visible at a new timestamp.
+// commit_lsn is the LSN of its commit record.
+static void version_install(trx_t *trx, uint64_t commit_lsn) {
+    version_bucket_t *bucket;
+    trx_undo_t *undo;
+    int64_t commit_ts;
+    size_t i;
+
+    // Nothing to install for a transaction that only read.
+    if (!trx_has_changes(trx)) return;
+
+    pthread_mutex_lock(&trx_commit_latch);
+    pthread_mutex_lock(&version_gc_latch);
+    commit_ts = visible_commit_ts + 1;
+    for (i = 0; i < trx->undo_records.size(); i++) {
+        undo = trx->undo_records[i];
+        if (undo->undo_type == UNDO_NONE) continue;
+
+        bucket = version_get_bucket(undo->table_id, undo->key);
+        pthread_mutex_lock(&bucket->latch);
+        auto it = bucket->table.find(std::make_pair(undo->table_id, undo->key));
+        it->second.writer_trx = 0;
+        it->second.commit_ts = commit_ts;
+        pthread_mutex_unlock(&bucket->latch);
+        version_gc_queue.push_back(std::make_pair(commit_ts, std::make_pair(undo->table_id, undo->key)));
+    }
+    pthread_mutex_unlock(&version_gc_latch);
+    visible_commit_ts = commit_ts;
+    if (commit_lsn > visible_commit_lsn)
+        visible_commit_lsn = commit_lsn;
+    pthread_mutex_unlock(&trx_commit_latch);
+
+    version_collect_garbage();
+}
+
+// Drop the version kept by an update that was rolled back. The page must
+// already hold the value again.
+static void version_rollback(int64_t table_id, int64_t key) {
+    version_bucket_t *bucket = version_get_bucket(table_id, key);
+    record_version_t *record;
+    version_t *version;
+    int64_t commit_ts;
+
+    pthread_mutex_lock(&bucket->latch);
+    auto it = bucket->table.find(std::make_pair(table_id, key));
+    record = &it->second;
+    version = record->versions;
+    record->versions = version->older;
+    record->writer_trx = 0;
+    commit_ts = record->commit_ts;
+    free(version);
+    pthread_mutex_unlock(&bucket->latch);
+
+    // The entry may have no use left.
+    pthread_mutex_lock(&version_gc_latch);
+    version_gc_queue.push_back(std::make_pair(commit_ts, std::make_pair(table_id, key)));
+    pthread_mutex_unlock(&version_gc_latch);
+}
+
+// Drop the version kept by trx_add_version for a change that failed.
+// The caller must hold the exclusive lock.
+void trx_drop_version(int64_t table_id, int64_t key) {
+    version_rollback(table_id, key);
+}
+
+// Only the thread of the trx touches its lock list.
+int trx_insert(int trx_id, lock_t *new_lock) {
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL)
+        return -1;
+
+    new_lock->next_trx_lock = trx->head;
+    trx->head = new_lock;
+    trx->lock_count++;
+    return 0;
+}
+
+int trx_find(int trx_id) {
+    return trx_get(trx_id) != NULL ? 0 : -1;
+}
+
+// Erase a transaction from the table and return it.
+static trx_t *trx_remove(int trx_id) {
+    trx_shard_t *shard = trx_get_shard(trx_id);
+    trx_t *trx;
+
+    // Latch.
+    pthread_mutex_lock(&shard->latch);
+
+    trx = trx_lookup(shard, trx_id);
+    if (trx == NULL) {
+        // Unlatch.
+        pthread_mutex_unlock(&shard->latch);
+        return NULL;
+    }
+
+    // Erase the trx, which no thread finds from now on
+    shard->table.erase(trx_id);
+    trx->trx_id = 0;
+
+    // Unlatch.
+    pthread_mutex_unlock(&shard->latch);
+    if (trx_context == trx) trx_context = NULL;
+    return trx;
+}
+
+// Release every lock of a finished transaction and free it.
+static void trx_destroy(trx_t *trx) {
+    lock_release_all(trx, 0);
+    trx_arena_clear(&trx->undo_arena);
+    trx->undo_log = NULL;
+    trx->wait_for.clear();
+    trx->granules.clear();
+    trx->undo_index.clear();
+    trx->undo_records.clear();
+    trx->read_set.clear();
+    trx->write_set.clear();
+    trx_free(trx);
+}
+
+// Unlatch a leaf undo wrote to, or only read.
+static void trx_undo_unlatch(leaf_node *leaf, int dirty) {
+    if (dirty)
+        buffer_write_logged_page((struct page_t *)leaf);
+    else
+        buffer_page_unlatch((struct page_t *)leaf);
+}
+
+/* Find the slot of the record changed by an undo log record, and leave the
+ * leaf that holds it latched in *leaf. The latched leaf is kept while the
+ * changes before are on it too, so undoing them takes a single latch. The
+ * leaf and slot the record was changed in are tried before the tree. Returns
+ * -1 with no leaf latched if the record does not exist.
+ */
+static int trx_undo_find_slot(trx_undo_rec_t *rec, leaf_node **leaf, int64_t *leaf_table_id,
+                              pagenum_t *leaf_pagenum, int *leaf_dirty) {
+    pagenum_t pagenum;
+    int i, tries;
+
+    pagenum = rec->pagenum != 0 && rec->free_count == tree_free_count ? rec->pagenum : 0;
+    for (tries = 0; tries < 2; tries++) {
+        if (pagenum == 0) {
+            // The descent may latch the leaf itself.
+            if (*leaf != NULL) {
+                trx_undo_unlatch(*leaf, *leaf_dirty);
+                *leaf = NULL;
+            }
+            pagenum = find_leaf(rec->table_id, rec->key);
+            if (pagenum == (pagenum_t)-1 || pagenum == 0) break;
+        }
+        if (*leaf != NULL && (*leaf_table_id != rec->table_id || *leaf_pagenum != pagenum)) {
+            trx_undo_unlatch(*leaf, *leaf_dirty);
+            *leaf = NULL;
+        }
+        if (*leaf == NULL) {
+            *leaf = (leaf_node *)buffer_read_page(rec->table_id, pagenum);
+            *leaf_table_id = rec->table_id;
+            *leaf_pagenum = pagenum;
+            *leaf_dirty = 0;
+        }
+
+        // Records of the leaf may have shifted, or moved to a new leaf.
+        i = rec->slot;
+        if (i < (int)(*leaf)->num_keys && read_leaf_key(*leaf, i) == rec->key)
+            return i;
+        i = leaf_lower_bound(*leaf, rec->key);
+        if (i < (int)(*leaf)->num_keys && read_leaf_key(*leaf, i) == rec->key)
+            return i;
+        pagenum = 0;
+    }
+
+    if (*leaf != NULL) {
+        trx_undo_unlatch(*leaf, *leaf_dirty);
+        *leaf = NULL;
+    }
+    return -1;
+}
+
+/* Apply the undo log of an aborting transaction, newest change first. An
+ * update is written back in place and logged like an update. The
+ * insertions and deletions that undo the others, and the updates that
+ * changed the size of a value, are made and logged like any other.
+ */
+static void trx_undo(trx_t *trx, int trx_id) {
+    char cur_value[MAX_VAL_SIZE];
+    trx_undo_rec_t *rec;
+    leaf_node *leaf = NULL;
+    pagenum_t leaf_pagenum = 0;
+    int64_t leaf_table_id = 0;
+    int leaf_dirty = 0, i;
+    uint64_t lsn;
+
+    pthread_rwlock_wrlock(&tree_latch);
+
+    for (rec = trx->undo_log; rec != NULL; rec = rec->prev) {
+        if (rec->undo_type == UNDO_UPDATE) {
+            i = trx_undo_find_slot(rec, &leaf, &leaf_table_id, &leaf_pagenum, &leaf_dirty);
+            if (i >= 0 && read_leaf_val_size(leaf, i) == rec->before_size) {
+                read_leaf_value(leaf, cur_value, i);
+                lsn = log_update(trx_id, rec->table_id, leaf_pagenum, rec->key, cur_value,
+                                 rec->before_size, rec->before, rec->before_size);
+                write_leaf_value(leaf, rec->before, rec->before_size, i);
+                if (lsn != 0)
+                    page_set_lsn((struct page_t *)leaf, lsn);
+                leaf_dirty = 1;
+                continue;
+            }
+        }
+
+        // The tree changes, so no leaf may stay latched.
+        if (leaf != NULL) {
+            trx_undo_unlatch(leaf, leaf_dirty);
+            leaf = NULL;
+        }
+        log_op_begin();
+        if (rec->undo_type != UNDO_DELETE)
+            bpt_delete(rec->table_id, rec->key);
+        if (rec->undo_type != UNDO_INSERT)
+            insert(rec->table_id, rec->key, rec->before, rec->before_size);
+        log_op_end();
+    }
+
+    if (leaf != NULL)
+        trx_undo_unlatch(leaf, leaf_dirty);
+    pthread_rwlock_unlock(&tree_latch);
+}
+
+int trx_abort(int trx_id) {
+    trx_undo_t *undo;
+    trx_t *trx;
+    size_t i;
+
+    trx = trx_remove(trx_id);
+    if (trx == NULL)
+        return 0;
+
+    trx_undo(trx, trx_id);
+    for (i = 0; i < trx->undo_records.size(); i++) {
+        undo = trx->undo_records[i];
+        if (undo->undo_type != UNDO_NONE)
+            version_rollback(undo->table_id, undo->key);
+    }
+    if (trx_has_changes(trx))
+        log_abort(trx_id);
+    trx_destroy(trx);
+    return 0;
+}
+
+// Begin a transaction of a concurrency control mode.
+static int trx_start(int mode) {
+    trx_t *trx = trx_alloc();
+    int trx_id = ++global_trx_id;
+    trx_shard_t *shard = trx_get_shard(trx_id);
+
+    trx->mode = mode;
+    trx->head = NULL;
+    trx->undo_log = NULL;
+    trx->waiting_lock = NULL;
+    trx->abort_requested = 0;
+    trx->abort_cause = LOCK_ABORT_DEADLOCK;
+    trx->lock_count = 0;
+    trx->undo_bytes = 0;
+
+    // Latch.
+    pthread_mutex_lock(&shard->latch);
+
+    // Taken under the latch so that garbage collection sees the snapshot.
+    // The snapshot may hold commits that are not durable yet.
+    trx->depend_lsn = visible_commit_lsn;
+    trx->snapshot_ts = visible_commit_ts;
+    trx->trx_id = trx_id;
+    shard->table[trx_id] = trx;
+
+    // Unlatch.
+    pthread_mutex_unlock(&shard->latch);
+    trx_context = trx;
+    return trx_id;
+}
+
+int trx_begin(void) {
+    return trx_start(TRX_LOCKING);
+}
+
+/* Begin a transaction that only reads its snapshot. It never takes a lock
+ * or waits, so it has nothing to release or undo when it ends.
+ */
+int trx_begin_readonly(void) {
+    return trx_start(TRX_READ_ONLY);
+}
+
+/* Begin a transaction that reads its snapshot and buffers its updates
+ * without locking. Its commit fails if another transaction committed a
+ * change of a record it read or updated in the meantime.
+ */
+int trx_begin_optimistic(void) {
+    return trx_start(TRX_OPTIMISTIC);
+}
+
+// Whether a transaction buffers its updates until it commits.
+int trx_is_optimistic(int trx_id) {
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    return trx != NULL && trx->mode == TRX_OPTIMISTIC;
+}
+
+// Buffer an update of an optimistic transaction until it commits.
+int trx_buffer_write(int trx_id, int64_t table_id, int64_t key, const char *value, uint16_t val_size) {
+    trx_write_t *write;
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL || trx->mode != TRX_OPTIMISTIC)
+        return -1;
+
+    write = (trx_write_t *)trx_arena_alloc(&trx->undo_arena, sizeof(trx_write_t) + val_size);
+    write->table_id = table_id;
+    write->key = key;
+    write->val_size = val_size;
+    memcpy(write->value, value, val_size);
+    trx->write_set[std::make_pair(table_id, key)] = write;
+    trx->read_set.insert(std::make_pair(table_id, key));
+    return 0;
+}
+
+// Whether a record changed after the snapshot of a transaction, or has an
+// uncommitted change of another one.
+static int trx_changed_since_snapshot(trx_t *trx, int64_t table_id, int64_t key) {
+    version_bucket_t *bucket = version_get_bucket(table_id, key);
+    int changed = 0;
+
+    pthread_mutex_lock(&bucket->latch);
+    auto it = bucket->table.find(std::make_pair(table_id, key));
+    if (it != bucket->table.end())
+        changed = it->second.commit_ts > trx->snapshot_ts ||
+                  (it->second.writer_trx != 0 && it->second.writer_trx != trx->trx_id);
+    pthread_mutex_unlock(&bucket->latch);
+    return changed;
+}
+
+/* Validate the records an optimistic transaction read and install its
+ * updates. The updated records are locked exclusively and the other ones
+ * it read in shared mode, without waiting, so none of them changes between
+ * the validation and the commit. Aborts the transaction and returns -1 if
+ * a lock is taken or a record changed after the snapshot.
+ */
+static int trx_install_writes(trx_t *trx) {
+    int trx_id = trx->trx_id;
+    uint16_t old_val_size;
+    trx_write_t *write;
+    int lock_mode;
+
+    for (auto &record : trx->read_set) {
+        lock_mode = trx->write_set.count(record) ? LOCK_EXCLUSIVE : LOCK_SHARED;
+        if (lock_granule(trx, lock_name_t{ record.first, record.second, LOCK_LEVEL_RECORD }, 0,
+                         lock_mode, 0) == NULL) {
+            trx_abort(trx_id);
+            return -1;
+        }
+    }
+    for (auto &record : trx->read_set) {
+        if (trx_changed_since_snapshot(trx, record.first, record.second)) {
+            trx_abort(trx_id);
+            return -1;
+        }
+    }
+
+    // An update fails only if the record is gone, which the validation saw.
+    for (auto &entry : trx->write_set) {
+        write = entry.second;
+        if (trx_write_record(trx_id, write->table_id, write->key, write->value, write->val_size,
+                             &old_val_size) != 0) {
+            trx_abort(trx_id);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Commit a transaction up to making it durable. Once the commit record is
+ * in the log, the updates are installed and the locks released before it
+ * is durable. The transactions that see the updates meanwhile wait for the
+ * commit LSN when they commit. Returns the transaction, removed from the
+ * table, with the LSN to make durable in *durable_lsn, or NULL if it was
+ * aborted.
+ */
+static trx_t *trx_precommit(int trx_id, uint64_t *durable_lsn) {
+    trx_t *trx;
+
+    // An optimistic trx validates and writes first.
+    trx = trx_get(trx_id);
+    if (trx != NULL && trx->mode == TRX_OPTIMISTIC && trx_install_writes(trx) != 0)
+        return NULL;
+
+    trx = trx_remove(trx_id);
+
+    // If trx has been aborted
+    if (trx == NULL)
+        return NULL;
+
+    // A read-only trx has nothing to install or release, but may have read
+    // commits that are not durable yet.
+    if (trx->mode == TRX_READ_ONLY) {
+        *durable_lsn = trx->depend_lsn;
+        return trx;
+    }
+
+    *durable_lsn = trx_has_changes(trx) ? log_commit(trx_id) : 0;
+    version_install(trx, *durable_lsn);
+    if (*durable_lsn < trx->depend_lsn)
+        *durable_lsn = trx->depend_lsn;
+    if (early_lock_release)
+        lock_release_all(trx, *durable_lsn);
+    return trx;
+}
+
+/* Commit a transaction and wait until the commit is durable. Returns -1
+ * if the log could not be written. The transaction has still ended and
+ * its updates are visible, but a crash may lose them.
+ */
+int trx_commit(int trx_id) {
+    uint64_t durable_lsn;
+    trx_t *trx;
+    int ret = trx_id;
+
+    trx = trx_precommit(trx_id, &durable_lsn);
+    if (trx == NULL)
+        return 0;
+    if (durable_lsn != 0 && log_flush(durable_lsn) != 0)
+        ret = -1;
+    trx_destroy(trx);
+    return ret;
+}
+
+
+/* ASYNCHRONOUS COMMIT.
+ * trx_commit_async commits a transaction up to making it durable and
+ * queues it. A worker thread makes every queued commit durable with one
+ * log flush, then ends the transactions and runs their callbacks in the
+ * order they were queued.
+ */
+
+// A commit waiting to be durable.
+struct trx_pending_commit_t {
+    int trx_id;
+    trx_t *trx;             // NULL once the transaction has ended.
+    uint64_t durable_lsn;
+    trx_commit_callback_t callback;
+    void *arg;
+};
+
+struct trx_commit_queue_t {
+    pthread_mutex_t latch;
+    pthread_cond_t cond;
+    std::vector<trx_pending_commit_t> queue;
+    pthread_t worker;
+    int running;
+    int stop;
+};
+
+trx_commit_queue_t trx_commit_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {}, 0, 0, 0 };
+
+// Make the queued commits durable in batches until stopped with an empty
+// queue.
+static void *trx_commit_worker_func(void *) {
+    std::vector<trx_pending_commit_t> batch;
+    uint64_t durable_lsn;
+    size_t i;
+    int failed;
+
+    pthread_mutex_lock(&trx_commit_queue.latch);
+    for (;;) {
+        while (trx_commit_queue.queue.empty() && !trx_commit_queue.stop)
+            pthread_cond_wait(&trx_commit_queue.cond, &trx_commit_queue.latch);
+        if (trx_commit_queue.queue.empty())
+            break;
+        batch.swap(trx_commit_queue.queue);
+        pthread_mutex_unlock(&trx_commit_queue.latch);
+
+        durable_lsn = 0;
+        for (i = 0; i < batch.size(); i++)
+            if (batch[i].durable_lsn > durable_lsn) durable_lsn = batch[i].durable_lsn;
+        failed = durable_lsn != 0 && log_flush(durable_lsn) != 0;
+
+        for (i = 0; i < batch.size(); i++) {
+            if (batch[i].trx != NULL)
+                trx_destroy(batch[i].trx);
+            if (batch[i].callback != NULL)
+                batch[i].callback(batch[i].trx_id, failed ? -1 : batch[i].trx_id, batch[i].arg);
+        }
+        batch.clear();
+        pthread_mutex_lock(&trx_commit_queue.latch);
+    }
+    pthread_mutex_unlock(&trx_commit_queue.latch);
+    return NULL;
+}
+
+// Queue a commit for the worker, starting it if needed.
+static void trx_queue_commit(const trx_pending_commit_t &commit) {
+    pthread_mutex_lock(&trx_commit_queue.latch);
+    if (!trx_commit_queue.running) {
+        trx_commit_queue.running = 1;
+        pthread_create(&trx_commit_queue.worker, NULL, trx_commit_worker_func, NULL);
+    }
+    trx_commit_queue.queue.push_back(commit);
+    pthread_cond_signal(&trx_commit_queue.cond);
+    pthread_mutex_unlock(&trx_commit_queue.latch);
+}
+
+/* Commit a transaction without waiting for the commit to be durable. The
+ * callback runs once it is, on the worker thread, with the result
+ * trx_commit would return. A relaxed commit runs the callback as soon as
+ * the commit is in memory, and is made durable in the background. An
+ * aborted transaction runs the callback right away with 0.
+ */
+int trx_commit_async(int trx_id, trx_commit_callback_t callback, void *arg, int relaxed) {
+    uint64_t durable_lsn;
+    trx_t *trx;
+
+    trx = trx_precommit(trx_id, &durable_lsn);
+    if (trx == NULL) {
+        if (callback != NULL)
+            callback(trx_id, 0, arg);
+        return 0;
+    }
+
+    if (durable_lsn == 0 || relaxed) {
+        lock_release_all(trx, durable_lsn);
+        trx_destroy(trx);
+        if (callback != NULL)
+            callback(trx_id, trx_id, arg);
+        if (durable_lsn != 0)
+            trx_queue_commit(trx_pending_commit_t{ trx_id, NULL, durable_lsn, NULL, NULL });
+        return trx_id;
+    }
+
+    trx_queue_commit(trx_pending_commit_t{ trx_id, trx, durable_lsn, callback, arg });
+    return trx_id;
+}
+
+/* Wait until every queued commit is durable and its callback has run, and
+ * stop the worker. Must not be called from a callback.
+ */
+void trx_flush_commits(void) {
+    pthread_mutex_lock(&trx_commit_queue.latch);
+    if (!trx_commit_queue.running) {
+        pthread_mutex_unlock(&trx_commit_queue.latch);
+        return;
+    }
+    trx_commit_queue.stop = 1;
+    pthread_cond_signal(&trx_commit_queue.cond);
+    pthread_mutex_unlock(&trx_commit_queue.latch);
+
+    pthread_join(trx_commit_queue.worker, NULL);
+
+    // Commits queued after the worker found the queue empty, while it was
+    // still marked running, get a new worker.
+    pthread_mutex_lock(&trx_commit_queue.latch);
+    trx_commit_queue.stop = 0;
+    if (trx_commit_queue.queue.empty())
+        trx_commit_queue.running = 0;
+    else
+        pthread_create(&trx_commit_queue.worker, NULL, trx_commit_worker_func, NULL);
+    pthread_mutex_unlock(&trx_commit_queue.latch);
+}
+
+/* Append a change to the undo log of a transaction, with the value before
+ * the change unless it inserted the record. pagenum and slot locate a
+ * record updated in place, and pagenum is 0 for any other change. Must be
+ * called with tree_latch held.
+ */
+int trx_log_undo(int trx_id, int undo_type, int64_t table_id, int64_t key, pagenum_t pagenum,
+                 int slot, const char *before, uint16_t before_size) {
+    trx_undo_rec_t *rec;
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL)
+        return -1;
+
+    if (undo_type == UNDO_INSERT)
+        before_size = 0;
+    rec = (trx_undo_rec_t *)trx_arena_alloc(&trx->undo_arena, sizeof(trx_undo_rec_t) + before_size);
+    rec->prev = trx->undo_log;
+    rec->table_id = table_id;
+    rec->key = key;
+    rec->pagenum = pagenum;
+    rec->free_count = tree_free_count;
+    rec->slot = slot;
+    rec->before_size = before_size;
+    rec->undo_type = undo_type;
+    if (before_size != 0)
+        memcpy(rec->before, before, before_size);
+    trx->undo_log = rec;
+    trx->undo_bytes += sizeof(trx_undo_rec_t) + before_size;
+    return 0;
+}
+
+/* Find how to undo the changes of a record by a transaction, adding an
+ * entry with nothing to undo yet on its first change. Only the thread of
+ * the transaction may use the entry.
+ */
+trx_undo_t *trx_get_undo(int trx_id, int64_t table_id, int64_t key) {
+    trx_undo_t *undo;
+    trx_t *trx;
+
+    trx = trx_get(trx_id);
+    if (trx == NULL)
+        return NULL;
+
+    auto it = trx->undo_index.find(std::make_pair(table_id, key));
+    if (it != trx->undo_index.end())
+        return it->second;
+
+    undo = (trx_undo_t *)trx_arena_alloc(&trx->undo_arena, sizeof(trx_undo_t));
+    undo->table_id = table_id;
+    undo->key = key;
+    undo->undo_type = UNDO_NONE;
+    trx->undo_index[std::make_pair(table_id, key)] = undo;
+    trx->undo_records.push_back(undo);
+    return undo;
+}
+
+/* Replace a record whose value changes size, which may split or merge
+ * leaves. It is logged as a deletion and an insertion, and undone the same
+ * way. Called with tree_latch held exclusively.
+ */
+static int trx_move_record(int trx_id, int64_t table_id, int64_t key, const char *old_value,
+                           uint16_t old_val_size, const char *value, uint16_t val_size) {
+    int ret;
+
+    trx_log_undo(trx_id, UNDO_UPDATE, table_id, key, 0, 0, old_value, old_val_size);
+    log_delete(trx_id, table_id, key, old_value, old_val_size);
+    log_insert(trx_id, table_id, key, value, val_size);
+
+    log_op_begin();
+    ret = bpt_delete(table_id, key);
+    if (ret == 0)
+        ret = insert(table_id, key, value, val_size);
+    log_op_end();
+    return ret;
+}
+
+/* Update a record the transaction holds an exclusive lock on. The first
+ * update keeps the original value for the snapshots that still read it,
+ * and every update logs the value it overwrites for undo. Returns -1 if the
+ * record is gone, or after aborting the transaction if another one
+ * committed a change of the record after its snapshot.
+ */
+int trx_write_record(int trx_id, int64_t table_id, int64_t key, const char *value,
+                     uint16_t val_size, uint16_t *old_val_size) {
+    char old_value[MAX_VAL_SIZE];
+    trx_undo_t *undo;
+    leaf_node *leaf;
+    pagenum_t pagenum;
+    uint64_t lsn;
+    int i, exclusive = 0, ret;
+
+    undo = trx_get_undo(trx_id, table_id, key);
+    if (undo == NULL)
+        return -1;
+
+    // The record may have moved or been deleted while waiting for the lock.
+    // A value that changes size is moved, which changes the tree.
+    pthread_rwlock_rdlock(&tree_latch);
+    for (;;) {
+        pagenum = find_leaf(table_id, key);
+        if (pagenum == (pagenum_t)-1 || pagenum == 0) {
+            pthread_rwlock_unlock(&tree_latch);
+            return -1;
+        }
+        leaf = (leaf_node *)buffer_read_page(table_id, pagenum);
+        i = leaf_lower_bound(leaf, key);
+        if (i == (int)leaf->num_keys || read_leaf_key(leaf, i) != key ||
+            (leaf->fixed_val_size && val_size != leaf->fixed_val_size)) {
+            buffer_page_unlatch((struct page_t *)leaf);
+            pthread_rwlock_unlock(&tree_latch);
+            return -1;
+        }
+        *old_val_size = read_leaf_val_size(leaf, i);
+        if (*old_val_size == val_size || exclusive)
+            break;
+        buffer_page_unlatch((struct page_t *)leaf);
+        pthread_rwlock_unlock(&tree_latch);
+        pthread_rwlock_wrlock(&tree_latch);
+        exclusive = 1;
+    }
+    read_leaf_value(leaf, old_value, i);
+
+    // Keep the original value for the snapshots that still read it
+    if (undo->undo_type == UNDO_NONE) {
+        buffer_page_unlatch((struct page_t *)leaf);
+
+        // Another trx updated the record after this one started
+        if (trx_add_version(trx_id, table_id, key, old_value, *old_val_size) != 0) {
+            pthread_rwlock_unlock(&tree_latch);
+            trx_abort(trx_id);
+            return -1;
+        }
+        undo->undo_type = UNDO_UPDATE;
+
+        leaf = (leaf_node *)buffer_read_page(table_id, pagenum);
+    }
+
+    if (*old_val_size != val_size) {
+        buffer_page_unlatch((struct page_t *)leaf);
+        ret = trx_move_record(trx_id, table_id, key, old_value, *old_val_size, value, val_size);
+        pthread_rwlock_unlock(&tree_latch);
+        return ret;
+    }
+
+    trx_log_undo(trx_id, UNDO_UPDATE, table_id, key, pagenum, i, old_value, *old_val_size);
+    lsn = log_update(trx_id, table_id, pagenum, key, old_value, *old_val_size, value, val_size);
+    write_leaf_value(leaf, value, val_size, i);
+    if (lsn != 0)
+        page_set_lsn((struct page_t *)leaf, lsn);
+
+    buffer_write_logged_page((struct page_t *)leaf);
+    pthread_rwlock_unlock(&tree_latch);
+    return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <string>
 #include <stdlib.h>
 #include <time.h>
@@ -173,6 +174,139 @@ TEST_F(DBTest, CheckInsertScan) {
 }
 
 
+// Scan with a predicate on the value suffix, a projection and a limit.
+TEST_F(DBTest, CheckFilteredScan) {
+  char input_val[120];
+  int input_size = 3000, input_val_size = 100, i;
+  std::vector<int64_t> keys;
+  std::vector< char* > values;
+  std::vector<uint16_t> val_sizes;
+  struct scan_filter_t filter = {};
+
+  // An empty tree has nothing to scan.
+  EXPECT_EQ(db_scan_filter(table_id, 1, input_size, &filter, &keys, &values, &val_sizes), 0);
+
+  // Values are "aaa...a" followed by the key in four digits.
+  memset(input_val, 'a', input_val_size);
+  for(i = 1; i <= input_size; i++) {
+    int_to_char_arr(i, &input_val[input_val_size - 4], 4);
+    db_insert(table_id, i, input_val, input_val_size);
+  }
+
+  // Keep the keys whose value ends with "2010" to "2019", and project
+  // those four digits.
+  filter.pred_offset = input_val_size - 4, filter.pred_len = 4;
+  filter.pred_low = "2010", filter.pred_high = "2019";
+  filter.proj_offset = input_val_size - 4, filter.proj_len = 8;
+  EXPECT_EQ(db_scan_filter(table_id, 1, input_size, &filter, &keys, &values, &val_sizes), 10);
+  for(i = 0; i < (int)keys.size(); i++) {
+    int_to_char_arr(2010 + i, input_val, 4);
+    EXPECT_EQ(keys[i], 2010 + i);
+    EXPECT_EQ(val_sizes[i], 4);
+    EXPECT_EQ(memcmp(values[i], input_val, 4), 0);
+    free(values[i]);
+  }
+
+  // The limit stops the scan early.
+  keys.clear(), values.clear(), val_sizes.clear();
+  filter.limit = 3;
+  EXPECT_EQ(db_scan_filter(table_id, 1, input_size, &filter, &keys, &values, &val_sizes), 3);
+  EXPECT_EQ(keys.back(), 2012);
+  for(i = 0; i < (int)values.size(); i++)
+    free(values[i]);
+}
+
+// Collect the keys found by each worker of a parallel scan.
+static void collect_parallel_scan(int worker, int64_t key, const char *,
+                                  uint16_t val_size, void * arg) {
+  std::vector<int64_t> * worker_keys = (std::vector<int64_t> *)arg;
+  EXPECT_EQ(val_size, 100);
+  worker_keys[worker].push_back(key);
+}
+
+// Scan a range with several workers and check that every key is found once.
+TEST_F(DBTest, CheckParallelScan) {
+  char input_val[120];
+  int input_size = 30000, input_val_size = 100, num_threads = 4, i, j;
+  int64_t begin = 1234, end = 28765, expected;
+  std::vector<int64_t> separators, worker_keys[4];
+
+  memset(input_val, 'a', input_val_size);
+  for(i = 1; i <= input_size; i++)
+    db_insert(table_id, i, input_val, input_val_size);
+
+  // The range is split into one part per worker.
+  EXPECT_EQ(find_range_separators(table_id, begin, end, num_threads, &separators),
+            num_threads - 1);
+
+  EXPECT_EQ(db_parallel_scan(table_id, begin, end, num_threads, collect_parallel_scan,
+                             worker_keys), end - begin + 1);
+
+  // Workers cover consecutive sub-ranges in key order.
+  expected = begin;
+  for(i = 0; i < num_threads; i++) {
+    EXPECT_FALSE(worker_keys[i].empty());
+    for(j = 0; j < (int)worker_keys[i].size(); j++)
+      EXPECT_EQ(worker_keys[i][j], expected++);
+  }
+  EXPECT_EQ(expected, end + 1);
+}
+
+// Scan backwards along the left sibling links after splits and merges.
+TEST_F(DBTest, CheckReverseScan) {
+  char input_val[120];
+  int input_size = 20000, input_val_size = 100, i;
+  int64_t expected;
+  std::vector<int64_t> keys;
+  std::vector< char* > values;
+  std::vector<uint16_t> val_sizes;
+  leaf_node * leaf;
+  pagenum_t pagenum, prev_pagenum;
+
+  memset(input_val, 'a', input_val_size);
+  for(i = 1; i <= input_size; i++) {
+    int_to_char_arr(i, &input_val[input_val_size - 5], 5);
+    db_insert(table_id, i, input_val, input_val_size);
+  }
+
+  // Delete most of the middle keys so that leaves merge.
+  for(i = 2000; i <= 18000; i++)
+    if(i % 10) {
+      EXPECT_EQ(db_delete(table_id, i), 0);
+    }
+
+  // Every right sibling points back to its left sibling.
+  prev_pagenum = 0, pagenum = find_leaf(table_id, INT64_MIN);
+  while(pagenum != 0) {
+    leaf = (leaf_node *)buffer_read_page(table_id, pagenum);
+    EXPECT_EQ(leaf->left_sibling_page_num, prev_pagenum);
+    prev_pagenum = pagenum, pagenum = leaf->right_sibling_page_num;
+    buffer_page_unlatch((struct page_t *)leaf);
+  }
+
+  // The latest ten records.
+  EXPECT_EQ(db_scan_reverse(table_id, INT64_MIN, INT64_MAX, 10, &keys, &values, &val_sizes), 10);
+  for(i = 0; i < 10; i++) {
+    int_to_char_arr(input_size - i, &input_val[input_val_size - 5], 5);
+    EXPECT_EQ(keys[i], input_size - i);
+    EXPECT_EQ(memcmp(values[i], input_val, input_val_size), 0);
+    free(values[i]);
+  }
+
+  // A range across the merged leaves, in descending order.
+  keys.clear(), values.clear(), val_sizes.clear();
+  EXPECT_EQ(db_scan_reverse(table_id, 1500, 18500, 0, &keys, &values, &val_sizes),
+            500 + 1601 + 500);
+  expected = 18500;
+  for(i = 0; i < (int)keys.size(); i++) {
+    EXPECT_EQ(keys[i], expected);
+    expected--;
+    while(expected >= 2000 && expected <= 18000 && expected % 10)
+      expected--;
+    free(values[i]);
+  }
+}
+
 // Insert and delete records with sequencial keys and check them.
 TEST_F(DBTest, CheckSequencialOrderDeletion) {
   char input_val[30010][120], output_val[3000];
@@ -205,4 +339,273 @@ TEST_F(DBTest, CheckSequencialOrderDeletion) {
         EXPECT_EQ(-1, exist);
     }
   }
-}
\ No newline at end of file
+}
+
+// Deleting a missing key fails and leaves the other records alone.
+TEST_F(DBTest, CheckMissingKeyDeletion) {
+  char input_val[100], output_val[120];
+  uint16_t output_val_size;
+  int i;
+
+  EXPECT_EQ(db_delete(table_id, 4), -1);
+  for(i = 0; i <= 8; i += 2) {
+    int_to_char_arr(i, input_val, 100);
+    EXPECT_EQ(db_insert(table_id, i, input_val, 100), 0);
+  }
+  EXPECT_EQ(db_delete(table_id, 3), -1);
+  EXPECT_EQ(db_delete(table_id, -1), -1);
+  EXPECT_EQ(db_delete(table_id, 100), -1);
+  for(i = 0; i <= 8; i += 2)
+    EXPECT_EQ(find(table_id, i, output_val, &output_val_size), 0) << "key " << i;
+}
+
+class FixedValueDBTest : public ::testing::Test {
+ protected:
+  FixedValueDBTest() {
+    init_db(10000);
+    pathname = "Fixed_DB_test.db", table_id = open_table(pathname.c_str(), 8);
+  }
+
+  ~FixedValueDBTest() {
+    if (table_id >= 0) {
+      file_close_table_file();
+      remove(pathname.c_str());
+    }
+  }
+
+  int64_t table_id;      // table id
+  std::string pathname;  // path for the file
+};
+
+// Insert, delete and scan records of a table whose leaves are dense.
+TEST_F(FixedValueDBTest, CheckDenseLeafOperations) {
+  char input_val[8], output_val[120];
+  int input_size = 20000, i, exist;
+  uint16_t output_val_size;
+  std::vector<int64_t> keys;
+  std::vector<char*> values;
+  std::vector<uint16_t> val_sizes;
+
+  ASSERT_GE(table_id, 0);
+
+  // Insert records in reverse order so that every split takes the lower half.
+  for(i = input_size; i >= 1; i--) {
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(db_insert(table_id, i, input_val, 8), 0);
+  }
+
+  // Values of another size are rejected.
+  EXPECT_EQ(db_insert(table_id, input_size + 1, input_val, 7), -1);
+
+  // Leaves use the dense layout.
+  leaf_node * leaf = (leaf_node *)buffer_read_page(table_id, find_leaf(table_id, 1));
+  EXPECT_EQ(leaf->fixed_val_size, 8);
+  EXPECT_EQ(leaf->dense_capacity, LEAF_SPACE_AMOUNT / 16);
+  buffer_page_unlatch((struct page_t *)leaf);
+
+  // Delete the odd keys.
+  for(i = 1; i <= input_size; i += 2)
+    EXPECT_EQ(db_delete(table_id, i), 0);
+
+  // Check records.
+  for(i = 1; i <= input_size; i++) {
+    exist = find(table_id, i, output_val, &output_val_size);
+    if(i % 2) {
+      EXPECT_EQ(exist, -1);
+      continue;
+    }
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(exist, 0);
+    EXPECT_EQ(output_val_size, 8);
+    EXPECT_EQ(memcmp(input_val, output_val, 8), 0);
+  }
+
+  // Scan a range that spans several leaves.
+  EXPECT_EQ(db_scan(table_id, 1001, 3000, &keys, &values, &val_sizes), 1000);
+  for(i = 0; i < (int)keys.size(); i++) {
+    EXPECT_EQ(keys[i], 1002 + i * 2);
+    free(values[i]);
+  }
+
+  // A key-only scan returns the same keys, and nothing past the last leaf.
+  keys.clear();
+  EXPECT_EQ(db_scan_keys(table_id, 1001, 3000, &keys), 1000);
+  for(i = 0; i < (int)keys.size(); i++)
+    EXPECT_EQ(keys[i], 1002 + i * 2);
+  keys.clear();
+  EXPECT_EQ(db_scan_keys(table_id, input_size - 5, INT64_MAX, &keys), 3);
+  EXPECT_EQ(db_scan_keys(table_id, input_size + 1, INT64_MAX, &keys), 0);
+}
+
+// Deleting a missing key fails and leaves the other records alone.
+TEST_F(FixedValueDBTest, CheckMissingKeyDeletion) {
+  char input_val[8], output_val[120];
+  uint16_t output_val_size;
+  int i;
+
+  ASSERT_GE(table_id, 0);
+  EXPECT_EQ(db_delete(table_id, 4), -1);
+  for(i = 0; i <= 8; i += 2) {
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(db_insert(table_id, i, input_val, 8), 0);
+  }
+  EXPECT_EQ(db_delete(table_id, 3), -1);
+  EXPECT_EQ(db_delete(table_id, -1), -1);
+  EXPECT_EQ(db_delete(table_id, 100), -1);
+  for(i = 0; i <= 8; i += 2)
+    EXPECT_EQ(find(table_id, i, output_val, &output_val_size), 0) << "key " << i;
+}
+
+// Deleting most records merges and rebalances dense leaves, down to an
+// empty tree.
+TEST_F(FixedValueDBTest, CheckDenseLeafMerges) {
+  char input_val[8], output_val[120];
+  int input_size = 20000, i, exist;
+  uint16_t output_val_size;
+  std::vector<int64_t> keys;
+  struct table_stats_t stats;
+
+  ASSERT_GE(table_id, 0);
+  for(i = 1; i <= input_size; i++) {
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(db_insert(table_id, i, input_val, 8), 0);
+  }
+
+  // Keep every tenth key, so that leaves fall far below the threshold.
+  for(i = 1; i <= input_size; i++)
+    if(i % 10) {
+      EXPECT_EQ(db_delete(table_id, i), 0);
+    }
+
+  for(i = 1; i <= input_size; i++) {
+    exist = find(table_id, i, output_val, &output_val_size);
+    if(i % 10) {
+      EXPECT_EQ(exist, -1);
+      continue;
+    }
+    int_to_char_arr(i, input_val, 8);
+    ASSERT_EQ(exist, 0) << "key " << i;
+    EXPECT_EQ(memcmp(input_val, output_val, 8), 0);
+  }
+  EXPECT_EQ(db_scan_keys(table_id, 1, input_size, &keys), input_size / 10);
+  for(i = 0; i < (int)keys.size(); i++)
+    EXPECT_EQ(keys[i], (i + 1) * 10);
+
+  // No leaf is left with 2500 free bytes or more, which 91 records of 16
+  // bytes would leave.
+  db_table_stats(table_id, &stats);
+  EXPECT_EQ(stats.num_records, input_size / 10);
+  EXPECT_LE(stats.num_leaves * 92, stats.num_records);
+
+  // Delete the rest, then use the empty table again.
+  for(i = 10; i <= input_size; i += 10)
+    EXPECT_EQ(db_delete(table_id, i), 0);
+  keys.clear();
+  EXPECT_EQ(db_scan_keys(table_id, 1, input_size, &keys), 0);
+  int_to_char_arr(1, input_val, 8);
+  EXPECT_EQ(db_insert(table_id, 1, input_val, 8), 0);
+  EXPECT_EQ(find(table_id, 1, output_val, &output_val_size), 0);
+}
+
+// Compressed dense leaves hold more keys and still find every record.
+TEST(CompressedLeafTest, CheckKeyCompression) {
+  std::string plain_path = "Plain_DB_test.db", compressed_path = "Compressed_DB_test.db";
+  int64_t plain_id, compressed_id, key, base = (int64_t)1 << 40;
+  int input_size = 20000, i;
+  char input_val[8], output_val[120];
+  uint16_t output_val_size;
+  struct table_stats_t plain_stats, compressed_stats;
+
+  init_db(10000);
+  plain_id = open_table(plain_path.c_str(), 8);
+  compressed_id = open_table(compressed_path.c_str(), 8, 1);
+  ASSERT_GE(plain_id, 0);
+  ASSERT_GE(compressed_id, 0);
+
+  // Clustered keys, plus a few outliers that need full-width keys.
+  for(i = 0; i < input_size; i++) {
+    key = i % 5000 == 4999 ? -base * (i + 1) : base + (int64_t)i * 3;
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(db_insert(plain_id, key, input_val, 8), 0);
+    EXPECT_EQ(db_insert(compressed_id, key, input_val, 8), 0);
+  }
+
+  // Delete a third of the records.
+  for(i = 0; i < input_size; i += 3) {
+    key = i % 5000 == 4999 ? -base * (i + 1) : base + (int64_t)i * 3;
+    EXPECT_EQ(db_delete(compressed_id, key), 0);
+  }
+
+  for(i = 0; i < input_size; i++) {
+    key = i % 5000 == 4999 ? -base * (i + 1) : base + (int64_t)i * 3;
+    if(i % 3 == 0) {
+      EXPECT_EQ(find(compressed_id, key, output_val, &output_val_size), -1);
+      continue;
+    }
+    int_to_char_arr(i, input_val, 8);
+    ASSERT_EQ(find(compressed_id, key, output_val, &output_val_size), 0);
+    EXPECT_EQ(memcmp(input_val, output_val, 8), 0);
+  }
+
+  // Keys take about half the bytes, so the table needs fewer leaves.
+  db_table_stats(plain_id, &plain_stats);
+  db_table_stats(compressed_id, &compressed_stats);
+  EXPECT_EQ(plain_stats.num_records, input_size);
+  EXPECT_DOUBLE_EQ(plain_stats.key_compression_ratio, 1.0);
+  EXPECT_EQ(compressed_stats.num_records, input_size - (input_size + 2) / 3);
+  EXPECT_GT(compressed_stats.key_compression_ratio, 1.9);
+  EXPECT_LT(compressed_stats.num_leaves * 3, plain_stats.num_leaves * 2);
+
+  file_close_table_file();
+  remove(plain_path.c_str());
+  remove(compressed_path.c_str());
+}
+
+// Leaves whose merged keys would need full-width keys share their records
+// instead of staying underfull.
+TEST(CompressedLeafTest, CheckWideMerge) {
+  std::string pathname = "Compressed_DB_test.db";
+  int64_t table_id, key, base = (int64_t)1 << 40;
+  int num_keys = 600, kept_low = 200, kept_high = 100, i;
+  char input_val[8], output_val[120];
+  uint16_t output_val_size;
+  std::vector<int64_t> keys;
+
+  init_db(10000);
+  table_id = open_table(pathname.c_str(), 8, 1);
+  ASSERT_GE(table_id, 0);
+
+  // Two clusters of keys that 32-bit deltas cannot cover together.
+  for(i = 0; i < num_keys; i++) {
+    int_to_char_arr(i, input_val, 8);
+    EXPECT_EQ(db_insert(table_id, i, input_val, 8), 0);
+    EXPECT_EQ(db_insert(table_id, base + i, input_val, 8), 0);
+  }
+  for(i = kept_high; i < num_keys; i++)
+    EXPECT_EQ(db_delete(table_id, base + i), 0);
+  for(i = 0; i < num_keys - kept_low; i++)
+    EXPECT_EQ(db_delete(table_id, i), 0);
+
+  for(i = 0; i < num_keys; i++) {
+    int_to_char_arr(i, input_val, 8);
+    key = i;
+    if(i < num_keys - kept_low) {
+      EXPECT_EQ(find(table_id, key, output_val, &output_val_size), -1);
+    } else {
+      ASSERT_EQ(find(table_id, key, output_val, &output_val_size), 0) << "key " << key;
+      EXPECT_EQ(memcmp(input_val, output_val, 8), 0);
+    }
+    key = base + i;
+    if(i >= kept_high) {
+      EXPECT_EQ(find(table_id, key, output_val, &output_val_size), -1);
+    } else {
+      ASSERT_EQ(find(table_id, key, output_val, &output_val_size), 0) << "key " << key;
+      EXPECT_EQ(memcmp(input_val, output_val, 8), 0);
+    }
+  }
+  ASSERT_EQ(db_scan_keys(table_id, 0, base + num_keys, &keys), kept_low + kept_high);
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+
+  file_close_table_file();
+  remove(pathname.c_str());
+}
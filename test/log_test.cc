@@ -0,0 +1,386 @@
+#include "db.h"
+#include "log.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LOG_TEST_RECORDS (2000)
+#define LOG_TEST_DELETED (500)
+#define LOG_TEST_VAL_SIZE (100)
+
+// Make a value of "key" padded with the given character.
+static void make_log_test_value(int64_t key, char pad, char * value) {
+  memset(value, pad, LOG_TEST_VAL_SIZE);
+  snprintf(value, LOG_TEST_VAL_SIZE, "%08ld", (long)key);
+  value[8] = pad;
+}
+
+class LogTest : public ::testing::Test {
+ protected:
+  LogTest() {
+    pathname = "DB_log_test.db";
+    log_pathname = "DB_log_test.log";
+    remove(pathname.c_str());
+    remove(log_pathname.c_str());
+  }
+
+  ~LogTest() {
+    remove(pathname.c_str());
+    remove(log_pathname.c_str());
+  }
+
+  // Check every record left by the crashed process.
+  void check_records(int64_t table_id) {
+    std::vector<int64_t> keys;
+    std::vector<char*> values;
+    std::vector<uint16_t> val_sizes;
+    char expected[LOG_TEST_VAL_SIZE];
+    char pad;
+
+    ASSERT_EQ(db_scan(table_id, 0, LOG_TEST_RECORDS, &keys, &values, &val_sizes),
+              LOG_TEST_RECORDS - LOG_TEST_DELETED);
+    for (int i = 0; i < (int)keys.size(); i++) {
+      ASSERT_EQ(keys[i], i);
+      // Keys 20 and 30 were updated by committed transactions, and keys 10
+      // and 50 by one that did not commit, which also deleted key 40 and
+      // inserted a deleted key.
+      pad = keys[i] == 20 || keys[i] == 30 ? 'b' : 'a';
+      make_log_test_value(keys[i], pad, expected);
+      EXPECT_EQ(memcmp(values[i], expected, LOG_TEST_VAL_SIZE), 0) << "key " << keys[i];
+      free(values[i]);
+    }
+  }
+
+  std::string pathname;
+  std::string log_pathname;
+};
+
+// Crash a process in the middle of its work and recover its tables.
+TEST_F(LogTest, CheckCrashRecovery) {
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+
+  if (pid == 0) {
+    char value[LOG_TEST_VAL_SIZE];
+    uint16_t old_val_size;
+    int loser_trx, trx_id;
+
+    // A small buffer pool writes pages back while the log grows.
+    if (init_db(64, log_pathname.c_str()) != 0)
+      _exit(1);
+    int64_t table_id = open_table(pathname.c_str());
+    for (int64_t key = 0; key < LOG_TEST_RECORDS; key++) {
+      make_log_test_value(key, 'a', value);
+      db_insert(table_id, key, value, LOG_TEST_VAL_SIZE);
+    }
+    for (int64_t key = LOG_TEST_RECORDS - LOG_TEST_DELETED; key < LOG_TEST_RECORDS; key++)
+      db_delete(table_id, key);
+
+    loser_trx = trx_begin();
+    make_log_test_value(10, 'b', value);
+    db_update(table_id, 10, value, LOG_TEST_VAL_SIZE, &old_val_size, loser_trx);
+    db_update(table_id, 50, value, LOG_TEST_VAL_SIZE / 2, &old_val_size, loser_trx);
+    db_delete(table_id, 40, loser_trx);
+    make_log_test_value(LOG_TEST_RECORDS - 1, 'b', value);
+    db_insert(table_id, LOG_TEST_RECORDS - 1, value, LOG_TEST_VAL_SIZE, loser_trx);
+
+    trx_id = trx_begin();
+    make_log_test_value(20, 'b', value);
+    db_update(table_id, 20, value, LOG_TEST_VAL_SIZE, &old_val_size, trx_id);
+    trx_commit(trx_id);
+
+    // The update that does not commit reaches the disk, and the next
+    // commit only reaches the log.
+    buffer_flush_all();
+    trx_id = trx_begin();
+    make_log_test_value(30, 'b', value);
+    db_update(table_id, 30, value, LOG_TEST_VAL_SIZE, &old_val_size, trx_id);
+    trx_commit(trx_id);
+    _exit(0);
+  }
+
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+
+  // Recover, then restart once more from the clean shutdown.
+  for (int round = 0; round < 2; round++) {
+    ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+    int64_t table_id = open_table(pathname.c_str());
+    ASSERT_GT(table_id, 0);
+    check_records(table_id);
+    shutdown_db();
+  }
+
+  // Nothing is left in the log after a clean shutdown.
+  struct stat log_stat;
+  ASSERT_EQ(stat(log_pathname.c_str(), &log_stat), 0);
+  EXPECT_EQ(log_stat.st_size, 16);
+}
+
+// Insertions and deletions without a transaction survive a crash right
+// after they return.
+TEST_F(LogTest, CheckNonTransactionalDurability) {
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+
+  if (pid == 0) {
+    char value[LOG_TEST_VAL_SIZE];
+
+    if (init_db(64, log_pathname.c_str()) != 0)
+      _exit(1);
+    int64_t table_id = open_table(pathname.c_str());
+    for (int64_t key = 0; key < 10; key++) {
+      make_log_test_value(key, 'a', value);
+      if (db_insert(table_id, key, value, LOG_TEST_VAL_SIZE) != 0)
+        _exit(1);
+    }
+    if (db_delete(table_id, 5) != 0)
+      _exit(1);
+    _exit(0);
+  }
+
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+
+  char value[LOG_TEST_VAL_SIZE], expected[LOG_TEST_VAL_SIZE];
+  uint16_t val_size;
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  int64_t table_id = open_table(pathname.c_str());
+  ASSERT_GT(table_id, 0);
+  int trx_id = trx_begin();
+  for (int64_t key = 0; key < 10; key++) {
+    if (key == 5) {
+      EXPECT_NE(db_find(table_id, key, value, &val_size, trx_id), 0);
+      continue;
+    }
+    ASSERT_EQ(db_find(table_id, key, value, &val_size, trx_id), 0) << "key " << key;
+    make_log_test_value(key, 'a', expected);
+    EXPECT_EQ(memcmp(value, expected, LOG_TEST_VAL_SIZE), 0) << "key " << key;
+  }
+  trx_commit(trx_id);
+  shutdown_db();
+}
+
+// A commit whose log cannot be written is not reported as durable, and
+// the next flush writes its records.
+TEST_F(LogTest, CheckFailedLogWrite) {
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+
+  if (pid == 0) {
+    char value[LOG_TEST_VAL_SIZE];
+    uint16_t old_val_size;
+    struct rlimit limit, saved_limit;
+    struct stat log_stat;
+    int trx_id;
+
+    // Writes past the file size limit fail with EFBIG instead of a signal.
+    signal(SIGXFSZ, SIG_IGN);
+    if (init_db(64, log_pathname.c_str()) != 0)
+      _exit(1);
+    int64_t table_id = open_table(pathname.c_str());
+    make_log_test_value(0, 'a', value);
+    if (db_insert(table_id, 0, value, LOG_TEST_VAL_SIZE) != 0)
+      _exit(1);
+
+    // The log cannot grow.
+    if (stat(log_pathname.c_str(), &log_stat) != 0 || getrlimit(RLIMIT_FSIZE, &saved_limit) != 0)
+      _exit(1);
+    limit = saved_limit;
+    limit.rlim_cur = log_stat.st_size;
+    setrlimit(RLIMIT_FSIZE, &limit);
+    trx_id = trx_begin();
+    make_log_test_value(0, 'b', value);
+    db_update(table_id, 0, value, LOG_TEST_VAL_SIZE, &old_val_size, trx_id);
+    if (trx_commit(trx_id) != -1)
+      _exit(2);
+    make_log_test_value(1, 'a', value);
+    if (db_insert(table_id, 1, value, LOG_TEST_VAL_SIZE) != -1)
+      _exit(3);
+
+    // Once the log can grow again, the next commit writes every record.
+    setrlimit(RLIMIT_FSIZE, &saved_limit);
+    trx_id = trx_begin();
+    make_log_test_value(2, 'a', value);
+    db_insert(table_id, 2, value, LOG_TEST_VAL_SIZE, trx_id);
+    if (trx_commit(trx_id) != trx_id)
+      _exit(4);
+    _exit(0);
+  }
+
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+
+  char value[LOG_TEST_VAL_SIZE], expected[LOG_TEST_VAL_SIZE];
+  uint16_t val_size;
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  int64_t table_id = open_table(pathname.c_str());
+  ASSERT_GT(table_id, 0);
+  int trx_id = trx_begin();
+  for (int64_t key = 0; key < 3; key++) {
+    ASSERT_EQ(db_find(table_id, key, value, &val_size, trx_id), 0) << "key " << key;
+    make_log_test_value(key, key == 0 ? 'b' : 'a', expected);
+    EXPECT_EQ(memcmp(value, expected, LOG_TEST_VAL_SIZE), 0) << "key " << key;
+  }
+  trx_commit(trx_id);
+  shutdown_db();
+}
+
+#define LOG_TEST_THREADS (4)
+#define LOG_TEST_INCREMENTS (200)
+
+// Increment the counter of record 0 until it has been done
+// LOG_TEST_INCREMENTS times, retrying aborted transactions.
+static void* increment_thread_func(void* arg) {
+  int64_t table_id = *(int64_t*)arg;
+  int64_t counter;
+  uint16_t val_size;
+  int i, trx_id;
+
+  for (i = 0; i < LOG_TEST_INCREMENTS; i++) {
+    do {
+      trx_id = trx_begin();
+      if (db_find_for_update(table_id, 0, (char*)&counter, &val_size, trx_id) != 0)
+        continue;
+      counter++;
+      if (db_update(table_id, 0, (char*)&counter, sizeof(counter), &val_size, trx_id) != 0)
+        continue;
+      if (trx_commit(trx_id) == trx_id)
+        break;
+    } while (true);
+  }
+  return NULL;
+}
+
+// Locks released before the commit is durable lose no committed update,
+// with or without a restart.
+TEST_F(LogTest, CheckEarlyLockRelease) {
+  pthread_t threads[LOG_TEST_THREADS];
+  int64_t counter = 0;
+  uint16_t val_size;
+  int trx_id;
+
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  int64_t table_id = open_table(pathname.c_str(), sizeof(counter));
+  ASSERT_GT(table_id, 0);
+  ASSERT_EQ(db_insert(table_id, 0, (char*)&counter, sizeof(counter)), 0);
+
+  for (int early = 0; early <= 1; early++) {
+    lock_set_early_release(early);
+    for (int i = 0; i < LOG_TEST_THREADS; i++)
+      pthread_create(&threads[i], NULL, increment_thread_func, &table_id);
+    for (int i = 0; i < LOG_TEST_THREADS; i++)
+      pthread_join(threads[i], NULL);
+  }
+  shutdown_db();
+
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  table_id = open_table(pathname.c_str(), sizeof(counter));
+  ASSERT_GT(table_id, 0);
+  trx_id = trx_begin();
+  ASSERT_EQ(db_find(table_id, 0, (char*)&counter, &val_size, trx_id), 0);
+  EXPECT_EQ(trx_commit(trx_id), trx_id);
+  EXPECT_EQ(counter, 2 * LOG_TEST_THREADS * LOG_TEST_INCREMENTS);
+  shutdown_db();
+}
+
+#define LOG_TEST_ASYNC_TRX (100)
+
+struct async_commit_state_t {
+  pthread_mutex_t latch;
+  std::vector<int> committed;
+  int aborted;
+};
+
+static void async_commit_callback(int trx_id, int result, void* arg) {
+  struct async_commit_state_t* state = (struct async_commit_state_t*)arg;
+
+  pthread_mutex_lock(&state->latch);
+  if (result == trx_id)
+    state->committed.push_back(trx_id);
+  else
+    state->aborted++;
+  pthread_mutex_unlock(&state->latch);
+}
+
+// One thread keeps many commits in flight. Each callback runs once, in
+// commit order, and every commit survives a restart.
+TEST_F(LogTest, CheckAsyncCommit) {
+  struct async_commit_state_t state;
+  char value[LOG_TEST_VAL_SIZE];
+  std::vector<int> trx_ids;
+  uint16_t old_val_size;
+  int trx_id;
+
+  pthread_mutex_init(&state.latch, NULL);
+  state.aborted = 0;
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  int64_t table_id = open_table(pathname.c_str());
+  ASSERT_GT(table_id, 0);
+  for (int64_t key = 0; key < LOG_TEST_ASYNC_TRX; key++) {
+    make_log_test_value(key, 'a', value);
+    ASSERT_EQ(db_insert(table_id, key, value, LOG_TEST_VAL_SIZE), 0);
+  }
+
+  for (int64_t key = 0; key < LOG_TEST_ASYNC_TRX; key++) {
+    trx_id = trx_begin();
+    make_log_test_value(key, 'b', value);
+    ASSERT_EQ(db_update(table_id, key, value, LOG_TEST_VAL_SIZE, &old_val_size, trx_id), 0);
+    // Every other commit is relaxed, and runs its callback right away.
+    ASSERT_EQ(trx_commit_async(trx_id, async_commit_callback, &state, key % 2), trx_id);
+    if (key % 2 == 1) {
+      pthread_mutex_lock(&state.latch);
+      EXPECT_EQ(std::count(state.committed.begin(), state.committed.end(), trx_id), 1);
+      pthread_mutex_unlock(&state.latch);
+    }
+    trx_ids.push_back(trx_id);
+  }
+
+  // A commit of an aborted transaction reports it.
+  trx_id = trx_begin();
+  trx_abort(trx_id);
+  EXPECT_EQ(trx_commit_async(trx_id, async_commit_callback, &state), 0);
+  EXPECT_EQ(state.aborted, 1);
+
+  trx_flush_commits();
+  ASSERT_EQ(state.committed.size(), LOG_TEST_ASYNC_TRX);
+  // The callbacks of the durable commits ran in commit order.
+  std::vector<int> durable_ids, callback_ids;
+  for (int i = 0; i < LOG_TEST_ASYNC_TRX; i += 2)
+    durable_ids.push_back(trx_ids[i]);
+  for (int id : state.committed)
+    if (std::find(durable_ids.begin(), durable_ids.end(), id) != durable_ids.end())
+      callback_ids.push_back(id);
+  EXPECT_EQ(callback_ids, durable_ids);
+  shutdown_db();
+
+  ASSERT_EQ(init_db(64, log_pathname.c_str()), 0);
+  table_id = open_table(pathname.c_str());
+  ASSERT_GT(table_id, 0);
+  trx_id = trx_begin();
+  for (int64_t key = 0; key < LOG_TEST_ASYNC_TRX; key++) {
+    char expected[LOG_TEST_VAL_SIZE];
+    ASSERT_EQ(db_find(table_id, key, value, &old_val_size, trx_id), 0);
+    make_log_test_value(key, 'b', expected);
+    EXPECT_EQ(memcmp(value, expected, LOG_TEST_VAL_SIZE), 0) << "key " << key;
+  }
+  EXPECT_EQ(trx_commit(trx_id), trx_id);
+  shutdown_db();
+}
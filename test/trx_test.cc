@@ -5,6 +5,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <string>
 
 #include "db.h"
@@ -166,4 +167,989 @@ TEST_F(DBTest, MultiTransactionTest) {
     for (int i = 0; i < SCAN_THREAD_NUMBER; i++) {
         pthread_join(scan_threads[i], NULL);
     }
-}
\ No newline at end of file
+}
+
+/*
+ * This thread transfers money in short transactions, retrying nothing.
+ * A transaction aborted by the deadlock policy has already been rolled back.
+ */
+void* short_transfer_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    int64_t record_ids[2];
+    int money_transferred, trx_id, i, j;
+    char temp_value[VALUE_SIZE];
+    uint16_t temp_val_size;
+
+    for (i = 0; i < TRANSFER_COUNT / 50; i++) {
+        record_ids[0] = rand() % RECORD_NUMBER;
+        record_ids[1] = rand() % RECORD_NUMBER;
+        money_transferred = rand() % MAX_MONEY_TRANSFERRED;
+
+        trx_id = trx_begin();
+        for (j = 0; j < 2; j++) {
+            if (db_find(table_id, record_ids[j], temp_value, &temp_val_size, trx_id) != 0)
+                break;
+            char_arr_sum(j == 0 ? -money_transferred : money_transferred, temp_value, VALUE_SIZE);
+            if (db_update(table_id, record_ids[j], temp_value, VALUE_SIZE, &temp_val_size, trx_id) != 0)
+                break;
+        }
+        if (j == 2)
+            trx_commit(trx_id);
+    }
+    return NULL;
+}
+
+TEST_F(DBTest, DeadlockPolicyTest) {
+    pthread_t transfer_threads[8];
+    int policies[] = { DEADLOCK_DETECT, DEADLOCK_TIMEOUT, DEADLOCK_NO_WAIT,
+                       DEADLOCK_WAIT_DIE, DEADLOCK_WOUND_WAIT };
+    char input_val[VALUE_SIZE];
+    long long sum_money;
+    uint16_t temp_val_size;
+    int trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    for (int policy : policies) {
+        ASSERT_EQ(lock_set_deadlock_policy(policy, 50), 0);
+        for (int i = 0; i < 8; i++)
+            pthread_create(&transfer_threads[i], 0, short_transfer_thread_func, &table_id);
+        for (int i = 0; i < 8; i++)
+            pthread_join(transfer_threads[i], NULL);
+
+        // Every policy keeps the total unchanged.
+        sum_money = 0;
+        trx_id = trx_begin();
+        for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+            ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+            sum_money += char_arr_to_int(input_val, VALUE_SIZE);
+        }
+        trx_commit(trx_id);
+        EXPECT_EQ(sum_money, SUM_MONEY);
+    }
+    lock_set_deadlock_policy(DEADLOCK_DETECT, 1000);
+}
+
+/*
+ * This thread reads record 0 for update, then waits for record 1 held by
+ * the main transaction, which then closes a cycle by updating record 0.
+ */
+void* victim_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    char temp_value[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int trx_id;
+    long ret;
+
+    trx_id = trx_begin();
+    ret = db_find_for_update(table_id, 0, temp_value, &temp_val_size, trx_id);
+    if (ret == 0)
+        ret = db_find_for_update(table_id, 1, temp_value, &temp_val_size, trx_id);
+    if (ret == 0)
+        trx_commit(trx_id);
+    return (void*)ret;
+}
+
+TEST_F(DBTest, DeadlockVictimTest) {
+    pthread_t victim_thread;
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    void* victim_ret;
+    int trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    // The older transaction holds many locks before the cycle appears.
+    trx_id = trx_begin();
+    for (int record_id = 1; record_id < 20; record_id++) {
+        int_to_char_array(INITIAL_MONEY + 1, input_val, VALUE_SIZE);
+        ASSERT_EQ(db_update(table_id, record_id, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    }
+    pthread_create(&victim_thread, 0, victim_thread_func, &table_id);
+    usleep(100000);
+
+    // Whichever transaction finds the cycle, the cheaper one is aborted.
+    int_to_char_array(INITIAL_MONEY + 1, input_val, VALUE_SIZE);
+    EXPECT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    pthread_join(victim_thread, &victim_ret);
+    EXPECT_NE((long)victim_ret, 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    struct lock_stats_t stats;
+    ASSERT_EQ(db_lock_stats(&stats), 0);
+    EXPECT_EQ(stats.deadlocks, 1);
+    EXPECT_EQ(stats.aborts[LOCK_ABORT_DEADLOCK], 1);
+}
+
+/*
+ * This thread reads record 0 for update and then updates it, while the
+ * main transaction still holds a shared lock on it.
+ */
+void* upgrade_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    char temp_value[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int trx_id;
+    long ret;
+
+    trx_id = trx_begin();
+    ret = db_find_for_update(table_id, 0, temp_value, &temp_val_size, trx_id);
+    if (ret == 0) {
+        char_arr_sum(1, temp_value, VALUE_SIZE);
+        ret = db_update(table_id, 0, temp_value, VALUE_SIZE, &temp_val_size, trx_id);
+    }
+    if (ret == 0)
+        trx_commit(trx_id);
+    return (void*)ret;
+}
+
+TEST_F(DBTest, LockUpgradeTest) {
+    pthread_t upgrade_thread;
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    void* upgrade_ret;
+    int trx_id, other_trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    // The upgrade waits for the other reader instead of aborting.
+    trx_id = trx_begin();
+    ASSERT_NE(lock_acquire(table_id, 0, 0, trx_id, LOCK_SHARED), nullptr);
+    pthread_create(&upgrade_thread, 0, upgrade_thread_func, &table_id);
+    usleep(100000);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    pthread_join(upgrade_thread, &upgrade_ret);
+    EXPECT_EQ((long)upgrade_ret, 0);
+
+    // An update lock lets readers in and is upgraded once they leave.
+    trx_id = trx_begin();
+    other_trx_id = trx_begin();
+    ASSERT_EQ(db_find_for_update(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    char_arr_sum(1, input_val, VALUE_SIZE);
+    EXPECT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+TEST_F(DBTest, FastPathLockTest) {
+    char input_val[VALUE_SIZE];
+    lock_t *lock_obj;
+    int trx_id, other_trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    // Requests that cannot be granted at once abort, so every conflict shows.
+    ASSERT_EQ(lock_set_deadlock_policy(DEADLOCK_NO_WAIT, 1000), 0);
+    for (int fast_path = 1; fast_path >= 0; fast_path--) {
+        lock_set_fast_path(fast_path);
+
+        // A lock is upgraded in place, and the upgraded mode holds off others.
+        trx_id = trx_begin();
+        lock_obj = lock_acquire(table_id, 0, 5, trx_id, LOCK_SHARED);
+        ASSERT_NE(lock_obj, nullptr);
+        EXPECT_EQ(lock_acquire(table_id, 0, 5, trx_id, LOCK_SHARED), lock_obj);
+        EXPECT_EQ(lock_acquire(table_id, 0, 5, trx_id, LOCK_EXCLUSIVE), lock_obj);
+        other_trx_id = trx_begin();
+        EXPECT_EQ(lock_acquire(table_id, 0, 5, other_trx_id, LOCK_SHARED), nullptr);
+        EXPECT_NE(trx_find(other_trx_id), 0);
+        EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+        // Readers share a record, and an upgrade still sees the other reader.
+        trx_id = trx_begin();
+        other_trx_id = trx_begin();
+        ASSERT_NE(lock_acquire(table_id, 0, 6, trx_id, LOCK_SHARED), nullptr);
+        ASSERT_NE(lock_acquire(table_id, 0, 6, other_trx_id, LOCK_SHARED), nullptr);
+        EXPECT_EQ(lock_acquire(table_id, 0, 6, other_trx_id, LOCK_EXCLUSIVE), nullptr);
+        EXPECT_NE(lock_acquire(table_id, 0, 6, trx_id, LOCK_EXCLUSIVE), nullptr);
+        EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+        // Released locks leave nothing behind.
+        trx_id = trx_begin();
+        EXPECT_NE(lock_acquire(table_id, 0, 5, trx_id, LOCK_EXCLUSIVE), nullptr);
+        EXPECT_NE(lock_acquire(table_id, 0, 6, trx_id, LOCK_EXCLUSIVE), nullptr);
+        EXPECT_EQ(trx_commit(trx_id), trx_id);
+    }
+    lock_set_fast_path(1);
+    lock_set_deadlock_policy(DEADLOCK_DETECT, 1000);
+}
+
+/*
+ * This thread locks record 3, which the main transaction holds, and
+ * commits once it gets it.
+ */
+void* lock_wait_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    int trx_id;
+
+    trx_id = trx_begin();
+    if (lock_acquire(table_id, 0, 3, trx_id, LOCK_EXCLUSIVE) == NULL)
+        return (void*)-1;
+    trx_commit(trx_id);
+    return NULL;
+}
+
+TEST_F(DBTest, LockStatsTest) {
+    std::vector<struct lock_key_stats_t> keys;
+    struct lock_stats_t stats;
+    pthread_t wait_thread;
+    void* wait_ret;
+    int trx_id, other_trx_id;
+
+    ASSERT_EQ(db_lock_stats(&stats), 0);
+    EXPECT_EQ(stats.waits, 0);
+    EXPECT_EQ(db_lock_hot_keys(10, &keys), 0);
+
+    // A wait is counted with its record and the queue it waited in.
+    trx_id = trx_begin();
+    ASSERT_NE(lock_acquire(table_id, 0, 3, trx_id, LOCK_EXCLUSIVE), nullptr);
+    pthread_create(&wait_thread, 0, lock_wait_thread_func, &table_id);
+    usleep(100000);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    pthread_join(wait_thread, &wait_ret);
+    EXPECT_EQ((long)wait_ret, 0);
+
+    ASSERT_EQ(db_lock_stats(&stats), 0);
+    EXPECT_EQ(stats.waits, 1);
+    EXPECT_GE(stats.wait_us, 50000);
+    EXPECT_GE(stats.max_queue_length, 2);
+    EXPECT_GT(stats.latch_acquires, 0);
+    ASSERT_EQ(db_lock_hot_keys(10, &keys), 1);
+    EXPECT_EQ(keys[0].table_id, table_id);
+    EXPECT_EQ(keys[0].key, 3);
+    EXPECT_EQ(keys[0].level, LOCK_LEVEL_RECORD);
+    EXPECT_EQ(keys[0].waits, 1);
+    EXPECT_EQ(keys[0].max_wait_us, keys[0].wait_us);
+    EXPECT_EQ(keys[0].max_queue_length, 2);
+    uint64_t binned = 0;
+    for (int bin = 0; bin < LOCK_WAIT_BIN_NUMBER; bin++)
+        binned += keys[0].wait_histogram[bin];
+    EXPECT_EQ(binned, 1);
+
+    // Aborts are counted by cause: a failed upgrade apart from a plain
+    // conflict.
+    ASSERT_EQ(lock_set_deadlock_policy(DEADLOCK_NO_WAIT, 1000), 0);
+    trx_id = trx_begin();
+    other_trx_id = trx_begin();
+    ASSERT_NE(lock_acquire(table_id, 0, 4, trx_id, LOCK_SHARED), nullptr);
+    ASSERT_NE(lock_acquire(table_id, 0, 4, other_trx_id, LOCK_SHARED), nullptr);
+    EXPECT_EQ(lock_acquire(table_id, 0, 4, other_trx_id, LOCK_EXCLUSIVE), nullptr);
+    other_trx_id = trx_begin();
+    EXPECT_EQ(lock_acquire(table_id, 0, 4, other_trx_id, LOCK_EXCLUSIVE), nullptr);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    lock_set_deadlock_policy(DEADLOCK_DETECT, 1000);
+
+    ASSERT_EQ(db_lock_stats(&stats), 0);
+    EXPECT_EQ(stats.aborts[LOCK_ABORT_UPGRADE], 1);
+    EXPECT_EQ(stats.aborts[LOCK_ABORT_NO_WAIT], 1);
+    EXPECT_EQ(stats.aborts[LOCK_ABORT_DEADLOCK], 0);
+    EXPECT_EQ(stats.deadlocks, 0);
+}
+
+TEST_F(DBTest, SnapshotReadTest) {
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int reader_trx_id, writer_trx_id, trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+    reader_trx_id = trx_begin();
+
+    // A committed update is not visible to an older snapshot.
+    writer_trx_id = trx_begin();
+    int_to_char_array(INITIAL_MONEY + 1, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, writer_trx_id), 0);
+    EXPECT_EQ(trx_commit(writer_trx_id), writer_trx_id);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+
+    // A reader does not wait for an uncommitted update, nor see it.
+    writer_trx_id = trx_begin();
+    int_to_char_array(INITIAL_MONEY + 2, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, writer_trx_id), 0);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, writer_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 2);
+
+    // An aborted update leaves the committed value.
+    trx_abort(writer_trx_id);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    // The old snapshot cannot update a record updated after it started.
+    int_to_char_array(INITIAL_MONEY + 3, input_val, VALUE_SIZE);
+    EXPECT_NE(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(trx_commit(reader_trx_id), 0);
+
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+TEST_F(DBTest, TransactionalInsertDeleteTest) {
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int reader_trx_id, writer_trx_id, trx_id;
+    std::vector<int64_t> keys;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+    reader_trx_id = trx_begin();
+
+    // Uncommitted changes are seen only by their own transaction.
+    writer_trx_id = trx_begin();
+    int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_insert(table_id, RECORD_NUMBER, input_val, VALUE_SIZE, writer_trx_id), 0);
+    EXPECT_NE(db_insert(table_id, RECORD_NUMBER, input_val, VALUE_SIZE, writer_trx_id), 0);
+    ASSERT_EQ(db_delete(table_id, 0, writer_trx_id), 0);
+    EXPECT_EQ(db_find(table_id, RECORD_NUMBER, input_val, &temp_val_size, writer_trx_id), 0);
+    EXPECT_NE(db_find(table_id, 0, input_val, &temp_val_size, writer_trx_id), 0);
+    EXPECT_NE(db_find(table_id, RECORD_NUMBER, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(db_find(table_id, 0, input_val, &temp_val_size, reader_trx_id), 0);
+
+    // An abort removes the insertion and restores the deleted record.
+    trx_abort(writer_trx_id);
+    db_scan_keys(table_id, 0, RECORD_NUMBER, &keys);
+    EXPECT_EQ(keys.size(), RECORD_NUMBER);
+    EXPECT_EQ(keys.front(), 0);
+
+    // Deleting and inserting a record again is an update.
+    writer_trx_id = trx_begin();
+    ASSERT_EQ(db_delete(table_id, 1, writer_trx_id), 0);
+    int_to_char_array(INITIAL_MONEY + 1, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_insert(table_id, 1, input_val, VALUE_SIZE, writer_trx_id), 0);
+    trx_abort(writer_trx_id);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 1, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    // Committed changes are not seen by an older snapshot.
+    writer_trx_id = trx_begin();
+    int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_insert(table_id, RECORD_NUMBER, input_val, VALUE_SIZE, writer_trx_id), 0);
+    ASSERT_EQ(db_delete(table_id, 0, writer_trx_id), 0);
+    EXPECT_EQ(trx_commit(writer_trx_id), writer_trx_id);
+    EXPECT_NE(db_find(table_id, RECORD_NUMBER, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(db_find(table_id, 0, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(trx_commit(reader_trx_id), reader_trx_id);
+
+    trx_id = trx_begin();
+    EXPECT_EQ(db_find(table_id, RECORD_NUMBER, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_NE(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+TEST_F(DBTest, FailedInsertTest) {
+    std::string fixed_path = "DB_fixed_trx_test.db";
+    int64_t fixed_id, value = INITIAL_MONEY, wrong_value[2] = {};
+    uint16_t val_size;
+    int trx_id, old_trx_id;
+
+    remove(fixed_path.c_str());
+    fixed_id = open_table(fixed_path.c_str(), sizeof(value));
+    ASSERT_GT(fixed_id, 0);
+    ASSERT_EQ(db_insert(fixed_id, 0, (char*)&value, sizeof(value)), 0);
+
+    // An insertion of a value of the wrong size fails without changing the
+    // record, so a commit does not conflict with older snapshots.
+    old_trx_id = trx_begin();
+    trx_id = trx_begin();
+    EXPECT_NE(db_insert(fixed_id, 1, (char*)wrong_value, sizeof(wrong_value), trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    EXPECT_EQ(db_insert(fixed_id, 1, (char*)&value, sizeof(value), old_trx_id), 0);
+    EXPECT_EQ(trx_commit(old_trx_id), old_trx_id);
+
+    // Nor does it turn a deletion into an update, so an abort restores
+    // the deleted record.
+    trx_id = trx_begin();
+    ASSERT_EQ(db_delete(fixed_id, 0, trx_id), 0);
+    EXPECT_NE(db_insert(fixed_id, 0, (char*)wrong_value, sizeof(wrong_value), trx_id), 0);
+    trx_abort(trx_id);
+    trx_id = trx_begin();
+    value = 0;
+    ASSERT_EQ(db_find(fixed_id, 0, (char*)&value, &val_size, trx_id), 0);
+    EXPECT_EQ(value, INITIAL_MONEY);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    remove(fixed_path.c_str());
+}
+
+// Check that each of the first num_records records holds the value given
+// by its key, of the size given by its key.
+static void check_undo_test_records(int64_t table_id, int num_records) {
+    char expected[VALUE_SIZE], value[MAX_VAL_SIZE];
+    uint16_t val_size;
+    int trx_id = trx_begin();
+
+    for (int record_id = 0; record_id < num_records; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, value, &val_size, trx_id), 0) << "key " << record_id;
+        ASSERT_EQ(val_size, 40 + record_id % 40) << "key " << record_id;
+        int_to_char_array(record_id, expected, val_size);
+        EXPECT_EQ(memcmp(value, expected, val_size), 0) << "key " << record_id;
+    }
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+TEST_F(DBTest, UndoLogTest) {
+    const int num_records = 2000;
+    char input_val[MAX_VAL_SIZE];
+    uint16_t temp_val_size;
+    int trx_id, reader_trx_id;
+    std::vector<int64_t> keys;
+
+    for (int record_id = 0; record_id < num_records; record_id++) {
+        int_to_char_array(record_id, input_val, 40 + record_id % 40);
+        ASSERT_EQ(db_insert(table_id, record_id, input_val, 40 + record_id % 40), 0);
+    }
+
+    // Updates in place, of values that grow and shrink, repeated updates,
+    // insertions and deletions are all undone.
+    for (int round = 0; round < 2; round++) {
+        trx_id = trx_begin();
+        for (int record_id = 0; record_id < num_records; record_id += 3) {
+            memset(input_val, 'x', MAX_VAL_SIZE);
+            ASSERT_EQ(db_update(table_id, record_id, input_val, 40 + record_id % 40,
+                                &temp_val_size, trx_id), 0);
+        }
+        for (int record_id = 1; record_id < num_records; record_id += 30) {
+            memset(input_val, 'y', MAX_VAL_SIZE);
+            ASSERT_EQ(db_update(table_id, record_id, input_val, MAX_VAL_SIZE, &temp_val_size, trx_id), 0);
+            EXPECT_EQ(temp_val_size, 40 + record_id % 40);
+            ASSERT_EQ(db_update(table_id, record_id, input_val, 10, &temp_val_size, trx_id), 0);
+            EXPECT_EQ(temp_val_size, MAX_VAL_SIZE);
+            ASSERT_EQ(db_update(table_id, record_id, input_val, 10, &temp_val_size, trx_id), 0);
+        }
+        for (int record_id = 2; record_id < num_records; record_id += 30) {
+            ASSERT_EQ(db_delete(table_id, record_id, trx_id), 0);
+            ASSERT_EQ(db_insert(table_id, record_id, input_val, 60, trx_id), 0);
+            ASSERT_EQ(db_update(table_id, record_id, input_val, 70, &temp_val_size, trx_id), 0);
+        }
+        for (int record_id = 5; record_id < num_records; record_id += 30)
+            ASSERT_EQ(db_delete(table_id, record_id, trx_id), 0);
+        for (int record_id = num_records; record_id < num_records + 100; record_id++)
+            ASSERT_EQ(db_insert(table_id, record_id, input_val, 50, trx_id), 0);
+        EXPECT_NE(db_update(table_id, 0, input_val, MAX_VAL_SIZE + 1, &temp_val_size, trx_id), 0);
+
+        // In the second round, leaves split and merge before the abort, so
+        // the leaves the changes were made in no longer hold them.
+        if (round == 1) {
+            for (int record_id = 0; record_id < num_records; record_id += 2) {
+                int_to_char_array(record_id, input_val, MAX_VAL_SIZE);
+                ASSERT_EQ(db_insert(table_id, -1 - record_id, input_val, MAX_VAL_SIZE), 0);
+            }
+            for (int record_id = 0; record_id < num_records; record_id += 2)
+                ASSERT_EQ(db_delete(table_id, -1 - record_id), 0);
+        }
+
+        trx_abort(trx_id);
+        check_undo_test_records(table_id, num_records);
+        keys.clear();
+        db_scan_keys(table_id, -num_records, num_records * 2, &keys);
+        EXPECT_EQ(keys.size(), num_records);
+    }
+
+    // A committed value of another size is seen by later snapshots only.
+    reader_trx_id = trx_begin();
+    trx_id = trx_begin();
+    memset(input_val, 'z', MAX_VAL_SIZE);
+    ASSERT_EQ(db_update(table_id, 1, input_val, MAX_VAL_SIZE, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    ASSERT_EQ(db_find(table_id, 1, input_val, &temp_val_size, reader_trx_id), 0);
+    EXPECT_EQ(temp_val_size, 41);
+    EXPECT_EQ(trx_commit(reader_trx_id), reader_trx_id);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 1, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(temp_val_size, MAX_VAL_SIZE);
+    EXPECT_EQ(input_val[MAX_VAL_SIZE - 1], 'z');
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+/*
+ * This thread inserts records of its own keys in short transactions, and
+ * aborts every third one.
+ */
+void* insert_thread_func(void* arg) {
+    int64_t base_key = *(int64_t*)arg;
+    char temp_value[VALUE_SIZE];
+    int trx_id, i, j;
+
+    int_to_char_array(0, temp_value, VALUE_SIZE);
+    for (i = 0; i < 30; i++) {
+        trx_id = trx_begin();
+        for (j = 0; j < 10; j++)
+            if (db_insert(TABLE_ID, base_key + i * 10 + j, temp_value, VALUE_SIZE, trx_id) != 0)
+                return (void*)-1L;
+        if (i % 3 == 2)
+            trx_abort(trx_id);
+        else
+            trx_commit(trx_id);
+    }
+    return NULL;
+}
+
+TEST_F(DBTest, ConcurrentInsertUpdateTest) {
+    pthread_t transfer_threads[4], insert_threads[4];
+    int64_t base_keys[4];
+    char input_val[VALUE_SIZE];
+    long long sum_money;
+    uint16_t temp_val_size;
+    void* insert_ret;
+    std::vector<int64_t> keys;
+    int trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    // Insertions split the leaves that the transfers update.
+    for (int i = 0; i < 4; i++) {
+        base_keys[i] = RECORD_NUMBER + i * 1000;
+        pthread_create(&insert_threads[i], 0, insert_thread_func, &base_keys[i]);
+        pthread_create(&transfer_threads[i], 0, short_transfer_thread_func, &table_id);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(insert_threads[i], &insert_ret);
+        EXPECT_EQ((long)insert_ret, 0);
+        pthread_join(transfer_threads[i], NULL);
+    }
+
+    // Only the committed insertions are left.
+    db_scan_keys(table_id, RECORD_NUMBER, RECORD_NUMBER + 4000, &keys);
+    EXPECT_EQ(keys.size(), 4 * 200);
+
+    sum_money = 0;
+    trx_id = trx_begin();
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        sum_money += char_arr_to_int(input_val, VALUE_SIZE);
+    }
+    trx_commit(trx_id);
+    EXPECT_EQ(sum_money, SUM_MONEY);
+}
+
+TEST_F(DBTest, LockEscalationTest) {
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    std::vector<int64_t> keys;
+    std::vector<char*> values;
+    std::vector<uint16_t> val_sizes;
+    int trx_id, other_trx_id;
+
+    for (int record_id = 0; record_id < 4 * RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+    ASSERT_EQ(lock_set_escalation_threshold(64, 1024), 0);
+    ASSERT_EQ(lock_set_deadlock_policy(DEADLOCK_NO_WAIT, 1000), 0);
+
+    // Updating most of a block locks the whole block, and the records
+    // updated after the escalation are still rolled back.
+    trx_id = trx_begin();
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        char_arr_sum(1, input_val, VALUE_SIZE);
+        ASSERT_EQ(db_update(table_id, record_id, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    }
+    other_trx_id = trx_begin();
+    EXPECT_NE(db_find_for_update(table_id, (1 << LOCK_BLOCK_SHIFT) - 1, input_val, &temp_val_size, other_trx_id), 0);
+    other_trx_id = trx_begin();
+    EXPECT_EQ(db_find_for_update(table_id, 1 << LOCK_BLOCK_SHIFT, input_val, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    trx_abort(trx_id);
+
+    trx_id = trx_begin();
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    }
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    // A scan locks the blocks of its range, keys not inserted yet included.
+    ASSERT_EQ(db_delete(table_id, 50), 0);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_scan(table_id, 0, RECORD_NUMBER - 1, &keys, &values, &val_sizes, trx_id), RECORD_NUMBER - 1);
+    other_trx_id = trx_begin();
+    EXPECT_NE(db_insert(table_id, 50, input_val, VALUE_SIZE, other_trx_id), 0);
+    other_trx_id = trx_begin();
+    EXPECT_NE(db_delete(table_id, 10, other_trx_id), 0);
+    other_trx_id = trx_begin();
+    EXPECT_EQ(db_delete(table_id, 3 * RECORD_NUMBER, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    other_trx_id = trx_begin();
+    EXPECT_EQ(db_insert(table_id, 50, input_val, VALUE_SIZE, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+
+    // A range of too many blocks locks the table.
+    trx_id = trx_begin();
+    ASSERT_GE(db_scan(table_id, 0, 1 << 20, &keys, &values, &val_sizes, trx_id), 0);
+    other_trx_id = trx_begin();
+    EXPECT_NE(db_find_for_update(table_id, 2 << 20, input_val, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    for (int i = 0; i < (int)values.size(); i++)
+        free(values[i]);
+
+    lock_set_deadlock_policy(DEADLOCK_DETECT, 1000);
+}
+
+/*
+ * This thread moves money from the first half of the accounts to the other
+ * half in one transaction, escalating its locks on the way.
+ */
+void* batch_transfer_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    char temp_value[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int trx_id, i, record_id;
+
+    for (i = 0; i < 20; i++) {
+        trx_id = trx_begin();
+        for (record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+            if (db_find(table_id, record_id, temp_value, &temp_val_size, trx_id) != 0)
+                break;
+            char_arr_sum(record_id < RECORD_NUMBER / 2 ? -1 : 1, temp_value, VALUE_SIZE);
+            if (db_update(table_id, record_id, temp_value, VALUE_SIZE, &temp_val_size, trx_id) != 0)
+                break;
+        }
+        if (record_id == RECORD_NUMBER)
+            trx_commit(trx_id);
+    }
+    return NULL;
+}
+
+/*
+ * This thread sums the accounts with locking scans, which see no
+ * uncommitted updates.
+ */
+void* locking_scan_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    std::vector<int64_t> keys;
+    std::vector<char*> values;
+    std::vector<uint16_t> val_sizes;
+    long long sum_money;
+    int trx_id, i, j;
+
+    for (i = 0; i < 50; i++) {
+        keys.clear(), values.clear(), val_sizes.clear();
+        trx_id = trx_begin();
+        if (db_scan(table_id, 0, RECORD_NUMBER - 1, &keys, &values, &val_sizes, trx_id) < 0)
+            continue;
+        sum_money = 0;
+        for (j = 0; j < (int)values.size(); j++) {
+            sum_money += char_arr_to_int(values[j], VALUE_SIZE);
+            free(values[j]);
+        }
+        EXPECT_EQ(keys.size(), RECORD_NUMBER);
+        EXPECT_EQ(sum_money, SUM_MONEY);
+        trx_commit(trx_id);
+    }
+    return NULL;
+}
+
+TEST_F(DBTest, ConcurrentEscalationTest) {
+    pthread_t transfer_threads[4], batch_threads[2], scan_thread;
+    char input_val[VALUE_SIZE];
+    long long sum_money;
+    uint16_t temp_val_size;
+    int trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+    ASSERT_EQ(lock_set_escalation_threshold(16, 64), 0);
+
+    for (int i = 0; i < 4; i++)
+        pthread_create(&transfer_threads[i], 0, short_transfer_thread_func, &table_id);
+    for (int i = 0; i < 2; i++)
+        pthread_create(&batch_threads[i], 0, batch_transfer_thread_func, &table_id);
+    pthread_create(&scan_thread, 0, locking_scan_thread_func, &table_id);
+    for (int i = 0; i < 4; i++)
+        pthread_join(transfer_threads[i], NULL);
+    for (int i = 0; i < 2; i++)
+        pthread_join(batch_threads[i], NULL);
+    pthread_join(scan_thread, NULL);
+
+    sum_money = 0;
+    trx_id = trx_begin();
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        sum_money += char_arr_to_int(input_val, VALUE_SIZE);
+    }
+    trx_commit(trx_id);
+    EXPECT_EQ(sum_money, SUM_MONEY);
+
+    lock_set_escalation_threshold(64, 1024);
+}
+
+/*
+ * This thread begins and commits empty transactions, keeping their ids.
+ */
+void* begin_commit_thread_func(void* arg) {
+    std::vector<int>* trx_ids = (std::vector<int>*)arg;
+    int trx_id, i;
+
+    for (i = 0; i < 1000; i++) {
+        trx_id = trx_begin();
+        if (trx_find(trx_id) != 0 || trx_commit(trx_id) != trx_id)
+            break;
+        trx_ids->push_back(trx_id);
+    }
+    return NULL;
+}
+
+// Commit a transaction begun by another thread.
+void* commit_thread_func(void* arg) {
+    int trx_id = *(int*)arg;
+    return (void*)(long)trx_commit(trx_id);
+}
+
+TEST_F(DBTest, TransactionTableTest) {
+    pthread_t threads[8], commit_thread;
+    std::vector<int> trx_ids[8], all_ids;
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    void* commit_ret;
+    int trx_id;
+
+    int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+    db_insert(table_id, 0, input_val, VALUE_SIZE);
+
+    // Transactions begin and end on many threads at once with unique ids.
+    for (int i = 0; i < 8; i++)
+        pthread_create(&threads[i], 0, begin_commit_thread_func, &trx_ids[i]);
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        EXPECT_EQ(trx_ids[i].size(), 1000);
+        all_ids.insert(all_ids.end(), trx_ids[i].begin(), trx_ids[i].end());
+    }
+    std::sort(all_ids.begin(), all_ids.end());
+    EXPECT_EQ(std::unique(all_ids.begin(), all_ids.end()), all_ids.end());
+    for (int i = 0; i < (int)all_ids.size(); i += 97)
+        EXPECT_EQ(trx_find(all_ids[i]), -1);
+
+    // A transaction ended by another thread is gone for the thread that
+    // began it, too.
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    pthread_create(&commit_thread, 0, commit_thread_func, &trx_id);
+    pthread_join(commit_thread, &commit_ret);
+    EXPECT_EQ((long)commit_ret, trx_id);
+    EXPECT_EQ(trx_find(trx_id), -1);
+    EXPECT_NE(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), 0);
+
+    // Nor is the id 0 a transaction once the last one of this thread ended,
+    // and the next one holds no lock of it.
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    EXPECT_EQ(trx_find(0), -1);
+    EXPECT_NE(db_find(table_id, 0, input_val, &temp_val_size, 0), 0);
+    int_to_char_array(INITIAL_MONEY + 1, input_val, VALUE_SIZE);
+    EXPECT_NE(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, 0), 0);
+
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    ASSERT_EQ(lock_set_deadlock_policy(DEADLOCK_NO_WAIT, 1000), 0);
+    int other_trx_id = trx_begin();
+    EXPECT_NE(lock_acquire(table_id, 0, 0, other_trx_id, LOCK_EXCLUSIVE), nullptr);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    lock_set_deadlock_policy(DEADLOCK_DETECT, 1000);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+TEST_F(DBTest, ReadOnlyTransactionTest) {
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    std::vector<int64_t> keys;
+    std::vector<char*> values;
+    std::vector<uint16_t> val_sizes;
+    int readonly_trx_id, trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+    readonly_trx_id = trx_begin_readonly();
+
+    // It reads its snapshot without waiting for writers.
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find_for_update(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    char_arr_sum(1, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, readonly_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, readonly_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+
+    // Writes and locking reads are rejected, and the trx stays alive.
+    EXPECT_NE(db_update(table_id, 1, input_val, VALUE_SIZE, &temp_val_size, readonly_trx_id), 0);
+    EXPECT_NE(db_find_for_update(table_id, 1, input_val, &temp_val_size, readonly_trx_id), 0);
+    EXPECT_NE(db_insert(table_id, RECORD_NUMBER, input_val, VALUE_SIZE, readonly_trx_id), 0);
+    EXPECT_NE(db_delete(table_id, 1, readonly_trx_id), 0);
+    EXPECT_LT(db_scan(table_id, 0, RECORD_NUMBER, &keys, &values, &val_sizes, readonly_trx_id), 0);
+    EXPECT_EQ(trx_find(readonly_trx_id), 0);
+    ASSERT_EQ(db_find(table_id, 1, input_val, &temp_val_size, readonly_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, RECORD_NUMBER, input_val, &temp_val_size, trx_id), -1);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    EXPECT_EQ(trx_commit(readonly_trx_id), readonly_trx_id);
+    EXPECT_EQ(trx_find(readonly_trx_id), -1);
+}
+
+TEST_F(DBTest, OptimisticTransactionTest) {
+    char input_val[VALUE_SIZE];
+    uint16_t temp_val_size;
+    int trx_id, other_trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    // Updates are seen by their own trx only, until it commits.
+    trx_id = trx_begin_optimistic();
+    ASSERT_EQ(db_find_for_update(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    char_arr_sum(1, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_update(table_id, 0, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    other_trx_id = trx_begin();
+    ASSERT_EQ(db_find_for_update(table_id, 0, input_val, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    EXPECT_NE(db_insert(table_id, RECORD_NUMBER, input_val, VALUE_SIZE, trx_id), 0);
+    EXPECT_NE(db_delete(table_id, 1, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    trx_id = trx_begin();
+    ASSERT_EQ(db_find(table_id, 0, input_val, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY + 1);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+
+    // A record read was changed by a later commit.
+    trx_id = trx_begin_optimistic();
+    ASSERT_EQ(db_find(table_id, 1, input_val, &temp_val_size, trx_id), 0);
+    other_trx_id = trx_begin();
+    ASSERT_EQ(db_update(table_id, 1, input_val, VALUE_SIZE, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+    char_arr_sum(1, input_val, VALUE_SIZE);
+    ASSERT_EQ(db_update(table_id, 2, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), 0);
+
+    // Two updates of the same record: the first commit wins.
+    trx_id = trx_begin_optimistic();
+    other_trx_id = trx_begin_optimistic();
+    ASSERT_EQ(db_update(table_id, 3, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    ASSERT_EQ(db_update(table_id, 3, input_val, VALUE_SIZE, &temp_val_size, other_trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+    EXPECT_EQ(trx_commit(other_trx_id), 0);
+
+    // A record read is being updated by a locking trx.
+    other_trx_id = trx_begin();
+    ASSERT_EQ(db_update(table_id, 4, input_val, VALUE_SIZE, &temp_val_size, other_trx_id), 0);
+    trx_id = trx_begin_optimistic();
+    ASSERT_EQ(db_find(table_id, 4, input_val, &temp_val_size, trx_id), 0);
+    ASSERT_EQ(db_update(table_id, 5, input_val, VALUE_SIZE, &temp_val_size, trx_id), 0);
+    EXPECT_EQ(trx_commit(trx_id), 0);
+    EXPECT_EQ(trx_commit(other_trx_id), other_trx_id);
+
+    trx_id = trx_begin();
+    for (int record_id = 2; record_id <= 5; record_id += 3) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        EXPECT_EQ(char_arr_to_int(input_val, VALUE_SIZE), INITIAL_MONEY);
+    }
+    EXPECT_EQ(trx_commit(trx_id), trx_id);
+}
+
+/*
+ * This thread transfers money in optimistic transactions, retrying the
+ * ones whose commit fails.
+ */
+void* optimistic_transfer_thread_func(void* arg) {
+    int64_t table_id = *(int64_t*)arg;
+    int64_t record_ids[2];
+    int money_transferred, trx_id, i, j;
+    char temp_value[VALUE_SIZE];
+    uint16_t temp_val_size;
+
+    for (i = 0; i < TRANSFER_COUNT / 50; i++) {
+        record_ids[0] = rand() % RECORD_NUMBER;
+        record_ids[1] = rand() % RECORD_NUMBER;
+        money_transferred = rand() % MAX_MONEY_TRANSFERRED;
+
+        do {
+            trx_id = trx_begin_optimistic();
+            for (j = 0; j < 2; j++) {
+                if (db_find(table_id, record_ids[j], temp_value, &temp_val_size, trx_id) != 0)
+                    return (void*)-1L;
+                char_arr_sum(j == 0 ? -money_transferred : money_transferred, temp_value, VALUE_SIZE);
+                if (db_update(table_id, record_ids[j], temp_value, VALUE_SIZE, &temp_val_size, trx_id) != 0)
+                    return (void*)-1L;
+            }
+        } while (trx_commit(trx_id) != trx_id);
+    }
+    return NULL;
+}
+
+TEST_F(DBTest, ConcurrentOptimisticTest) {
+    pthread_t optimistic_threads[4], transfer_threads[4];
+    char input_val[VALUE_SIZE];
+    long long sum_money;
+    uint16_t temp_val_size;
+    void* thread_ret;
+    int trx_id;
+
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        int_to_char_array(INITIAL_MONEY, input_val, VALUE_SIZE);
+        db_insert(table_id, record_id, input_val, VALUE_SIZE);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&optimistic_threads[i], 0, optimistic_transfer_thread_func, &table_id);
+        pthread_create(&transfer_threads[i], 0, short_transfer_thread_func, &table_id);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(optimistic_threads[i], &thread_ret);
+        EXPECT_EQ((long)thread_ret, 0);
+        pthread_join(transfer_threads[i], NULL);
+    }
+
+    sum_money = 0;
+    trx_id = trx_begin();
+    for (int record_id = 0; record_id < RECORD_NUMBER; record_id++) {
+        ASSERT_EQ(db_find(table_id, record_id, input_val, &temp_val_size, trx_id), 0);
+        sum_money += char_arr_to_int(input_val, VALUE_SIZE);
+    }
+    trx_commit(trx_id);
+    EXPECT_EQ(sum_money, SUM_MONEY);
+}